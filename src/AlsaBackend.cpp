@@ -27,15 +27,25 @@
 #include <getopt.h>
 #include <signal.h>
 
+#include "LogControl.hpp"
+#include "ThreadPolicy.hpp"
 #include "XenStore.hpp"
 
 using std::cout;
 using std::endl;
 using std::exception;
+using std::lock_guard;
+using std::mutex;
 using std::runtime_error;
+using std::set;
 using std::shared_ptr;
+using std::stoi;
+using std::stol;
+using std::stoul;
 using std::string;
+using std::thread;
 using std::to_string;
+using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 
@@ -46,19 +56,87 @@ using XenBackend::XenStore;
 
 unique_ptr<AlsaBackend> alsaBackend;
 
-StreamRingBuffer::StreamRingBuffer(int id, Alsa::StreamType type, int domId, int ref) :
-	RingBufferBase<xen_sndif_back_ring, xen_sndif_sring, xensnd_req, xensnd_resp>(domId, ref),
+static string logControlPath;
+
+// Multi page ring negotiation: the backend advertises the maximal order, the
+// frontend writes the order and ring-ref0 ... ring-ref<2^order - 1>
+static const char* cFieldMaxRingPageOrder = "max-ring-page-order";
+static const char* cFieldRingPageOrder = "ring-page-order";
+
+bool StreamRingBuffer::sBatchResponses = false;
+bool StreamRingBuffer::sPipeline = false;
+unsigned AlsaFrontendHandler::sMaxRingPageOrder = 0;
+unsigned AlsaFrontendHandler::sBusyPollUs = 0;
+set<int> AlsaFrontendHandler::sBusyPollStreams;
+
+StreamRingBuffer::StreamRingBuffer(int id, Alsa::StreamType type, int domId,
+								   const vector<uint32_t>& refs) :
+	RingBufferBase<xen_sndif_back_ring, xen_sndif_sring, xensnd_req, xensnd_resp>(domId, refs.data(),
+																				   refs.size()),
 	mId(id),
 	mCommandHandler(type, domId),
-	mLog("StreamRing(" + to_string(id) + ")")
+	mLog("StreamRing(" + to_string(id) + ")", domId),
+	mTerminate(false)
+{
+	LOG(mLog, DEBUG) << "Create stream ring buffer: id = " << id << ", type:" << static_cast<int>(type)
+					 << ", pages: " << refs.size() << ", slots: " << getRingSize();
+
+	setBatchResponses(sBatchResponses);
+
+	if (sPipeline)
+	{
+		mPipelineThread = thread(&StreamRingBuffer::pipelineThread, this);
+	}
+}
+
+StreamRingBuffer::~StreamRingBuffer()
 {
-	LOG(mLog, DEBUG) << "Create stream ring buffer: id = " << id << ", type:" << static_cast<int>(type);
+	if (mPipelineThread.joinable())
+	{
+		{
+			lock_guard<mutex> lock(mPipelineMutex);
+
+			mTerminate = true;
+
+			mPipelineCondVar.notify_all();
+		}
+
+		// The thread completes the queued requests before exit
+		mPipelineThread.join();
+	}
+
+	waitDeferred();
+
+	if (getNumBatches())
+	{
+		LOG(mLog, INFO) << "Batches: " << getNumBatches() << ", responses: "
+						<< getNumBatchedResponses() << ", max batch: "
+						<< getMaxBatchSize() << ", saved pushes: " << getSavedPushes();
+	}
 }
 
 void StreamRingBuffer::processRequest(const xensnd_req& req)
 {
 	DLOG(mLog, DEBUG) << "Request received, id: " << mId << ", cmd:" << static_cast<int>(req.u.data.operation);
 
+	if (mPipelineThread.joinable())
+	{
+		auto token = deferResponse();
+
+		lock_guard<mutex> lock(mPipelineMutex);
+
+		mPipeline.emplace_back(req, token);
+
+		mPipelineCondVar.notify_one();
+
+		return;
+	}
+
+	sendResponse(processCommand(req));
+}
+
+xensnd_resp StreamRingBuffer::processCommand(const xensnd_req& req)
+{
 	xensnd_resp rsp {};
 
 	rsp.u.data.id = req.u.data.id;
@@ -66,7 +144,68 @@ void StreamRingBuffer::processRequest(const xensnd_req& req)
 	rsp.u.data.operation = req.u.data.operation;
 	rsp.u.data.status = mCommandHandler.processCommand(req);
 
-	sendResponse(rsp);
+	return rsp;
+}
+
+void StreamRingBuffer::pipelineThread()
+{
+	XenBackend::ThreadPolicy::apply(XenBackend::ThreadPolicy::Group::RING);
+
+	while(true)
+	{
+		unique_lock<mutex> lock(mPipelineMutex);
+
+		mPipelineCondVar.wait(lock, [this] { return mTerminate || !mPipeline.empty(); });
+
+		if (mPipeline.empty())
+		{
+			return;
+		}
+
+		auto item = mPipeline.front();
+
+		mPipeline.pop_front();
+
+		lock.unlock();
+
+		auto& req = item.first;
+		xensnd_resp rsp {};
+
+		try
+		{
+			rsp = processCommand(req);
+		}
+		catch(const exception& e)
+		{
+			LOG(mLog, ERROR) << e.what();
+
+			rsp.u.data.id = req.u.data.id;
+			rsp.u.data.stream_idx = req.u.data.stream_idx;
+			rsp.u.data.operation = req.u.data.operation;
+			rsp.u.data.status = XENSND_RSP_ERROR;
+		}
+
+		// The token is released by the first call, so complete only once
+		try
+		{
+			complete(item.second, rsp);
+		}
+		catch(const exception& e)
+		{
+			LOG(mLog, ERROR) << e.what();
+		}
+	}
+}
+
+AlsaFrontendHandler::AlsaFrontendHandler(int domId, XenBackend::BackendBase& backend, int id) :
+	FrontendHandlerBase(domId, backend, id),
+	mLog("AlsaFrontend", domId)
+{
+	if (sMaxRingPageOrder)
+	{
+		getXenStore().writeInt(getXsBackendPath() + "/" + cFieldMaxRingPageOrder,
+							   sMaxRingPageOrder);
+	}
 }
 
 void AlsaFrontendHandler::onBind()
@@ -137,14 +276,90 @@ void AlsaFrontendHandler::createStreamChannel(int id, Alsa::StreamType type, con
 
 	LOG(mLog, DEBUG) << "Read event channel port: " << port << ", dom: " << getDomId();
 
-	uint32_t ref = getXenStore().readInt(streamPath + "/" + XENSND_FIELD_RING_REF);
+	auto refs = readRingRefs(streamPath);
+
+	shared_ptr<RingBufferItf> ringBuffer(new StreamRingBuffer(id, type, getDomId(), refs));
+
+	unsigned busyPollUs = 0;
+
+	if (sBusyPollStreams.empty() || sBusyPollStreams.count(id))
+	{
+		busyPollUs = sBusyPollUs;
+	}
+
+	addChannel(port, ringBuffer, busyPollUs);
+}
+
+bool AlsaFrontendHandler::setMaxRingPageOrder(unsigned order)
+{
+	if (order > cMaxRingPageOrder)
+	{
+		return false;
+	}
+
+	sMaxRingPageOrder = order;
+
+	return true;
+}
+
+bool AlsaFrontendHandler::setBusyPoll(const string& config)
+{
+	auto sep = config.find(':');
+
+	sBusyPollUs = stoul(config.substr(0, sep));
+	sBusyPollStreams.clear();
+
+	while(sep != string::npos)
+	{
+		auto next = config.find(',', sep + 1);
+
+		if (next == sep + 1 || sep + 1 == config.size())
+		{
+			return false;
+		}
+
+		sBusyPollStreams.insert(stoi(config.substr(sep + 1, next - sep - 1)));
+
+		sep = next;
+	}
+
+	return true;
+}
+
+vector<uint32_t> AlsaFrontendHandler::readRingRefs(const string& streamPath)
+{
+	auto orderPath = streamPath + "/" + cFieldRingPageOrder;
+
+	// Single page ring if the frontend doesn't support multi page rings
+	if (!sMaxRingPageOrder || !getXenStore().checkIfExist(orderPath))
+	{
+		uint32_t ref = getXenStore().readInt(streamPath + "/" + XENSND_FIELD_RING_REF);
+
+		LOG(mLog, DEBUG) << "Read ring buffer ref: " << ref << ", dom: " << getDomId();
+
+		return vector<uint32_t>(1, ref);
+	}
+
+	// The order comes from the frontend, check it before the shift
+	int order = getXenStore().readInt(orderPath);
 
-	LOG(mLog, DEBUG) << "Read ring buffer ref: " << ref << ", dom: " << getDomId();
+	if (order < 0 || static_cast<unsigned>(order) > sMaxRingPageOrder)
+	{
+		throw XenBackend::FrontendHandlerException("Ring page order " + to_string(order) +
+												   " exceeds " + to_string(sMaxRingPageOrder));
+	}
 
+	vector<uint32_t> refs;
 
-	shared_ptr<RingBufferItf> ringBuffer(new StreamRingBuffer(id, type, getDomId(), ref));
+	for (unsigned i = 0; i < (1u << order); i++)
+	{
+		refs.push_back(getXenStore().readInt(streamPath + "/" + XENSND_FIELD_RING_REF +
+											 to_string(i)));
+	}
+
+	LOG(mLog, DEBUG) << "Read ring buffer refs, order: " << order << ", dom: " << getDomId();
 
-	addChannel(port, ringBuffer);
+	return refs;
 }
 
 // Uncomment for manual dom
@@ -197,10 +412,51 @@ void registerTerminate()
 
 bool commandLineOptions(int argc, char *argv[])
 {
+	static const option longOptions[] =
+	{
+		{"verbose",        required_argument, nullptr, 'v'},
+		{"fileline",       no_argument,       nullptr, 'f'},
+		{"playback-mode",  required_argument, nullptr, 'p'},
+		{"capture-mode",   required_argument, nullptr, 'k'},
+		{"jitter-buffer",  required_argument, nullptr, 'j'},
+		{"mmap",           no_argument,       nullptr, 'm'},
+		{"latency",        required_argument, nullptr, 'l'},
+		{"periods",        required_argument, nullptr, 'n'},
+		{"mixer",          required_argument, nullptr, 'x'},
+		{"mixer-rate",     required_argument, nullptr, 'r'},
+		{"mixer-channels", required_argument, nullptr, 'c'},
+		{"mixer-priority", required_argument, nullptr, 'P'},
+		{"splitter",       required_argument, nullptr, 's'},
+		{"splitter-rate",  required_argument, nullptr, 'S'},
+		{"splitter-channels", required_argument, nullptr, 'N'},
+		{"resampler",      required_argument, nullptr, 'q'},
+		{"adaptive",       no_argument,       nullptr, 'a'},
+		{"pool-size",      required_argument, nullptr, 'o'},
+		{"prewarm",        required_argument, nullptr, 'w'},
+		{"reactor",        required_argument, nullptr, 'R'},
+		{"workers",        required_argument, nullptr, 'W'},
+		{"worker-queue",   required_argument, nullptr, 'Q'},
+		{"pin-workers",    no_argument,       nullptr, 'A'},
+		{"batch-responses", no_argument,      nullptr, 'b'},
+		{"pipeline",       no_argument,       nullptr, 'i'},
+		{"max-ring-order", required_argument, nullptr, 'g'},
+		{"busy-poll",      required_argument, nullptr, 'y'},
+		{"thread-policy",  required_argument, nullptr, 'T'},
+		{"lock-memory",    required_argument, nullptr, 'L'},
+		{"gnttab-cache",   required_argument, nullptr, 'G'},
+		{"transfer-mode",  required_argument, nullptr, 'X'},
+		{"log-control",    required_argument, nullptr, 'V'},
+		{"close-policy",   required_argument, nullptr, 'C'},
+		{"help",           no_argument,       nullptr, 'h'},
+		{nullptr,          0,                 nullptr, 0}
+	};
+
+	vector<string> prewarmConfigs;
+	long lockMemoryMb = -1;
 
 	int opt = -1;
 
-	while((opt = getopt(argc, argv, "v:fh?")) != -1)
+	while((opt = getopt_long(argc, argv, "v:fp:k:j:ml:n:x:r:c:P:s:S:N:q:ao:w:R:W:Q:Abig:y:T:L:G:X:V:C:h?", longOptions, nullptr)) != -1)
 	{
 		switch(opt)
 		{
@@ -216,11 +472,192 @@ bool commandLineOptions(int argc, char *argv[])
 			Log::setShowFileAndLine(true);
 			break;
 
+		case 'p':
+			if (!CommandHandler::setPlaybackMode(string(optarg)))
+			{
+				return false;
+			}
+
+			break;
+
+		case 'k':
+			if (!CommandHandler::setCaptureMode(string(optarg)))
+			{
+				return false;
+			}
+
+			break;
+
+		case 'j':
+			if (!CommandHandler::setJitterBufferTime(stoul(optarg)))
+			{
+				return false;
+			}
+
+			break;
+
+		case 'm':
+			CommandHandler::setMmapEnabled(true);
+			break;
+
+		case 'l':
+			CommandHandler::setLatency(stoul(optarg));
+			break;
+
+		case 'n':
+			CommandHandler::setNumPeriods(stoul(optarg));
+			break;
+
+		case 'x':
+			CommandHandler::setMixerDevice(optarg);
+			break;
+
+		case 'r':
+			CommandHandler::setMixerRate(stoul(optarg));
+			break;
+
+		case 'c':
+			CommandHandler::setMixerChannels(stoul(optarg));
+			break;
+
+		case 'P':
+			// Kept for compatibility, the mixer runs with the device threads
+			// policy, 0 - don't change
+			if (stoi(optarg) && !XenBackend::ThreadPolicy::setPolicy("device:fifo:" + string(optarg)))
+			{
+				return false;
+			}
+
+			break;
+
+		case 's':
+			CommandHandler::setSplitterDevice(optarg);
+			break;
+
+		case 'S':
+			CommandHandler::setSplitterRate(stoul(optarg));
+			break;
+
+		case 'N':
+			CommandHandler::setSplitterChannels(stoul(optarg));
+			break;
+
+		case 'q':
+			if (!Alsa::Resampler::setQuality(string(optarg)))
+			{
+				return false;
+			}
+
+			break;
+
+		case 'a':
+			CommandHandler::setAdaptiveResampling(true);
+			break;
+
+		case 'o':
+			Alsa::AlsaPcmPool::setMaxIdle(stoul(optarg));
+			break;
+
+		case 'w':
+			prewarmConfigs.push_back(optarg);
+			break;
+
+		case 'R':
+			XenBackend::XenEvtchnReactor::setNumHandles(stoul(optarg));
+			break;
+
+		case 'W':
+			XenBackend::Executor::setNumWorkers(stoul(optarg));
+			break;
+
+		case 'Q':
+			XenBackend::Executor::setQueueDepth(stoul(optarg));
+			break;
+
+		case 'A':
+			XenBackend::Executor::setPinning(true);
+			break;
+
+		case 'b':
+			StreamRingBuffer::setBatchResponses(true);
+			break;
+
+		case 'i':
+			StreamRingBuffer::setPipeline(true);
+			break;
+
+		case 'g':
+			if (!AlsaFrontendHandler::setMaxRingPageOrder(stoul(optarg)))
+			{
+				return false;
+			}
+
+			break;
+
+		case 'y':
+			if (!AlsaFrontendHandler::setBusyPoll(string(optarg)))
+			{
+				return false;
+			}
+
+			break;
+
+		case 'T':
+			if (!XenBackend::ThreadPolicy::setPolicy(string(optarg)))
+			{
+				return false;
+			}
+
+			break;
+
+		case 'L':
+			lockMemoryMb = stol(optarg);
+			break;
+
+		case 'G':
+			XenBackend::XenGnttabCache::setMaxIdle(stoul(optarg));
+			break;
+
+		case 'X':
+			if (!CommandHandler::setTransferMode(string(optarg)))
+			{
+				return false;
+			}
+
+			break;
+
+		case 'V':
+			logControlPath = optarg;
+			break;
+
+		case 'C':
+			if (!CommandHandler::setClosePolicy(string(optarg)))
+			{
+				return false;
+			}
+
+			break;
+
 		default:
 			return false;
 		}
 	}
 
+	// Lock before the prewarmed devices allocate their buffers
+	if (lockMemoryMb >= 0)
+	{
+		XenBackend::ThreadPolicy::lockMemory(lockMemoryMb * 1024 * 1024);
+	}
+
+	// Prewarm when all stream options are known
+	for (auto& config : prewarmConfigs)
+	{
+		if (!CommandHandler::prewarm(config))
+		{
+			return false;
+		}
+	}
+
 	return true;
 }
 
@@ -232,14 +669,61 @@ int main(int argc, char *argv[])
 
 		if (commandLineOptions(argc, argv))
 		{
+			unique_ptr<XenBackend::LogControl> logControl;
+
+			if (!logControlPath.empty())
+			{
+				logControl.reset(new XenBackend::LogControl(logControlPath));
+			}
+
 			alsaBackend.reset(new AlsaBackend(0, XENSND_DRIVER_NAME));
 
 			alsaBackend->run();
+
+			// Release the streams before the parked devices are closed
+			alsaBackend.reset();
+
+			// Finish closing the streams handed off to the reaper
+			Alsa::PcmReaper::stop();
+
+			Alsa::AlsaPcmPool::clear();
 		}
 		else
 		{
-			cout << "Usage: " << argv[0] << " [-v <level>]" << endl;
-			cout << "\t-v -- verbose level (disable, error, warning, info, debug)" << endl;
+			cout << "Usage: " << argv[0] << " [options]" << endl;
+			cout << "\t-v, --verbose <level>       -- verbose level (disable, error, warning, info, debug), per module and domain: info,CommandHandler=debug,dom3=debug" << endl;
+			cout << "\t-f, --fileline              -- show source file and line instead of module name" << endl;
+			cout << "\t-p, --playback-mode <mode>  -- playback mode (sync, async)" << endl;
+			cout << "\t-k, --capture-mode <mode>   -- capture mode (sync, prefetch)" << endl;
+			cout << "\t-j, --jitter-buffer <ms>    -- async playback jitter and capture prefetch buffer time" << endl;
+			cout << "\t-m, --mmap                  -- use mmap access if the device supports it" << endl;
+			cout << "\t-l, --latency <ms>          -- target device buffer time, 0 - device default" << endl;
+			cout << "\t-n, --periods <num>         -- number of periods in the device buffer" << endl;
+			cout << "\t-x, --mixer <device>        -- mix playback streams into the device" << endl;
+			cout << "\t-r, --mixer-rate <rate>     -- mixer sample rate" << endl;
+			cout << "\t-c, --mixer-channels <num>  -- mixer number of channels" << endl;
+			cout << "\t-P, --mixer-priority <prio> -- device threads SCHED_FIFO priority, same as -T device:fifo:<prio>" << endl;
+			cout << "\t-s, --splitter <device>     -- feed capture streams from the device" << endl;
+			cout << "\t-S, --splitter-rate <rate>  -- splitter sample rate" << endl;
+			cout << "\t-N, --splitter-channels <num> -- splitter number of channels" << endl;
+			cout << "\t-q, --resampler <quality>   -- resampler quality (low, medium, high)" << endl;
+			cout << "\t-a, --adaptive              -- compensate playback clock drift by resampling" << endl;
+			cout << "\t-o, --pool-size <num>       -- number of idle pcm devices kept opened, 0 - disable" << endl;
+			cout << "\t-w, --prewarm <fmt:rate:ch> -- open playback device at start, e.g. S16_LE:48000:2" << endl;
+			cout << "\t-R, --reactor <num>         -- serve event channels by one thread with num handles, 0 - thread per channel, requests of all streams are processed one by one unless -W is set" << endl;
+			cout << "\t-W, --workers <num>         -- process requests on num worker threads, 0 - on event channel thread" << endl;
+			cout << "\t-Q, --worker-queue <num>    -- maximal number of tasks per worker queue" << endl;
+			cout << "\t-A, --pin-workers           -- pin worker threads to CPUs" << endl;
+			cout << "\t-b, --batch-responses       -- push responses once per batch of requests" << endl;
+			cout << "\t-i, --pipeline              -- process requests by stream thread, consume next request meanwhile" << endl;
+			cout << "\t-g, --max-ring-order <num>  -- maximal ring page order offered to frontends, 0 - single page, up to 4" << endl;
+			cout << "\t-y, --busy-poll <us[:ids]> -- spin on the stream rings after an event, e.g. 50:0,2 for streams 0 and 2" << endl;
+			cout << "\t-T, --thread-policy <policy> -- group:sched[:prio][@cpus], group (ring, device, control), sched (other, fifo, rr), e.g. ring:fifo:40@2-3" << endl;
+			cout << "\t-L, --lock-memory <MB>      -- lock process memory and pre-fault MB of heap" << endl;
+			cout << "\t-G, --gnttab-cache <num>    -- number of released buffers kept mapped per domain, 0 - disable" << endl;
+			cout << "\t-X, --transfer-mode <mode> -- buffer transfer (map, copy, auto)" << endl;
+			cout << "\t-V, --log-control <path>    -- apply log levels written to the named pipe, e.g. echo debug > path" << endl;
+			cout << "\t-C, --close-policy <policy> -- queued data on close (drain, drop)" << endl;
 		}
 	}
 	catch(const exception& e)
@@ -21,6 +21,14 @@
 #ifndef INCLUDE_ALSABACKEND_HPP_
 #define INCLUDE_ALSABACKEND_HPP_
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include "BackendBase.hpp"
 #include "CommandHandler.hpp"
 #include "FrontendHandlerBase.hpp"
@@ -40,28 +48,64 @@ class StreamRingBuffer : public XenBackend::RingBufferBase<
 											xensnd_resp>
 {
 public:
-	StreamRingBuffer(int id, Alsa::StreamType type, int domId, int ref);
+	StreamRingBuffer(int id, Alsa::StreamType type, int domId,
+					 const std::vector<uint32_t>& refs);
+	~StreamRingBuffer();
+
+	static void setBatchResponses(bool batch) { sBatchResponses = batch; }
+	static void setPipeline(bool pipeline) { sPipeline = pipeline; }
 
 private:
+	static bool sBatchResponses;
+	static bool sPipeline;
+
 	int mId;
 	CommandHandler mCommandHandler;
 	XenBackend::Log mLog;
 
+	// Pipelined requests are processed by own thread in order and completed
+	// through the deferred responses
+	std::deque<std::pair<xensnd_req, CompletionToken>> mPipeline;
+	std::mutex mPipelineMutex;
+	std::condition_variable mPipelineCondVar;
+	std::thread mPipelineThread;
+	bool mTerminate;
+
 	void processRequest(const xensnd_req& req);
+	xensnd_resp processCommand(const xensnd_req& req);
+	void pipelineThread();
 };
 
 class AlsaFrontendHandler : public XenBackend::FrontendHandlerBase
 {
 public:
 
-	AlsaFrontendHandler(int domId, XenBackend::BackendBase& backend, int id) :
-		FrontendHandlerBase(domId, backend, id),
-		mLog("AlsaFrontend") {}
+	AlsaFrontendHandler(int domId, XenBackend::BackendBase& backend, int id);
+
+	/**
+	 * Sets maximal ring page order offered to frontends
+	 * @param[in] order page order, up to cMaxRingPageOrder
+	 */
+	static bool setMaxRingPageOrder(unsigned order);
+
+	/**
+	 * Sets busy poll of the stream rings
+	 * @param[in] config <us>[:<stream id>,...], all streams if no ids given
+	 */
+	static bool setBusyPoll(const std::string& config);
 
 private
 :
+	static const unsigned cMaxRingPageOrder = 4;
+
+	static unsigned sMaxRingPageOrder;
+	static unsigned sBusyPollUs;
+	static std::set<int> sBusyPollStreams;
+
 	XenBackend::Log mLog;
 
+	std::vector<uint32_t> readRingRefs(const std::string& streamPath);
+
 	void onBind();
 
 	void createStreamChannel(int id, Alsa::StreamType type, const std::string& streamPath);
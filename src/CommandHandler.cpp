@@ -20,15 +20,59 @@
 
 #include "CommandHandler.hpp"
 
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <limits>
+
 #include <sys/mman.h>
 
+using std::atomic;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::atomic_bool;
+using std::move;
+using std::numeric_limits;
+using std::shared_future;
+using std::stoul;
+using std::string;
+using std::to_string;
 using std::vector;
 
 using XenBackend::XenException;
 using XenBackend::XenGnttabBuffer;
+using XenBackend::XenGnttabCache;
+using XenBackend::XenGnttabCopy;
+using XenBackend::XenGnttabException;
 
+using Alsa::AlsaPcm;
 using Alsa::AlsaPcmException;
 using Alsa::AlsaPcmParams;
+using Alsa::AlsaPcmPool;
+using Alsa::AsyncPcmReader;
+using Alsa::AsyncPcmWriter;
+using Alsa::FormatConverter;
+using Alsa::Mixer;
+using Alsa::PcmReaper;
+using Alsa::Splitter;
+
+atomic<CommandHandler::PlaybackMode> CommandHandler::sPlaybackMode(PlaybackMode::SYNC);
+atomic<CommandHandler::CaptureMode> CommandHandler::sCaptureMode(CaptureMode::SYNC);
+atomic<unsigned> CommandHandler::sJitterBufferTimeMs(200);
+atomic_bool CommandHandler::sMmapEnabled(false);
+atomic<unsigned> CommandHandler::sLatencyUs(0);
+atomic<unsigned> CommandHandler::sNumPeriods(4);
+atomic_bool CommandHandler::sAdaptiveResampling(false);
+string CommandHandler::sMixerDevice;
+atomic<unsigned> CommandHandler::sMixerRate(48000);
+atomic<unsigned> CommandHandler::sMixerChannels(2);
+string CommandHandler::sSplitterDevice;
+atomic<unsigned> CommandHandler::sSplitterRate(48000);
+atomic<unsigned> CommandHandler::sSplitterChannels(2);
+atomic<CommandHandler::TransferMode> CommandHandler::sTransferMode(TransferMode::MAP);
+atomic<PcmReaper::Policy> CommandHandler::sClosePolicy(PcmReaper::Policy::DRAIN);
 
 CommandHandler::PcmFormat CommandHandler::sPcmFormat[] = {
 	{ .sndif = XENSND_PCM_FORMAT_U8,                 .alsa = SND_PCM_FORMAT_U8 },
@@ -61,18 +105,147 @@ CommandHandler::PcmFormat CommandHandler::sPcmFormat[] = {
 
 CommandHandler::CommandHandler(Alsa::StreamType type, int domId) :
 	mDomId(domId),
-	mAlsaPcm(type),
+	mType(type),
+	mGnttabCache(XenGnttabCache::getInstance(domId)),
+	mDirectoryCopy(true),
+	mCopy(domId),
+	mTransferBufferSize(0),
+	mNumRequests(0),
+	mRequestRate(numeric_limits<unsigned>::max()),
+	mClosePolicy(sClosePolicy),
 	mCmdTable{&CommandHandler::open, &CommandHandler::close, &CommandHandler::read, &CommandHandler::write},
-	mLog("CommandHandler")
+	mLog("CommandHandler", domId)
 {
 	LOG(mLog, DEBUG) << "Create command handler, dom: " << mDomId;
 }
 
 CommandHandler::~CommandHandler()
 {
+	closeStream(PcmReaper::Policy::DROP);
+
 	LOG(mLog, DEBUG) << "Delete command handler, dom: " << mDomId;
 }
 
+bool CommandHandler::setJitterBufferTime(unsigned timeMs)
+{
+	if (timeMs == 0)
+	{
+		return false;
+	}
+
+	sJitterBufferTimeMs = timeMs;
+
+	return true;
+}
+
+bool CommandHandler::setPlaybackMode(const string& mode)
+{
+	if (mode == "sync")
+	{
+		sPlaybackMode = PlaybackMode::SYNC;
+	}
+	else if (mode == "async")
+	{
+		sPlaybackMode = PlaybackMode::ASYNC;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool CommandHandler::setCaptureMode(const string& mode)
+{
+	if (mode == "sync")
+	{
+		sCaptureMode = CaptureMode::SYNC;
+	}
+	else if (mode == "prefetch")
+	{
+		sCaptureMode = CaptureMode::PREFETCH;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool CommandHandler::setClosePolicy(const string& policy)
+{
+	if (policy == "drain")
+	{
+		sClosePolicy = PcmReaper::Policy::DRAIN;
+	}
+	else if (policy == "drop")
+	{
+		sClosePolicy = PcmReaper::Policy::DROP;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool CommandHandler::setTransferMode(const string& mode)
+{
+	if (mode == "map")
+	{
+		sTransferMode = TransferMode::MAP;
+	}
+	else if (mode == "copy")
+	{
+		sTransferMode = TransferMode::COPY;
+	}
+	else if (mode == "auto")
+	{
+		sTransferMode = TransferMode::AUTO;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool CommandHandler::prewarm(const string& config)
+{
+	// format:rate:channels
+	auto rateSep = config.find(':');
+	auto channelsSep = config.find(':', rateSep + 1);
+
+	if (rateSep == string::npos || channelsSep == string::npos)
+	{
+		return false;
+	}
+
+	auto format = snd_pcm_format_value(config.substr(0, rateSep).c_str());
+
+	if (format == SND_PCM_FORMAT_UNKNOWN)
+	{
+		return false;
+	}
+
+	try
+	{
+		AlsaPcmPool::prewarm(Alsa::StreamType::PLAYBACK,
+							 getPcmParams(format, stoul(config.substr(rateSep + 1)),
+										  stoul(config.substr(channelsSep + 1))));
+	}
+	catch(const AlsaPcmException& e)
+	{
+		LOG("CommandHandler", ERROR) << e.what();
+	}
+
+	return true;
+}
+
 uint8_t CommandHandler::processCommand(const xensnd_req& req)
 {
 	uint8_t status = XENSND_RSP_OKAY;
@@ -94,6 +267,12 @@ uint8_t CommandHandler::processCommand(const xensnd_req& req)
 
 		status = XENSND_RSP_ERROR;
 	}
+	catch(const XenException& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+
+		status = XENSND_RSP_ERROR;
+	}
 
 	DLOG(mLog, DEBUG) << "Return status: [" << static_cast<int>(status) << "]";
 
@@ -106,22 +285,131 @@ void CommandHandler::open(const xensnd_req& req)
 
 	const xensnd_open_req& openReq = req.u.data.op.open;
 
+	closeStream(PcmReaper::Policy::DROP);
+
+	mClosePolicy = sClosePolicy;
+
 	vector<grant_ref_t> refs;
 
+	auto start = steady_clock::now();
+
 	getBufferRefs(openReq.gref_directory_start, refs);
 
-	mBuffer.reset(new XenGnttabBuffer(mDomId, refs.data(), refs.size(), PROT_READ | PROT_WRITE));
+	auto refsRead = steady_clock::now();
+	auto numRefs = refs.size();
+
+	mOpenTime = refsRead;
+	mNumRequests = 0;
+
+	// The stream may be reopened without CLOSE
+	mBuffer.reset();
+	mRefs.clear();
+
+	// All data pages are mapped by one call
+	if (isCopyMode(numRefs))
+	{
+		mRefs = move(refs);
+	}
+	else if (mGnttabCache)
+	{
+		mBuffer = mGnttabCache->map(openReq.gref_directory_start, refs, PROT_READ | PROT_WRITE);
+	}
+	else
+	{
+		mBuffer.reset(new XenGnttabBuffer(mDomId, refs.data(), refs.size(), PROT_READ | PROT_WRITE));
+	}
+
+	auto mapped = steady_clock::now();
+
+	try
+	{
+		openDevice(openReq);
+	}
+	catch(const AlsaPcmException& e)
+	{
+		// The previous stream is closed in background and may still hold the
+		// device: wait for it only when the device can't be opened meanwhile
+		if (e.getError() != -EBUSY || !mClosed.valid())
+		{
+			throw;
+		}
+
+		LOG(mLog, DEBUG) << "Device is busy, wait for the previous stream closed";
+
+		mClosed.wait();
+		mClosed = shared_future<void>();
+
+		openDevice(openReq);
+	}
+
+	LOG(mLog, DEBUG) << "Open time, refs: " << numRefs
+					 << ", mode: " << (mBuffer ? "map" : "copy")
+					 << ", directory: " << duration_cast<microseconds>(refsRead - start).count()
+					 << " us, map: " << duration_cast<microseconds>(mapped - refsRead).count()
+					 << " us, device: " << duration_cast<microseconds>(steady_clock::now() - mapped).count()
+					 << " us";
+}
 
-	mAlsaPcm.open(AlsaPcmParams(convertPcmFormat(openReq.pcm_format), openReq.pcm_rate, openReq.pcm_channels));
+void CommandHandler::openDevice(const xensnd_open_req& openReq)
+{
+	if (!openMixerInput(openReq) && !openSplitterOutput(openReq))
+	{
+		openPcm(openReq);
+	}
+}
+
+void CommandHandler::openPcm(const xensnd_open_req& openReq)
+{
+	mAlsaPcm = AlsaPcmPool::acquire(mType, getPcmParams(convertPcmFormat(openReq.pcm_format),
+														openReq.pcm_rate, openReq.pcm_channels),
+									"default", mDomId);
+
+	if (mType == Alsa::StreamType::PLAYBACK && sPlaybackMode == PlaybackMode::ASYNC)
+	{
+		mAsyncWriter.reset(new AsyncPcmWriter(*mAlsaPcm, getJitterBufferSize(mAlsaPcm->getFrameSize(),
+																			  openReq.pcm_rate)));
+	}
+
+	if (mType == Alsa::StreamType::CAPTURE && sCaptureMode == CaptureMode::PREFETCH)
+	{
+		mAsyncReader.reset(new AsyncPcmReader(*mAlsaPcm, getJitterBufferSize(mAlsaPcm->getFrameSize(),
+																			  openReq.pcm_rate)));
+	}
 }
 
 void CommandHandler::close(const xensnd_req& req)
 {
 	DLOG(mLog, DEBUG) << "Handle command [CLOSE]";
 
-	mBuffer.reset();
+	// The prefetch stats are taken before the reader is handed to the reaper
+	size_t prefetched = mAsyncReader ? mAsyncReader->getFilled() : 0;
+	uint64_t overrunBytes = mAsyncReader ? mAsyncReader->getOverrunBytes() : 0;
+
+	// The queued data is played from own copies, the buffer can be unmapped
+	closeStream(mClosePolicy);
+
+	auto elapsedMs = duration_cast<milliseconds>(steady_clock::now() - mOpenTime).count();
 
-	mAlsaPcm.close();
+	if (elapsedMs > 0)
+	{
+		mRequestRate = mNumRequests * 1000 / elapsedMs;
+	}
+
+	LOG(mLog, DEBUG) << "Close stream, mode: " << (mBuffer ? "map" : "copy")
+					 << ", requests: " << mNumRequests << ", rate: " << mRequestRate << "/s";
+
+	if (overrunBytes)
+	{
+		LOG(mLog, WARNING) << "Prefetch buffer overrun, dropped: " << overrunBytes
+						   << ", not read: " << prefetched;
+	}
+	else if (prefetched)
+	{
+		LOG(mLog, DEBUG) << "Prefetched data not read: " << prefetched;
+	}
+
+	mBuffer.reset();
+	mRefs.clear();
 }
 
 void CommandHandler::read(const xensnd_req& req)
@@ -130,7 +418,22 @@ void CommandHandler::read(const xensnd_req& req)
 
 	const xensnd_read_req& readReq = req.u.data.op.read;
 
-	mAlsaPcm.read(&(static_cast<uint8_t*>(mBuffer->get())[readReq.offset]), readReq.len);
+	auto data = getData(readReq.offset, readReq.len, false);
+
+	if (mSplitterOutput)
+	{
+		mSplitterOutput->read(data, readReq.len);
+	}
+	else if (mAsyncReader)
+	{
+		mAsyncReader->read(data, readReq.len);
+	}
+	else
+	{
+		getAlsaPcm().read(data, readReq.len);
+	}
+
+	putData(data, readReq.offset, readReq.len);
 }
 
 void CommandHandler::write(const xensnd_req& req)
@@ -139,22 +442,236 @@ void CommandHandler::write(const xensnd_req& req)
 
 	const xensnd_write_req& writeReq = req.u.data.op.write;
 
-	mAlsaPcm.write(&(static_cast<uint8_t*>(mBuffer->get())[writeReq.offset]), writeReq.len);
+	auto data = getData(writeReq.offset, writeReq.len, true);
+
+	if (mMixerInput)
+	{
+		mMixerInput->write(data, writeReq.len);
+	}
+	else if (mAsyncWriter)
+	{
+		mAsyncWriter->write(data, writeReq.len);
+	}
+	else
+	{
+		getAlsaPcm().write(data, writeReq.len);
+	}
+}
+
+bool CommandHandler::isCopyMode(size_t numRefs)
+{
+	if (sTransferMode != TransferMode::AUTO)
+	{
+		return sTransferMode == TransferMode::COPY;
+	}
+
+	// Large buffers take many mapping slots, rare requests don't pay off the
+	// mapping. The rate is measured while the stream was opened last time.
+	return numRefs * XC_PAGE_SIZE >= cCopyMinBufferSize ||
+		   mRequestRate < cCopyMaxRequestRate;
+}
+
+uint8_t* CommandHandler::getData(uint32_t offset, uint32_t len, bool fromGuest)
+{
+	mNumRequests++;
+
+	size_t bufferSize = mBuffer ? mBuffer->size() : mRefs.size() * XC_PAGE_SIZE;
+
+	if (!bufferSize)
+	{
+		throw XenException("Buffer is not opened");
+	}
+
+	// Validate the guest range before anything is allocated or transferred
+	if (static_cast<uint64_t>(offset) + len > bufferSize)
+	{
+		throw XenException("Wrong request range, offset: " + to_string(offset) +
+						   ", len: " + to_string(len) +
+						   ", buffer size: " + to_string(bufferSize));
+	}
+
+	if (mBuffer)
+	{
+		return &(static_cast<uint8_t*>(mBuffer->get())[offset]);
+	}
+
+	if (len > mTransferBufferSize)
+	{
+		void* buffer = nullptr;
+
+		if (posix_memalign(&buffer, XC_PAGE_SIZE, len))
+		{
+			throw XenException("Can't allocate transfer buffer");
+		}
+
+		mTransferBuffer.reset(static_cast<uint8_t*>(buffer));
+		mTransferBufferSize = len;
+	}
+
+	if (fromGuest)
+	{
+		mCopy.addFromRefs(mRefs.data(), mRefs.size(), offset, mTransferBuffer.get(), len);
+		mCopy.execute();
+	}
+
+	return mTransferBuffer.get();
+}
+
+void CommandHandler::putData(const uint8_t* data, uint32_t offset, uint32_t len)
+{
+	if (mBuffer)
+	{
+		return;
+	}
+
+	mCopy.addToRefs(mRefs.data(), mRefs.size(), offset, data, len);
+	mCopy.execute();
+}
+
+AlsaPcmParams CommandHandler::getPcmParams(snd_pcm_format_t format, unsigned rate,
+										   unsigned numChannels)
+{
+	return AlsaPcmParams(format, rate, numChannels, sMmapEnabled, sLatencyUs,
+						 sNumPeriods, sAdaptiveResampling);
+}
+
+AlsaPcm& CommandHandler::getAlsaPcm()
+{
+	if (!mAlsaPcm)
+	{
+		throw AlsaPcmException("Pcm device is not opened");
+	}
+
+	return *mAlsaPcm;
+}
+
+bool CommandHandler::openMixerInput(const xensnd_open_req& openReq)
+{
+	if (mType != Alsa::StreamType::PLAYBACK || sMixerDevice.empty())
+	{
+		return false;
+	}
+
+	auto mixer = Mixer::getInstance(sMixerDevice,
+									AlsaPcmParams(SND_PCM_FORMAT_S16, sMixerRate, sMixerChannels,
+												  sMmapEnabled, sLatencyUs, sNumPeriods));
+
+	auto& params = mixer->getParams();
+	auto format = convertPcmFormat(openReq.pcm_format);
+
+	if (!FormatConverter::isSupported(format) ||
+		params.rate != openReq.pcm_rate ||
+		params.numChannels != openReq.pcm_channels)
+	{
+		LOG(mLog, WARNING) << "Stream parameters don't match the mixer, use own device";
+
+		return false;
+	}
+
+	mMixer = mixer;
+
+	mMixerInput = mMixer->addInput(getJitterBufferSize(snd_pcm_format_size(params.format, params.numChannels),
+													   params.rate), format, mDomId);
+
+	return true;
+}
+
+bool CommandHandler::openSplitterOutput(const xensnd_open_req& openReq)
+{
+	if (mType != Alsa::StreamType::CAPTURE || sSplitterDevice.empty())
+	{
+		return false;
+	}
+
+	auto splitter = Splitter::getInstance(sSplitterDevice,
+										  AlsaPcmParams(SND_PCM_FORMAT_FLOAT, sSplitterRate,
+														sSplitterChannels, sMmapEnabled,
+														sLatencyUs, sNumPeriods));
+
+	auto& params = splitter->getParams();
+	auto format = convertPcmFormat(openReq.pcm_format);
+
+	if (!FormatConverter::isSupported(format) ||
+		params.numChannels != openReq.pcm_channels)
+	{
+		LOG(mLog, WARNING) << "Stream parameters don't match the splitter, use own device";
+
+		return false;
+	}
+
+	mSplitter = splitter;
+
+	mSplitterOutput = mSplitter->addOutput(getJitterBufferSize(snd_pcm_format_size(format, params.numChannels),
+															   openReq.pcm_rate), format, openReq.pcm_rate,
+										   mDomId);
+
+	return true;
+}
+
+void CommandHandler::closeStream(PcmReaper::Policy policy)
+{
+	if (!mAlsaPcm && !mAsyncWriter && !mAsyncReader && !mMixerInput && !mSplitterOutput)
+	{
+		return;
+	}
+
+	PcmReaper::Stream stream;
+
+	// The writer and the reader refer to the pcm device: they are destroyed
+	// by the reaper first
+	stream.pcm = move(mAlsaPcm);
+	stream.writer = move(mAsyncWriter);
+	stream.reader = move(mAsyncReader);
+	stream.mixer = move(mMixer);
+	stream.mixerInput = move(mMixerInput);
+	stream.splitter = move(mSplitter);
+	stream.splitterOutput = move(mSplitterOutput);
+
+	mClosed = PcmReaper::reap(move(stream), policy);
+}
+
+size_t CommandHandler::getJitterBufferSize(size_t frameSize, unsigned rate)
+{
+	return static_cast<uint64_t>(frameSize) * rate * sJitterBufferTimeMs / 1000;
 }
 
 void CommandHandler::getBufferRefs(grant_ref_t startDirectory, vector<grant_ref_t>& refs)
 {
 	refs.clear();
 
+	// Copying avoids map, unmap and TLB shootdown per directory page, but
+	// not all kernels support grant copy. The fallback is per handler: a copy
+	// failure caused by one guest doesn't affect other domains.
+	if (mDirectoryCopy)
+	{
+		try
+		{
+			copyBufferRefs(startDirectory, refs);
+
+			return;
+		}
+		catch(const XenGnttabException& e)
+		{
+			LOG(mLog, WARNING) << "Can't copy page directory, use mapping: " << e.what();
+
+			mDirectoryCopy = false;
+
+			refs.clear();
+		}
+	}
+
+	unsigned numPages = 0;
+
 	do
 	{
+		checkDirectoryPages(++numPages);
 
 		XenGnttabBuffer pageBuffer(mDomId, startDirectory, PROT_READ | PROT_WRITE);
 		xensnd_page_directory* pageDirectory = static_cast<xensnd_page_directory*>(pageBuffer.get());
 
 		DLOG(mLog, DEBUG) << "Get buffer refs, directory: " << startDirectory << ", num refs: " << pageDirectory->num_grefs;
 
-		refs.insert(refs.end(), pageDirectory->gref, pageDirectory->gref + pageDirectory->num_grefs);
+		addDirectoryRefs(*pageDirectory, refs);
 
 		startDirectory = pageDirectory->gref_dir_next_page;
 
@@ -164,6 +681,58 @@ void CommandHandler::getBufferRefs(grant_ref_t startDirectory, vector<grant_ref_
 	DLOG(mLog, DEBUG) << "Get buffer refs, num refs: " << refs.size();
 }
 
+void CommandHandler::copyBufferRefs(grant_ref_t startDirectory, vector<grant_ref_t>& refs)
+{
+	XenGnttabCopy copy(mDomId);
+
+	// Each page is copied into the same scratch page. The next page ref is
+	// known only from the current page, so the pages can't be batched.
+	mDirectoryPage.resize(XC_PAGE_SIZE);
+
+	auto pageDirectory = reinterpret_cast<xensnd_page_directory*>(mDirectoryPage.data());
+	unsigned numPages = 0;
+
+	do
+	{
+		checkDirectoryPages(++numPages);
+
+		copy.addFromRef(startDirectory, 0, mDirectoryPage.data(), XC_PAGE_SIZE);
+		copy.execute();
+
+		DLOG(mLog, DEBUG) << "Copy buffer refs, directory: " << startDirectory << ", num refs: " << pageDirectory->num_grefs;
+
+		addDirectoryRefs(*pageDirectory, refs);
+
+		startDirectory = pageDirectory->gref_dir_next_page;
+	}
+	while(startDirectory != 0);
+
+	DLOG(mLog, DEBUG) << "Copy buffer refs, num refs: " << refs.size();
+}
+
+void CommandHandler::checkDirectoryPages(unsigned numPages)
+{
+	// The next page ref comes from the guest, a looped directory never ends
+	if (numPages > cMaxDirectoryPages)
+	{
+		throw XenException("Page directory exceeds " + to_string(cMaxDirectoryPages) + " pages");
+	}
+}
+
+void CommandHandler::addDirectoryRefs(const xensnd_page_directory& pageDirectory,
+									  vector<grant_ref_t>& refs)
+{
+	auto maxRefs = (XC_PAGE_SIZE - offsetof(xensnd_page_directory, gref)) / sizeof(grant_ref_t);
+
+	if (pageDirectory.num_grefs > maxRefs)
+	{
+		throw XenException("Wrong number of refs in page directory: " +
+						   to_string(pageDirectory.num_grefs));
+	}
+
+	refs.insert(refs.end(), pageDirectory.gref, pageDirectory.gref + pageDirectory.num_grefs);
+}
+
 snd_pcm_format_t CommandHandler::convertPcmFormat(uint8_t format)
 {
 	for (auto value : sPcmFormat)
@@ -21,11 +21,22 @@
 #ifndef SRC_COMMANDHANDLER_HPP_
 #define SRC_COMMANDHANDLER_HPP_
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <cstdlib>
+#include <future>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "AlsaPcm.hpp"
+#include "AlsaPcmPool.hpp"
+#include "AsyncPcmReader.hpp"
+#include "AsyncPcmWriter.hpp"
+#include "Mixer.hpp"
+#include "PcmReaper.hpp"
+#include "Splitter.hpp"
 #include "XenGnttab.hpp"
 #include "Log.hpp"
 
@@ -36,12 +47,61 @@ extern "C" {
 class CommandHandler
 {
 public:
+	/**
+	 * Playback modes:
+	 * SYNC  - WRITE is completed when the device accepts all frames;
+	 * ASYNC - WRITE is queued into the jitter buffer and completed at once.
+	 */
+	enum class PlaybackMode { SYNC, ASYNC };
+
+	/**
+	 * Capture modes:
+	 * SYNC     - READ waits for the device;
+	 * PREFETCH - the device is read into the prefetch buffer from OPEN, READ
+	 *            is completed from the buffer.
+	 */
+	enum class CaptureMode { SYNC, PREFETCH };
+
+	/**
+	 * Buffer transfer modes:
+	 * MAP  - the buffer is mapped from OPEN till CLOSE;
+	 * COPY - the range of each READ/WRITE is copied by grant copy;
+	 * AUTO - COPY for large buffers and for streams with rare requests,
+	 *        MAP otherwise.
+	 */
+	enum class TransferMode { MAP, COPY, AUTO };
+
 	CommandHandler(Alsa::StreamType type, int domId);
 	~CommandHandler();
 
 	uint8_t processCommand(const xensnd_req& req);
 
+	static void setPlaybackMode(PlaybackMode mode) { sPlaybackMode = mode; }
+	static bool setPlaybackMode(const std::string& mode);
+	static void setCaptureMode(CaptureMode mode) { sCaptureMode = mode; }
+	static bool setCaptureMode(const std::string& mode);
+	static bool setJitterBufferTime(unsigned timeMs);
+	static void setMmapEnabled(bool enabled) { sMmapEnabled = enabled; }
+	static void setLatency(unsigned latencyMs) { sLatencyUs = latencyMs * 1000; }
+	static void setNumPeriods(unsigned numPeriods) { sNumPeriods = numPeriods; }
+	static void setAdaptiveResampling(bool enabled) { sAdaptiveResampling = enabled; }
+	static void setMixerDevice(const std::string& device) { sMixerDevice = device; }
+	static void setMixerRate(unsigned rate) { sMixerRate = rate; }
+	static void setMixerChannels(unsigned numChannels) { sMixerChannels = numChannels; }
+	static void setSplitterDevice(const std::string& device) { sSplitterDevice = device; }
+	static void setSplitterRate(unsigned rate) { sSplitterRate = rate; }
+	static void setSplitterChannels(unsigned numChannels) { sSplitterChannels = numChannels; }
+	static bool setClosePolicy(const std::string& policy);
+	static bool setTransferMode(const std::string& mode);
+	static bool prewarm(const std::string& config);
+
 private:
+	// AUTO transfer mode thresholds
+	static const size_t cCopyMinBufferSize = 1024 * 1024;
+	static const unsigned cCopyMaxRequestRate = 20;
+	// Bounds the page directory walk, about 64 MiB of buffer
+	static const unsigned cMaxDirectoryPages = 16;
+
 	struct PcmFormat
 	{
 		uint8_t sndif;
@@ -50,10 +110,53 @@ private:
 
 	static PcmFormat sPcmFormat[];
 
-	int mDomId;
-	std::unique_ptr<XenBackend::XenGnttabBuffer> mBuffer;
+	static std::atomic<PlaybackMode> sPlaybackMode;
+	static std::atomic<CaptureMode> sCaptureMode;
+	static std::atomic<unsigned> sJitterBufferTimeMs;
+	static std::atomic_bool sMmapEnabled;
+	static std::atomic<unsigned> sLatencyUs;
+	static std::atomic<unsigned> sNumPeriods;
+	static std::atomic_bool sAdaptiveResampling;
+	static std::string sMixerDevice;
+	static std::atomic<unsigned> sMixerRate;
+	static std::atomic<unsigned> sMixerChannels;
+	static std::string sSplitterDevice;
+	static std::atomic<unsigned> sSplitterRate;
+	static std::atomic<unsigned> sSplitterChannels;
+	static std::atomic<Alsa::PcmReaper::Policy> sClosePolicy;
+	static std::atomic<TransferMode> sTransferMode;
+
+	struct FreeDeleter
+	{
+		void operator()(uint8_t* p) const { free(p); }
+	};
 
-	Alsa::AlsaPcm mAlsaPcm;
+	int mDomId;
+	Alsa::StreamType mType;
+	std::shared_ptr<XenBackend::XenGnttabCache> mGnttabCache;
+	std::shared_ptr<XenBackend::XenGnttabBuffer> mBuffer;
+	std::vector<uint8_t> mDirectoryPage;
+	bool mDirectoryCopy;
+
+	// Copy transfer mode: the buffer refs and the aligned transfer buffer
+	std::vector<grant_ref_t> mRefs;
+	XenBackend::XenGnttabCopy mCopy;
+	std::unique_ptr<uint8_t, FreeDeleter> mTransferBuffer;
+	size_t mTransferBufferSize;
+
+	std::chrono::steady_clock::time_point mOpenTime;
+	uint64_t mNumRequests;
+	unsigned mRequestRate;
+
+	std::unique_ptr<Alsa::AlsaPcm> mAlsaPcm;
+	std::unique_ptr<Alsa::AsyncPcmWriter> mAsyncWriter;
+	std::unique_ptr<Alsa::AsyncPcmReader> mAsyncReader;
+	std::shared_ptr<Alsa::Mixer> mMixer;
+	std::shared_ptr<Alsa::MixerInput> mMixerInput;
+	std::shared_ptr<Alsa::Splitter> mSplitter;
+	std::shared_ptr<Alsa::SplitterOutput> mSplitterOutput;
+	Alsa::PcmReaper::Policy mClosePolicy;
+	std::shared_future<void> mClosed;
 
 	XenBackend::Log mLog;
 
@@ -66,7 +169,24 @@ private:
 	void read(const xensnd_req& req);
 	void write(const xensnd_req& req);
 
+	static Alsa::AlsaPcmParams getPcmParams(snd_pcm_format_t format, unsigned rate,
+											unsigned numChannels);
+
+	void openDevice(const xensnd_open_req& openReq);
+	void openPcm(const xensnd_open_req& openReq);
+	bool isCopyMode(size_t numRefs);
+	uint8_t* getData(uint32_t offset, uint32_t len, bool fromGuest);
+	void putData(const uint8_t* data, uint32_t offset, uint32_t len);
+	Alsa::AlsaPcm& getAlsaPcm();
+	bool openMixerInput(const xensnd_open_req& openReq);
+	bool openSplitterOutput(const xensnd_open_req& openReq);
+	void closeStream(Alsa::PcmReaper::Policy policy);
+	size_t getJitterBufferSize(size_t frameSize, unsigned rate);
 	void getBufferRefs(grant_ref_t startDirectory, std::vector<grant_ref_t>& refs);
+	void copyBufferRefs(grant_ref_t startDirectory, std::vector<grant_ref_t>& refs);
+	void checkDirectoryPages(unsigned numPages);
+	void addDirectoryRefs(const xensnd_page_directory& pageDirectory,
+						  std::vector<grant_ref_t>& refs);
 	snd_pcm_format_t convertPcmFormat(uint8_t format);
 };
 
@@ -7,19 +7,35 @@
 
 #include "AlsaPcm.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <exception>
 
 using std::exception;
+using std::max;
+using std::min;
 using std::string;
 using std::to_string;
 
 namespace Alsa {
 
-AlsaPcm::AlsaPcm(StreamType type, const std::string& name) :
+AlsaPcm::AlsaPcm(StreamType type, const std::string& name, int domId) :
 	mHandle(nullptr),
 	mName(name),
 	mType(type),
-	mLog("AlsaPcm")
+	mRequestedParams(SND_PCM_FORMAT_UNKNOWN, 0, 0),
+	mParams(SND_PCM_FORMAT_UNKNOWN, 0, 0),
+	mAccess(SND_PCM_ACCESS_RW_INTERLEAVED),
+	mPeriodSize(0),
+	mBufferSize(0),
+	mStartThreshold(0),
+	mDeviceFormat(SND_PCM_FORMAT_UNKNOWN),
+	mDeviceRate(0),
+	mFrameSize(0),
+	mConvertFrameSize(0),
+	mDomId(domId),
+	mLog("AlsaPcm", domId),
+	mXrunLimit(cXrunLogIntervalMs)
 {
 	LOG(mLog, DEBUG) << "Create pcm device: " << mName;
 }
@@ -31,70 +47,54 @@ AlsaPcm::~AlsaPcm()
 	close();
 }
 
-void AlsaPcm::open(const AlsaPcmParams& params, bool forCapture)
+void AlsaPcm::setDomain(int domId)
 {
-	snd_pcm_hw_params_t *hwParams = nullptr;
+	mDomId = domId;
+
+	mLog.setDomain(domId);
+}
 
+void AlsaPcm::open(const AlsaPcmParams& params, bool forCapture)
+{
 	try
 	{
 		DLOG(mLog, DEBUG) << "Open pcm device: " << mName << ", format: " << params.format
-				<< ", rate: " << params.rate << ", channels: " << params.numChannels;
-
-		if (snd_pcm_open(&mHandle, mName.c_str(), mType == StreamType::PLAYBACK ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE, 0) < 0)
-		{
-			throw AlsaPcmException("Can't open audio device " + mName);
-		}
-
-		if (snd_pcm_hw_params_malloc(&hwParams) < 0)
-		{
-			throw AlsaPcmException("Can't allocate hw params " + mName);
-		}
-
-		if (snd_pcm_hw_params_any(mHandle, hwParams) < 0)
-		{
-			throw AlsaPcmException("Can't allocate hw params " + mName);
-		}
+				<< ", rate: " << params.rate << ", channels: " << params.numChannels
+				<< ", latency: " << params.latencyUs << ", periods: " << params.numPeriods;
 
-		if (snd_pcm_hw_params_set_access(mHandle, hwParams, SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
-		{
-			throw AlsaPcmException("Can't set access " + mName);
-		}
-
-		if (snd_pcm_hw_params_set_format(mHandle, hwParams, params.format) < 0)
-		{
-			throw AlsaPcmException("Can't set format " + mName);
-		}
+		// Linear formats are converted and resampled by the backend instead of
+		// the plug layer
+		int mode = FormatConverter::isSupported(params.format) ?
+				   SND_PCM_NO_AUTO_FORMAT | SND_PCM_NO_AUTO_RESAMPLE : 0;
 
-		unsigned int rate = params.rate;
+		int ret = snd_pcm_open(&mHandle, mName.c_str(), mType == StreamType::PLAYBACK ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE, mode);
 
-		if (snd_pcm_hw_params_set_rate_near(mHandle, hwParams, &rate, 0) < 0)
+		if (ret < 0)
 		{
-			throw AlsaPcmException("Can't set rate " + mName);
+			throw AlsaPcmException("Can't open audio device " + mName + ". Error: " +
+								   snd_strerror(ret), ret);
 		}
 
-		if (snd_pcm_hw_params_set_channels(mHandle, hwParams, params.numChannels) < 0)
-		{
-			throw AlsaPcmException("Can't set channels " + mName);
-		}
+		mRequestedParams = params;
+		mParams = params;
 
-		if (snd_pcm_hw_params(mHandle, hwParams) < 0)
-		{
-			throw AlsaPcmException("Can't set hwParams " + mName);
-		}
+		setHwParams();
+		setSwParams();
 
 		if (snd_pcm_prepare(mHandle) < 0)
 		{
 			throw AlsaPcmException("Can't prepare audio interface for use");
 		}
+
+		LOG(mLog, INFO) << "Pcm device: " << mName << " opened, access: " << snd_pcm_access_name(mAccess)
+						<< ", format: " << snd_pcm_format_name(mDeviceFormat)
+						<< ", rate: " << mDeviceRate << ", period size: " << mPeriodSize
+						<< ", buffer size: " << mBufferSize << ", periods: " << mParams.numPeriods
+						<< ", latency: " << mParams.latencyUs << " us";
 	}
 	catch(const AlsaPcmException& e)
 	{
-		if (hwParams)
-		{
-			snd_pcm_hw_params_free(hwParams);
-
-			close();
-		}
+		close();
 
 		throw;
 	}
@@ -111,21 +111,353 @@ void AlsaPcm::close()
 	}
 
 	mHandle = nullptr;
+	mConverter.reset();
+	mStreamConverter.reset();
+	mResampler.reset();
+}
+
+void AlsaPcm::recycle()
+{
+	DLOG(mLog, DEBUG) << "Recycle pcm device: " << mName;
+
+	if (!mHandle)
+	{
+		return;
+	}
+
+	setNonBlock(false);
+
+	if (mType == StreamType::PLAYBACK)
+	{
+		snd_pcm_drain(mHandle);
+	}
+	else
+	{
+		snd_pcm_drop(mHandle);
+	}
+
+	if (snd_pcm_prepare(mHandle) < 0)
+	{
+		throw AlsaPcmException("Can't prepare audio interface for use");
+	}
+
+	if (mResampler)
+	{
+		mResampler->reset();
+		mResampler->setRatioAdjustment(1.0);
+	}
+
+	if (mDriftController)
+	{
+		mDriftController->reset();
+	}
+}
+
+void AlsaPcm::drop()
+{
+	DLOG(mLog, DEBUG) << "Drop pcm device: " << mName;
+
+	if (mHandle)
+	{
+		snd_pcm_drop(mHandle);
+	}
 }
 
 void AlsaPcm::read(uint8_t* buffer, ssize_t size)
 {
 	DLOG(mLog, DEBUG) << "Read from pcm device: " << mName << ", size: " << size;
 
-	auto numFrames = snd_pcm_bytes_to_frames(mHandle, size);
+	if (mResampler)
+	{
+		readResampled(buffer, size / mFrameSize);
+	}
+	else
+	{
+		readConverted(buffer, size / mFrameSize);
+	}
+}
+
+void AlsaPcm::write(uint8_t* buffer, ssize_t size)
+{
+	DLOG(mLog, DEBUG) << "Write to pcm device: " << mName << ", size: " << size;
+
+	if (mResampler)
+	{
+		writeResampled(buffer, size / mFrameSize);
+	}
+	else
+	{
+		writeConverted(buffer, size / mFrameSize);
+	}
+
+	if (mDriftController)
+	{
+		mResampler->setRatioAdjustment(mDriftController->update(getDelay()));
+	}
+}
+
+size_t AlsaPcm::tryWrite(const uint8_t* buffer, size_t size)
+{
+	if (mResampler)
+	{
+		return tryWriteResampled(buffer, size / mFrameSize) * mFrameSize;
+	}
+
+	return tryWriteConverted(buffer, size / mFrameSize) * mFrameSize;
+}
+
+snd_pcm_uframes_t AlsaPcm::getAvail()
+{
+	auto avail = getDeviceAvail();
+
+	if (mResampler && mType == StreamType::PLAYBACK)
+	{
+		return mResampler->getInputFrames(avail);
+	}
+
+	return avail;
+}
+
+snd_pcm_sframes_t AlsaPcm::getDelay()
+{
+	snd_pcm_sframes_t delay = 0;
+
+	if (auto status = snd_pcm_delay(mHandle, &delay))
+	{
+		recover(status);
+
+		return 0;
+	}
+
+	// Report the delay in stream frames
+	return static_cast<int64_t>(delay) * mParams.rate / mDeviceRate;
+}
+
+void AlsaPcm::setRateAdjustment(double factor)
+{
+	if (mResampler)
+	{
+		mResampler->setRatioAdjustment(factor);
+	}
+}
+
+void AlsaPcm::readConverted(uint8_t* buffer, snd_pcm_uframes_t numFrames)
+{
+	if (mAccess == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+	{
+		readMmap(buffer, numFrames);
+
+		return;
+	}
+
+	if (!mConverter)
+	{
+		readFrames(buffer, numFrames);
+
+		return;
+	}
+
+	snd_pcm_uframes_t convertFrames = mConvertBuffer.size() / snd_pcm_frames_to_bytes(mHandle, 1);
+
+	while(numFrames > 0)
+	{
+		auto frames = min(numFrames, convertFrames);
+
+		readFrames(mConvertBuffer.data(), frames);
+
+		mConverter->convert(mConvertBuffer.data(), buffer, frames * mParams.numChannels);
+
+		numFrames -= frames;
+		buffer = &buffer[frames * mConvertFrameSize];
+	}
+}
+
+void AlsaPcm::writeConverted(const uint8_t* buffer, snd_pcm_uframes_t numFrames)
+{
+	if (mAccess == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+	{
+		writeMmap(buffer, numFrames);
+
+		return;
+	}
+
+	if (!mConverter)
+	{
+		writeFrames(buffer, numFrames);
+
+		return;
+	}
+
+	snd_pcm_uframes_t convertFrames = mConvertBuffer.size() / snd_pcm_frames_to_bytes(mHandle, 1);
+
+	while(numFrames > 0)
+	{
+		auto frames = min(numFrames, convertFrames);
+
+		mConverter->convert(buffer, mConvertBuffer.data(), frames * mParams.numChannels);
+
+		writeFrames(mConvertBuffer.data(), frames);
+
+		numFrames -= frames;
+		buffer = &buffer[frames * mConvertFrameSize];
+	}
+}
+
+snd_pcm_uframes_t AlsaPcm::tryWriteConverted(const uint8_t* buffer, snd_pcm_uframes_t numFrames)
+{
+	if (mAccess == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+	{
+		auto status = transferMmap(const_cast<uint8_t*>(buffer), numFrames);
+
+		startIfReady();
+
+		return status;
+	}
+
+	if (mConverter)
+	{
+		// Convert only what the device accepts now
+		numFrames = min(numFrames, static_cast<snd_pcm_uframes_t>(mConvertBuffer.size() /
+																  snd_pcm_frames_to_bytes(mHandle, 1)));
+		numFrames = min(numFrames, getDeviceAvail());
+
+		if (numFrames == 0)
+		{
+			return 0;
+		}
+
+		mConverter->convert(buffer, mConvertBuffer.data(), numFrames * mParams.numChannels);
+
+		buffer = mConvertBuffer.data();
+	}
+
+	auto status = snd_pcm_writei(mHandle, buffer, numFrames);
+
+	if (status == -EAGAIN)
+	{
+		return 0;
+	}
+
+	if (status == -EPIPE)
+	{
+		LOG_LIMIT(mLog, WARNING, mXrunLimit) << "Device: " << mName << ", message: " << snd_strerror(status);
+
+		snd_pcm_prepare(mHandle);
+
+		return 0;
+	}
+
+	if (status < 0)
+	{
+		throw AlsaPcmException("Write to audio interface failed: " + mName + ". Error: " + snd_strerror(status));
+	}
+
+	return status;
+}
+
+void AlsaPcm::readResampled(uint8_t* buffer, snd_pcm_uframes_t numFrames)
+{
+	snd_pcm_uframes_t streamFrames = mStreamBuffer.size() / mParams.numChannels;
+	snd_pcm_uframes_t deviceFrames = mDeviceBuffer.size() / mParams.numChannels;
+
+	while(numFrames > 0)
+	{
+		size_t numOut = min(numFrames, streamFrames);
+		size_t numIn = min(static_cast<snd_pcm_uframes_t>(mResampler->getInputFrames(numOut)),
+						   deviceFrames);
+
+		readConverted(reinterpret_cast<uint8_t*>(mDeviceBuffer.data()), numIn);
+
+		mResampler->process(mDeviceBuffer.data(), numIn, mStreamBuffer.data(), numOut);
+
+		mStreamConverter->convert(reinterpret_cast<uint8_t*>(mStreamBuffer.data()),
+								  buffer, numOut * mParams.numChannels);
+
+		numFrames -= numOut;
+		buffer = &buffer[numOut * mFrameSize];
+	}
+}
+
+void AlsaPcm::writeResampled(const uint8_t* buffer, snd_pcm_uframes_t numFrames)
+{
+	snd_pcm_uframes_t streamFrames = mStreamBuffer.size() / mParams.numChannels;
+	snd_pcm_uframes_t deviceFrames = mDeviceBuffer.size() / mParams.numChannels;
 
+	while(numFrames > 0)
+	{
+		auto frames = min(numFrames, streamFrames);
+
+		mStreamConverter->convert(buffer, reinterpret_cast<uint8_t*>(mStreamBuffer.data()),
+								  frames * mParams.numChannels);
+
+		size_t consumed = 0;
+
+		while(consumed < frames)
+		{
+			size_t numIn = frames - consumed;
+			size_t numOut = deviceFrames;
+
+			mResampler->process(&mStreamBuffer[consumed * mParams.numChannels], numIn,
+								mDeviceBuffer.data(), numOut);
+
+			writeConverted(reinterpret_cast<uint8_t*>(mDeviceBuffer.data()), numOut);
+
+			consumed += numIn;
+		}
+
+		numFrames -= frames;
+		buffer = &buffer[frames * mFrameSize];
+	}
+}
+
+snd_pcm_uframes_t AlsaPcm::tryWriteResampled(const uint8_t* buffer, snd_pcm_uframes_t numFrames)
+{
+	snd_pcm_uframes_t streamFrames = mStreamBuffer.size() / mParams.numChannels;
+	snd_pcm_uframes_t deviceFrames = mDeviceBuffer.size() / mParams.numChannels;
+
+	snd_pcm_uframes_t consumed = 0;
+
+	while(consumed < numFrames)
+	{
+		// Produce only what the device accepts now
+		size_t numOut = min(getDeviceAvail(), deviceFrames);
+
+		if (numOut == 0)
+		{
+			break;
+		}
+
+		size_t numIn = min({ numFrames - consumed, streamFrames,
+							 static_cast<snd_pcm_uframes_t>(mResampler->getInputFrames(numOut)) });
+
+		mStreamConverter->convert(&buffer[consumed * mFrameSize],
+								  reinterpret_cast<uint8_t*>(mStreamBuffer.data()),
+								  numIn * mParams.numChannels);
+
+		mResampler->process(mStreamBuffer.data(), numIn, mDeviceBuffer.data(), numOut);
+
+		tryWriteConverted(reinterpret_cast<uint8_t*>(mDeviceBuffer.data()), numOut);
+
+		consumed += numIn;
+
+		if (numIn == 0 && numOut == 0)
+		{
+			break;
+		}
+	}
+
+	return consumed;
+}
+
+void AlsaPcm::readFrames(uint8_t* buffer, snd_pcm_uframes_t numFrames)
+{
 	while(numFrames > 0)
 	{
 		if (auto status = snd_pcm_readi(mHandle, buffer, numFrames))
 		{
 			if (status == -EPIPE)
 			{
-				LOG(mLog, WARNING) << "Device: " << mName << ", message: " << snd_strerror(status);
+				LOG_LIMIT(mLog, WARNING, mXrunLimit) << "Device: " << mName << ", message: " << snd_strerror(status);
 
 				snd_pcm_prepare(mHandle);
 			}
@@ -142,19 +474,15 @@ void AlsaPcm::read(uint8_t* buffer, ssize_t size)
 	}
 }
 
-void AlsaPcm::write(uint8_t* buffer, ssize_t size)
+void AlsaPcm::writeFrames(const uint8_t* buffer, snd_pcm_uframes_t numFrames)
 {
-	DLOG(mLog, DEBUG) << "Write to pcm device: " << mName << ", size: " << size;
-
-	auto numFrames = snd_pcm_bytes_to_frames(mHandle, size);
-
 	while(numFrames > 0)
 	{
 		if (auto status = snd_pcm_writei(mHandle, buffer, numFrames))
 		{
 			if (status == -EPIPE)
 			{
-				LOG(mLog, WARNING) << "Device: " << mName << ", message: " << snd_strerror(status);
+				LOG_LIMIT(mLog, WARNING, mXrunLimit) << "Device: " << mName << ", message: " << snd_strerror(status);
 
 				snd_pcm_prepare(mHandle);
 			}
@@ -171,6 +499,488 @@ void AlsaPcm::write(uint8_t* buffer, ssize_t size)
 	}
 }
 
+snd_pcm_uframes_t AlsaPcm::getDeviceAvail()
+{
+	auto avail = snd_pcm_avail_update(mHandle);
+
+	if (avail < 0)
+	{
+		recover(avail);
+
+		return 0;
+	}
+
+	return avail;
+}
+
+void AlsaPcm::setNonBlock(bool nonBlock)
+{
+	if (snd_pcm_nonblock(mHandle, nonBlock ? 1 : 0) < 0)
+	{
+		throw AlsaPcmException("Can't set non block mode " + mName);
+	}
+}
+
+size_t AlsaPcm::getFrameSize() const
+{
+	return mFrameSize;
+}
+
+size_t AlsaPcm::getPeriodBytes() const
+{
+	// Counted in stream frames, the device may run at another rate
+	return max<size_t>(static_cast<uint64_t>(mPeriodSize) * mParams.rate / mDeviceRate, 1) *
+		   mFrameSize;
+}
+
+void AlsaPcm::getPollDescriptors(std::vector<pollfd>& fds)
+{
+	auto count = snd_pcm_poll_descriptors_count(mHandle);
+
+	if (count <= 0)
+	{
+		throw AlsaPcmException("Can't get poll descriptors count " + mName);
+	}
+
+	fds.resize(count);
+
+	if (snd_pcm_poll_descriptors(mHandle, fds.data(), count) < 0)
+	{
+		throw AlsaPcmException("Can't get poll descriptors " + mName);
+	}
+}
+
+unsigned short AlsaPcm::getPollEvents(pollfd* fds, size_t count)
+{
+	unsigned short events = 0;
+
+	if (snd_pcm_poll_descriptors_revents(mHandle, fds, count, &events) < 0)
+	{
+		throw AlsaPcmException("Can't get poll events " + mName);
+	}
+
+	return events;
+}
+
+void AlsaPcm::setHwParams()
+{
+	snd_pcm_hw_params_t *hwParams = nullptr;
+
+	snd_pcm_hw_params_alloca(&hwParams);
+
+	if (snd_pcm_hw_params_any(mHandle, hwParams) < 0)
+	{
+		throw AlsaPcmException("Can't allocate hw params " + mName);
+	}
+
+	setAccess(hwParams, mParams.mmap);
+
+	setFormat(hwParams);
+	setRate(hwParams);
+
+	if (snd_pcm_hw_params_set_channels(mHandle, hwParams, mParams.numChannels) < 0)
+	{
+		throw AlsaPcmException("Can't set channels " + mName);
+	}
+
+	if (mParams.latencyUs)
+	{
+		unsigned int bufferTime = mParams.latencyUs;
+		unsigned int periodTime = mParams.latencyUs / (mParams.numPeriods ? mParams.numPeriods : 1);
+
+		if (snd_pcm_hw_params_set_buffer_time_near(mHandle, hwParams, &bufferTime, 0) < 0)
+		{
+			throw AlsaPcmException("Can't set buffer time " + mName);
+		}
+
+		if (snd_pcm_hw_params_set_period_time_near(mHandle, hwParams, &periodTime, 0) < 0)
+		{
+			throw AlsaPcmException("Can't set period time " + mName);
+		}
+	}
+
+	if (snd_pcm_hw_params(mHandle, hwParams) < 0)
+	{
+		throw AlsaPcmException("Can't set hwParams " + mName);
+	}
+
+	if (snd_pcm_hw_params_get_buffer_size(hwParams, &mBufferSize) < 0 ||
+		snd_pcm_hw_params_get_period_size(hwParams, &mPeriodSize, 0) < 0 ||
+		snd_pcm_hw_params_get_buffer_time(hwParams, &mParams.latencyUs, 0) < 0 ||
+		snd_pcm_hw_params_get_periods(hwParams, &mParams.numPeriods, 0) < 0)
+	{
+		throw AlsaPcmException("Can't get buffer configuration " + mName);
+	}
+
+	createConverters();
+}
+
+void AlsaPcm::setSwParams()
+{
+	snd_pcm_sw_params_t *swParams = nullptr;
+
+	snd_pcm_sw_params_alloca(&swParams);
+
+	if (snd_pcm_sw_params_current(mHandle, swParams) < 0)
+	{
+		throw AlsaPcmException("Can't get sw params " + mName);
+	}
+
+	// Without the target latency the device keeps its default sw params
+	if (!mRequestedParams.latencyUs)
+	{
+		if (snd_pcm_sw_params_get_start_threshold(swParams, &mStartThreshold) < 0)
+		{
+			throw AlsaPcmException("Can't get start threshold " + mName);
+		}
+
+		return;
+	}
+
+	// Wake up once per period
+	if (snd_pcm_sw_params_set_avail_min(mHandle, swParams, mPeriodSize) < 0)
+	{
+		throw AlsaPcmException("Can't set avail min " + mName);
+	}
+
+	// Playback starts when the buffer is filled by whole periods, capture
+	// starts on the first read
+	mStartThreshold = mType == StreamType::PLAYBACK ? (mBufferSize / mPeriodSize) * mPeriodSize : 1;
+
+	if (snd_pcm_sw_params_set_start_threshold(mHandle, swParams, mStartThreshold) < 0)
+	{
+		throw AlsaPcmException("Can't set start threshold " + mName);
+	}
+
+	if (snd_pcm_sw_params(mHandle, swParams) < 0)
+	{
+		throw AlsaPcmException("Can't set sw params " + mName);
+	}
+}
+
+void AlsaPcm::setAccess(snd_pcm_hw_params_t* hwParams, bool mmap)
+{
+	if (mmap)
+	{
+		if (snd_pcm_hw_params_set_access(mHandle, hwParams, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0)
+		{
+			mAccess = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+
+			return;
+		}
+
+		LOG(mLog, WARNING) << "Device: " << mName << " doesn't support mmap access, fallback to RW";
+	}
+
+	if (snd_pcm_hw_params_set_access(mHandle, hwParams, SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
+	{
+		throw AlsaPcmException("Can't set access " + mName);
+	}
+
+	mAccess = SND_PCM_ACCESS_RW_INTERLEAVED;
+}
+
+void AlsaPcm::setFormat(snd_pcm_hw_params_t* hwParams)
+{
+	mDeviceFormat = mParams.format;
+
+	if (snd_pcm_hw_params_test_format(mHandle, hwParams, mDeviceFormat) < 0 &&
+		FormatConverter::isSupported(mParams.format))
+	{
+		mDeviceFormat = findDeviceFormat(hwParams);
+
+		LOG(mLog, INFO) << "Device: " << mName << " doesn't support format "
+						<< snd_pcm_format_name(mParams.format) << ", convert to "
+						<< snd_pcm_format_name(mDeviceFormat) << ", kernels: "
+						<< FormatConverter::getImplementation();
+	}
+
+	if (snd_pcm_hw_params_set_format(mHandle, hwParams, mDeviceFormat) < 0)
+	{
+		throw AlsaPcmException("Can't set format " + mName);
+	}
+}
+
+void AlsaPcm::setRate(snd_pcm_hw_params_t* hwParams)
+{
+	mDeviceRate = mParams.rate;
+
+	if (snd_pcm_hw_params_set_rate_near(mHandle, hwParams, &mDeviceRate, 0) < 0)
+	{
+		throw AlsaPcmException("Can't set rate " + mName);
+	}
+
+	if (mDeviceRate == mParams.rate)
+	{
+		return;
+	}
+
+	if (!FormatConverter::isSupported(mParams.format))
+	{
+		LOG(mLog, WARNING) << "Device: " << mName << " doesn't support rate "
+						   << mParams.rate << ", use " << mDeviceRate;
+
+		mParams.rate = mDeviceRate;
+
+		return;
+	}
+
+	LOG(mLog, INFO) << "Device: " << mName << " doesn't support rate "
+					<< mParams.rate << ", resample to " << mDeviceRate << ", kernels: "
+					<< Resampler::getImplementation();
+}
+
+void AlsaPcm::createConverters()
+{
+	mConverter.reset();
+	mStreamConverter.reset();
+	mResampler.reset();
+	mDriftController.reset();
+
+	mFrameSize = snd_pcm_format_size(mParams.format, mParams.numChannels);
+
+	auto format = mParams.format;
+
+	bool adaptive = mParams.adaptive && mType == StreamType::PLAYBACK &&
+					FormatConverter::isSupported(mParams.format);
+
+	if (mDeviceRate != mParams.rate || adaptive)
+	{
+		// Resampling is done on float samples
+		format = SND_PCM_FORMAT_FLOAT;
+
+		if (mType == StreamType::PLAYBACK)
+		{
+			mStreamConverter.reset(new FormatConverter(mParams.format, format));
+			mResampler.reset(new Resampler(mParams.numChannels, mParams.rate, mDeviceRate,
+										   Resampler::getQuality()));
+		}
+		else
+		{
+			mStreamConverter.reset(new FormatConverter(format, mParams.format));
+			mResampler.reset(new Resampler(mParams.numChannels, mDeviceRate, mParams.rate,
+										   Resampler::getQuality()));
+		}
+
+		mStreamBuffer.resize(mPeriodSize * mParams.numChannels);
+		mDeviceBuffer.resize(mPeriodSize * mParams.numChannels);
+
+		LOG(mLog, DEBUG) << "Resampler taps: " << mResampler->getNumTaps();
+	}
+
+	if (adaptive)
+	{
+		// Blocking writes keep the device buffer full: compensate the drift
+		// when the stream is slower than the device
+		mDriftController.reset(new DriftController(
+				static_cast<double>(mBufferSize - mPeriodSize) * mParams.rate / mDeviceRate,
+				mParams.rate));
+	}
+
+	if (format != mDeviceFormat)
+	{
+		if (mType == StreamType::PLAYBACK)
+		{
+			mConverter.reset(new FormatConverter(format, mDeviceFormat));
+		}
+		else
+		{
+			mConverter.reset(new FormatConverter(mDeviceFormat, format));
+		}
+
+		mConvertBuffer.resize(snd_pcm_frames_to_bytes(mHandle, mPeriodSize));
+	}
+
+	mConvertFrameSize = snd_pcm_format_size(format, mParams.numChannels);
+}
+
+snd_pcm_format_t AlsaPcm::findDeviceFormat(snd_pcm_hw_params_t* hwParams)
+{
+	// Native endian formats in order of preference: keep the resolution of
+	// wide formats if possible
+	static const snd_pcm_format_t cWideFormats[] =
+	{
+		SND_PCM_FORMAT_S32, SND_PCM_FORMAT_FLOAT, SND_PCM_FORMAT_S24,
+		SND_PCM_FORMAT_S16, SND_PCM_FORMAT_U8
+	};
+
+	static const snd_pcm_format_t cNarrowFormats[] =
+	{
+		SND_PCM_FORMAT_S16, SND_PCM_FORMAT_S32, SND_PCM_FORMAT_S24,
+		SND_PCM_FORMAT_FLOAT, SND_PCM_FORMAT_U8
+	};
+
+	bool wide = snd_pcm_format_width(mParams.format) > 16;
+
+	for (auto format : wide ? cWideFormats : cNarrowFormats)
+	{
+		if (snd_pcm_hw_params_test_format(mHandle, hwParams, format) == 0)
+		{
+			return format;
+		}
+	}
+
+	throw AlsaPcmException("Can't find supported format " + mName);
+}
+
+void AlsaPcm::readMmap(uint8_t* buffer, snd_pcm_uframes_t numFrames)
+{
+	while(numFrames > 0)
+	{
+		if (snd_pcm_state(mHandle) == SND_PCM_STATE_PREPARED)
+		{
+			if (auto status = snd_pcm_start(mHandle))
+			{
+				recover(status);
+			}
+		}
+
+		auto status = transferMmap(buffer, numFrames);
+
+		if (status == 0)
+		{
+			auto ret = snd_pcm_wait(mHandle, -1);
+
+			if (ret < 0)
+			{
+				recover(ret);
+			}
+		}
+
+		numFrames -= status;
+		buffer = &buffer[status * mConvertFrameSize];
+	}
+}
+
+void AlsaPcm::writeMmap(const uint8_t* buffer, snd_pcm_uframes_t numFrames)
+{
+	while(numFrames > 0)
+	{
+		auto status = transferMmap(const_cast<uint8_t*>(buffer), numFrames);
+
+		startIfReady();
+
+		if (status == 0)
+		{
+			auto ret = snd_pcm_wait(mHandle, -1);
+
+			if (ret < 0)
+			{
+				recover(ret);
+			}
+		}
+
+		numFrames -= status;
+		buffer = &buffer[status * mConvertFrameSize];
+	}
+}
+
+snd_pcm_uframes_t AlsaPcm::transferMmap(uint8_t* buffer, snd_pcm_uframes_t numFrames)
+{
+	auto avail = snd_pcm_avail_update(mHandle);
+
+	if (avail < 0)
+	{
+		recover(avail);
+
+		return 0;
+	}
+
+	numFrames = min(numFrames, static_cast<snd_pcm_uframes_t>(avail));
+
+	snd_pcm_uframes_t transferred = 0;
+
+	while(transferred < numFrames)
+	{
+		const snd_pcm_channel_area_t* areas = nullptr;
+		snd_pcm_uframes_t offset = 0;
+		snd_pcm_uframes_t frames = numFrames - transferred;
+
+		if (auto status = snd_pcm_mmap_begin(mHandle, &areas, &offset, &frames))
+		{
+			recover(status);
+
+			break;
+		}
+
+		// Interleaved access: all channels share the first area
+		auto area = static_cast<uint8_t*>(areas[0].addr) + (areas[0].first + offset * areas[0].step) / 8;
+		auto data = &buffer[transferred * mConvertFrameSize];
+
+		// Convert directly into or from the device buffer
+		if (mType == StreamType::PLAYBACK)
+		{
+			copyFrames(data, area, frames);
+		}
+		else
+		{
+			copyFrames(area, data, frames);
+		}
+
+		auto status = snd_pcm_mmap_commit(mHandle, offset, frames);
+
+		if (status < 0)
+		{
+			recover(status);
+
+			break;
+		}
+
+		transferred += status;
+
+		if (static_cast<snd_pcm_uframes_t>(status) != frames)
+		{
+			break;
+		}
+	}
+
+	return transferred;
+}
+
+void AlsaPcm::copyFrames(const uint8_t* src, uint8_t* dst, snd_pcm_uframes_t numFrames)
+{
+	if (mConverter)
+	{
+		mConverter->convert(src, dst, numFrames * mParams.numChannels);
+	}
+	else
+	{
+		memcpy(dst, src, numFrames * mConvertFrameSize);
+	}
+}
+
+void AlsaPcm::startIfReady()
+{
+	if (snd_pcm_state(mHandle) != SND_PCM_STATE_PREPARED)
+	{
+		return;
+	}
+
+	auto avail = snd_pcm_avail_update(mHandle);
+
+	if (avail >= 0 && mBufferSize - avail >= mStartThreshold)
+	{
+		if (auto status = snd_pcm_start(mHandle))
+		{
+			recover(status);
+		}
+	}
+}
+
+void AlsaPcm::recover(int status)
+{
+	if (status == -EPIPE)
+	{
+		LOG_LIMIT(mLog, WARNING, mXrunLimit) << "Device: " << mName << ", message: " << snd_strerror(status);
+
+		snd_pcm_prepare(mHandle);
+	}
+	else if (status != -EAGAIN)
+	{
+		throw AlsaPcmException("Audio interface failed: " + mName + ". Error: " + snd_strerror(status));
+	}
+}
+
 void AlsaPcm::info()
 {
 	int card = -1;
@@ -8,11 +8,16 @@
 #ifndef SRC_ALSA_ALSAPCM_HPP_
 #define SRC_ALSA_ALSAPCM_HPP_
 
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <alsa/asoundlib.h>
 
+#include "DriftController.hpp"
+#include "FormatConverter.hpp"
 #include "Log.hpp"
+#include "Resampler.hpp"
 
 namespace Alsa {
 
@@ -21,41 +26,123 @@ enum class StreamType {PLAYBACK, CAPTURE};
 class AlsaPcmException : public std::exception
 {
 public:
-	explicit AlsaPcmException(const std::string& msg) : mMsg(msg) {};
+	explicit AlsaPcmException(const std::string& msg, int error = 0) :
+		mMsg(msg), mError(error) {};
 
 	const char* what() const throw() { return mMsg.c_str(); };
 
+	/**
+	 * Returns negative ALSA error code or 0 if unknown
+	 */
+	int getError() const { return mError; }
+
 private:
 	std::string mMsg;
+	int mError;
 };
 
 struct AlsaPcmParams
 {
-	AlsaPcmParams(snd_pcm_format_t f, unsigned r, unsigned c) :
-		format(f), rate(r), numChannels(c) {}
+	AlsaPcmParams(snd_pcm_format_t f, unsigned r, unsigned c, bool m = false,
+				  unsigned l = 0, unsigned p = 0, bool a = false) :
+		format(f), rate(r), numChannels(c), mmap(m), latencyUs(l), numPeriods(p),
+		adaptive(a) {}
 
 	snd_pcm_format_t	format;
 	unsigned			rate;
 	unsigned			numChannels;
+	bool				mmap;		//!< try mmap access, RW is used if not supported
+	unsigned			latencyUs;	//!< target buffer time, 0 - device default
+	unsigned			numPeriods;	//!< target number of periods in the buffer
+	bool				adaptive;	//!< compensate playback clock drift by resampling
 };
 
 class AlsaPcm
 {
 public:
-	explicit AlsaPcm(StreamType type, const std::string& name = "default");
+	explicit AlsaPcm(StreamType type, const std::string& name = "default",
+					 int domId = XenBackend::Log::cNoDomain);
 	~AlsaPcm();
 
 	void open(const AlsaPcmParams& params, bool forCapture = false);
 	void close();
+	void recycle();
+	void drop();
+	bool isOpened() const { return mHandle != nullptr; }
+	const std::string& getName() const { return mName; }
+	StreamType getType() const { return mType; }
+	int getDomain() const { return mDomId; }
+	void setDomain(int domId);
+	const AlsaPcmParams& getRequestedParams() const { return mRequestedParams; }
 	void read(uint8_t* buffer, ssize_t size);
 	void write(uint8_t* buffer, ssize_t size);
+	size_t tryWrite(const uint8_t* buffer, size_t size);
+	snd_pcm_uframes_t getAvail();
+	void setNonBlock(bool nonBlock);
+	size_t getFrameSize() const;
+	void getPollDescriptors(std::vector<pollfd>& fds);
+	unsigned short getPollEvents(pollfd* fds, size_t count);
+	snd_pcm_access_t getAccess() const { return mAccess; }
+	const AlsaPcmParams& getParams() const { return mParams; }
+	snd_pcm_format_t getDeviceFormat() const { return mDeviceFormat; }
+	unsigned getDeviceRate() const { return mDeviceRate; }
+	bool isAdaptive() const { return mResampler && mParams.adaptive; }
+	snd_pcm_sframes_t getDelay();
+	void setRateAdjustment(double factor);
+	snd_pcm_uframes_t getPeriodSize() const { return mPeriodSize; }
+	size_t getPeriodBytes() const;
+	snd_pcm_uframes_t getBufferSize() const { return mBufferSize; }
 	void info();
 
 private:
+	const unsigned cXrunLogIntervalMs = 1000;
+
 	snd_pcm_t *mHandle;
 	std::string mName;
 	StreamType mType;
+	AlsaPcmParams mRequestedParams;
+	AlsaPcmParams mParams;
+	snd_pcm_access_t mAccess;
+	snd_pcm_uframes_t mPeriodSize;
+	snd_pcm_uframes_t mBufferSize;
+	snd_pcm_uframes_t mStartThreshold;
+	snd_pcm_format_t mDeviceFormat;
+	unsigned mDeviceRate;
+	size_t mFrameSize;
+	size_t mConvertFrameSize;
+	std::unique_ptr<FormatConverter> mConverter;
+	std::vector<uint8_t> mConvertBuffer;
+	std::unique_ptr<FormatConverter> mStreamConverter;
+	std::unique_ptr<Resampler> mResampler;
+	std::vector<float> mStreamBuffer;
+	std::vector<float> mDeviceBuffer;
+	std::unique_ptr<DriftController> mDriftController;
+	int mDomId;
 	XenBackend::Log mLog;
+	XenBackend::LogRateLimit mXrunLimit;
+
+	void setHwParams();
+	void setSwParams();
+	void setAccess(snd_pcm_hw_params_t* hwParams, bool mmap);
+	void setFormat(snd_pcm_hw_params_t* hwParams);
+	snd_pcm_format_t findDeviceFormat(snd_pcm_hw_params_t* hwParams);
+	void setRate(snd_pcm_hw_params_t* hwParams);
+	void createConverters();
+	snd_pcm_uframes_t getDeviceAvail();
+	void readResampled(uint8_t* buffer, snd_pcm_uframes_t numFrames);
+	void writeResampled(const uint8_t* buffer, snd_pcm_uframes_t numFrames);
+	snd_pcm_uframes_t tryWriteResampled(const uint8_t* buffer, snd_pcm_uframes_t numFrames);
+	void readConverted(uint8_t* buffer, snd_pcm_uframes_t numFrames);
+	void writeConverted(const uint8_t* buffer, snd_pcm_uframes_t numFrames);
+	snd_pcm_uframes_t tryWriteConverted(const uint8_t* buffer, snd_pcm_uframes_t numFrames);
+	void readFrames(uint8_t* buffer, snd_pcm_uframes_t numFrames);
+	void writeFrames(const uint8_t* buffer, snd_pcm_uframes_t numFrames);
+	void readMmap(uint8_t* buffer, snd_pcm_uframes_t numFrames);
+	void writeMmap(const uint8_t* buffer, snd_pcm_uframes_t numFrames);
+	snd_pcm_uframes_t transferMmap(uint8_t* buffer, snd_pcm_uframes_t numFrames);
+	void copyFrames(const uint8_t* src, uint8_t* dst, snd_pcm_uframes_t numFrames);
+	void startIfReady();
+	void recover(int status);
 
 	void showCardInfo(int card);
 	void showPcmDevicesInfo(snd_ctl_t* handle);
@@ -0,0 +1,200 @@
+/*
+ *  Pool of opened pcm devices
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "AlsaPcmPool.hpp"
+
+using std::get;
+using std::list;
+using std::lock_guard;
+using std::make_tuple;
+using std::move;
+using std::mutex;
+using std::string;
+using std::unique_ptr;
+
+namespace Alsa {
+
+mutex AlsaPcmPool::sMutex;
+list<AlsaPcmPool::Entry> AlsaPcmPool::sIdle;
+size_t AlsaPcmPool::sMaxIdle = 4;
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+unique_ptr<AlsaPcm> AlsaPcmPool::acquire(StreamType type, const AlsaPcmParams& params,
+										 const string& name, int domId)
+{
+	auto key = getKey(type, params, name);
+
+	list<Entry> evicted;
+
+	{
+		lock_guard<mutex> lock(sMutex);
+
+		for (auto it = sIdle.begin(); it != sIdle.end(); it++)
+		{
+			if (it->key == key)
+			{
+				auto pcm = move(it->pcm);
+
+				sIdle.erase(it);
+
+				// The parked device may have served another domain
+				pcm->setDomain(domId);
+
+				DLOG("AlsaPcmPool", DEBUG) << "Reuse pcm device: " << name
+										   << ", idle: " << sIdle.size();
+
+				return pcm;
+			}
+		}
+	}
+
+	unique_ptr<AlsaPcm> pcm(new AlsaPcm(type, name, domId));
+
+	try
+	{
+		pcm->open(params);
+	}
+	catch(const AlsaPcmException& e)
+	{
+		{
+			lock_guard<mutex> lock(sMutex);
+
+			evict(name, evicted);
+		}
+
+		if (evicted.empty())
+		{
+			throw;
+		}
+
+		LOG("AlsaPcmPool", WARNING) << "Can't open pcm device: " << name
+									<< ", close " << evicted.size() << " idle device(s) and retry";
+
+		// Close the parked devices before the retry
+		evicted.clear();
+
+		pcm->open(params);
+	}
+
+	return pcm;
+}
+
+void AlsaPcmPool::release(unique_ptr<AlsaPcm> pcm)
+{
+	if (!pcm || !pcm->isOpened())
+	{
+		return;
+	}
+
+	try
+	{
+		pcm->recycle();
+	}
+	catch(const AlsaPcmException& e)
+	{
+		LOG("AlsaPcmPool", WARNING) << e.what();
+
+		return;
+	}
+
+	pcm->setDomain(XenBackend::Log::cNoDomain);
+
+	auto key = getKey(pcm->getType(), pcm->getRequestedParams(), pcm->getName());
+
+	list<Entry> evicted;
+
+	lock_guard<mutex> lock(sMutex);
+
+	if (sMaxIdle == 0)
+	{
+		return;
+	}
+
+	sIdle.push_back(Entry{key, move(pcm)});
+
+	while(sIdle.size() > sMaxIdle)
+	{
+		evicted.splice(evicted.end(), sIdle, sIdle.begin());
+	}
+
+	DLOG("AlsaPcmPool", DEBUG) << "Park pcm device, idle: " << sIdle.size();
+}
+
+void AlsaPcmPool::prewarm(StreamType type, const AlsaPcmParams& params,
+						  const string& name)
+{
+	LOG("AlsaPcmPool", INFO) << "Prewarm pcm device: " << name << ", format: "
+							 << snd_pcm_format_name(params.format) << ", rate: "
+							 << params.rate << ", channels: " << params.numChannels;
+
+	release(acquire(type, params, name));
+}
+
+void AlsaPcmPool::setMaxIdle(size_t maxIdle)
+{
+	list<Entry> evicted;
+
+	lock_guard<mutex> lock(sMutex);
+
+	sMaxIdle = maxIdle;
+
+	while(sIdle.size() > sMaxIdle)
+	{
+		evicted.splice(evicted.end(), sIdle, sIdle.begin());
+	}
+}
+
+void AlsaPcmPool::clear()
+{
+	list<Entry> evicted;
+
+	lock_guard<mutex> lock(sMutex);
+
+	evicted.swap(sIdle);
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+AlsaPcmPool::Key AlsaPcmPool::getKey(StreamType type, const AlsaPcmParams& params,
+									 const string& name)
+{
+	return make_tuple(type, name, params.format, params.rate, params.numChannels,
+					  params.mmap, params.latencyUs, params.numPeriods, params.adaptive);
+}
+
+void AlsaPcmPool::evict(const string& name, list<Entry>& evicted)
+{
+	for (auto it = sIdle.begin(); it != sIdle.end();)
+	{
+		auto current = it++;
+
+		if (get<1>(current->key) == name)
+		{
+			evicted.splice(evicted.end(), sIdle, current);
+		}
+	}
+}
+
+}
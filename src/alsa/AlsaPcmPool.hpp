@@ -0,0 +1,106 @@
+/*
+ *  Pool of opened pcm devices
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_ALSA_ALSAPCMPOOL_HPP_
+#define SRC_ALSA_ALSAPCMPOOL_HPP_
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+#include "AlsaPcm.hpp"
+
+namespace Alsa {
+
+/***************************************************************************//**
+ * Keeps opened and configured pcm devices for reuse.
+ * release() prepares the device and parks it in the pool, acquire() takes
+ * the parked device with the same device name, stream type and parameters
+ * instead of opening a new one. The least recently released devices are
+ * closed when the pool is full. Parked devices keep the hardware busy: if
+ * a device can't be opened, the parked devices with the same name are closed
+ * and the open is retried.
+ ******************************************************************************/
+class AlsaPcmPool
+{
+public:
+
+	/**
+	 * Returns opened pcm device.
+	 * @param[in] type   stream type
+	 * @param[in] params pcm parameters
+	 * @param[in] name   device name
+	 * @param[in] domId  domain the device serves, its logs are bound to
+	 */
+	static std::unique_ptr<AlsaPcm> acquire(StreamType type, const AlsaPcmParams& params,
+											const std::string& name = "default",
+											int domId = XenBackend::Log::cNoDomain);
+
+	/**
+	 * Returns the pcm device to the pool. The device is closed if it can't
+	 * be reused.
+	 * @param[in] pcm pcm device
+	 */
+	static void release(std::unique_ptr<AlsaPcm> pcm);
+
+	/**
+	 * Opens the pcm device and parks it in the pool.
+	 * @param[in] type   stream type
+	 * @param[in] params pcm parameters
+	 * @param[in] name   device name
+	 */
+	static void prewarm(StreamType type, const AlsaPcmParams& params,
+						const std::string& name = "default");
+
+	/**
+	 * Sets maximal number of parked devices, 0 - disable pooling
+	 */
+	static void setMaxIdle(size_t maxIdle);
+
+	/**
+	 * Closes all parked devices
+	 */
+	static void clear();
+
+private:
+
+	typedef std::tuple<StreamType, std::string, snd_pcm_format_t, unsigned,
+					   unsigned, bool, unsigned, unsigned, bool> Key;
+
+	struct Entry
+	{
+		Key key;
+		std::unique_ptr<AlsaPcm> pcm;
+	};
+
+	static std::mutex sMutex;
+	static std::list<Entry> sIdle;
+	static size_t sMaxIdle;
+
+	static Key getKey(StreamType type, const AlsaPcmParams& params,
+					  const std::string& name);
+	static void evict(const std::string& name, std::list<Entry>& evicted);
+};
+
+}
+
+#endif /* SRC_ALSA_ALSAPCMPOOL_HPP_ */
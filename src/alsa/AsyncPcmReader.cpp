@@ -0,0 +1,194 @@
+/*
+ *  Asynchronous PCM reader
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "AsyncPcmReader.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "ThreadPolicy.hpp"
+
+using std::exception;
+using std::max;
+using std::string;
+using std::thread;
+using std::vector;
+
+namespace Alsa {
+
+AsyncPcmReader::AsyncPcmReader(AlsaPcm& pcm, size_t bufferSize) :
+	mPcm(pcm),
+	// The ring holds at least one device period
+	mRing(max(bufferSize - bufferSize % pcm.getFrameSize(), pcm.getPeriodBytes())),
+	// Pull the device by periods
+	mChunkSize(pcm.getPeriodBytes()),
+	mChunk(mChunkSize),
+	mTerminate(false),
+	mError(false),
+	mOverrunBytes(0),
+	mLog("AsyncPcmReader", pcm.getDomain()),
+	mOverrunLimit(cOverrunLogIntervalMs)
+{
+	LOG(mLog, DEBUG) << "Create async reader, prefetch buffer size: " << mRing.getSize()
+					 << ", chunk size: " << mChunkSize;
+
+	mThread = thread(&AsyncPcmReader::readerThread, this);
+}
+
+AsyncPcmReader::~AsyncPcmReader()
+{
+	mTerminate = true;
+
+	if (mThread.joinable())
+	{
+		mWakeup.signal();
+
+		mThread.join();
+	}
+
+	LOG(mLog, DEBUG) << "Delete async reader, overrun bytes: " << mOverrunBytes;
+}
+
+void AsyncPcmReader::read(uint8_t* buffer, size_t size)
+{
+	DLOG(mLog, DEBUG) << "Read data, size: " << size << ", filled: " << mRing.getFilled();
+
+	size_t done = 0;
+
+	while(true)
+	{
+		done += mRing.read(&buffer[done], size - done);
+
+		if (done == size)
+		{
+			break;
+		}
+
+		if (mError)
+		{
+			throw AlsaPcmException("Async reader is stopped due to error");
+		}
+
+		// The reader signals after each chunk, a missed signal is caught by
+		// the ring read above
+		pollfd fd = { .fd = mDataReady.getFd(), .events = POLLIN, .revents = 0 };
+
+		auto ret = poll(&fd, 1, cReadTimeoutMs);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			throw AlsaPcmException("Can't poll capture data: " + string(strerror(errno)));
+		}
+
+		if (ret == 0)
+		{
+			throw AlsaPcmException("Capture data timeout");
+		}
+
+		mDataReady.clear();
+	}
+}
+
+void AsyncPcmReader::readerThread()
+{
+	XenBackend::ThreadPolicy::apply(XenBackend::ThreadPolicy::Group::DEVICE);
+
+	try
+	{
+		vector<pollfd> fds;
+
+		mPcm.getPollDescriptors(fds);
+
+		// The wakeup fd is always the last one
+		fds.push_back({ .fd = mWakeup.getFd(), .events = POLLIN, .revents = 0 });
+
+		// Prepared capture is not polled until started: the first read starts it
+		readChunk();
+
+		while(!mTerminate)
+		{
+			auto ret = poll(fds.data(), fds.size(), -1);
+
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				throw AlsaPcmException("Can't poll pcm device: " + string(strerror(errno)));
+			}
+
+			if (fds.back().revents & POLLIN)
+			{
+				mWakeup.clear();
+			}
+
+			if (mPcm.getPollEvents(fds.data(), fds.size() - 1) & (POLLIN | POLLERR))
+			{
+				readChunk();
+			}
+		}
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+
+		mError = true;
+
+		mDataReady.signal();
+	}
+}
+
+void AsyncPcmReader::readChunk()
+{
+	uint8_t* data = nullptr;
+
+	if (mRing.getWriteRegion(data) >= mChunkSize)
+	{
+		// Read in place if the chunk fits the contiguous region
+		mPcm.read(data, mChunkSize);
+
+		mRing.commit(mChunkSize);
+	}
+	else
+	{
+		mPcm.read(mChunk.data(), mChunkSize);
+
+		auto written = mRing.write(mChunk.data(), mChunkSize);
+
+		if (written < mChunkSize)
+		{
+			mOverrunBytes += mChunkSize - written;
+
+			LOG_LIMIT(mLog, WARNING, mOverrunLimit) << "Prefetch buffer overrun, dropped: " << mChunkSize - written;
+		}
+	}
+
+	mDataReady.signal();
+}
+
+}
@@ -0,0 +1,100 @@
+/*
+ *  Asynchronous PCM reader
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_ALSA_ASYNCPCMREADER_HPP_
+#define SRC_ALSA_ASYNCPCMREADER_HPP_
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "AlsaPcm.hpp"
+#include "EventFd.hpp"
+#include "PcmRing.hpp"
+#include "Log.hpp"
+
+namespace Alsa {
+
+/***************************************************************************//**
+ * Prefetches the captured data so the ring buffer thread doesn't wait for
+ * the device.
+ * The reader thread starts the capture at once, waits for the PCM poll
+ * descriptors and pulls the device by periods into the prefetch buffer.
+ * read() copies the data out of the prefetch buffer and waits only if there
+ * is not enough data. If the prefetch buffer is full the captured data which
+ * doesn't fit is dropped.
+ ******************************************************************************/
+class AsyncPcmReader
+{
+public:
+	/**
+	 * @param[in] pcm        opened capture pcm
+	 * @param[in] bufferSize prefetch buffer size in bytes
+	 */
+	AsyncPcmReader(AlsaPcm& pcm, size_t bufferSize);
+	AsyncPcmReader(const AsyncPcmReader&) = delete;
+	AsyncPcmReader& operator=(AsyncPcmReader const&) = delete;
+	~AsyncPcmReader();
+
+	/**
+	 * Copies the captured data.
+	 * @param[out] buffer pointer to the destination
+	 * @param[in]  size   number of bytes requested
+	 */
+	void read(uint8_t* buffer, size_t size);
+
+	/**
+	 * Returns number of bytes in the prefetch buffer
+	 */
+	size_t getFilled() const { return mRing.getFilled(); }
+
+	/**
+	 * Returns number of bytes dropped due to prefetch buffer overrun
+	 */
+	uint64_t getOverrunBytes() const { return mOverrunBytes; }
+
+private:
+
+	const int cReadTimeoutMs = 1000;
+	const unsigned cOverrunLogIntervalMs = 1000;
+
+	AlsaPcm& mPcm;
+	PcmRing mRing;
+	size_t mChunkSize;
+	std::vector<uint8_t> mChunk;
+
+	XenBackend::EventFd mWakeup;
+	XenBackend::EventFd mDataReady;
+
+	std::thread mThread;
+	std::atomic_bool mTerminate;
+	std::atomic_bool mError;
+	std::atomic<uint64_t> mOverrunBytes;
+
+	XenBackend::Log mLog;
+	XenBackend::LogRateLimit mOverrunLimit;
+
+	void readerThread();
+	void readChunk();
+};
+
+}
+
+#endif /* SRC_ALSA_ASYNCPCMREADER_HPP_ */
@@ -0,0 +1,206 @@
+/*
+ *  Asynchronous PCM writer
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "AsyncPcmWriter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "ThreadPolicy.hpp"
+
+using std::exception;
+using std::max;
+using std::string;
+using std::thread;
+using std::vector;
+
+namespace Alsa {
+
+AsyncPcmWriter::AsyncPcmWriter(AlsaPcm& pcm, size_t bufferSize) :
+	mPcm(pcm),
+	// The ring holds at least one device period
+	mRing(max(bufferSize - bufferSize % pcm.getFrameSize(), pcm.getPeriodBytes())),
+	mFrameSize(pcm.getFrameSize()),
+	mTerminate(false),
+	mDrain(false),
+	mError(false),
+	mDroppedBytes(0),
+	mLog("AsyncPcmWriter", pcm.getDomain())
+{
+	LOG(mLog, DEBUG) << "Create async writer, jitter buffer size: " << mRing.getSize();
+
+	if (mPcm.isAdaptive())
+	{
+		// The device buffer is kept full, the jitter buffer absorbs the drift
+		auto bufferFrames = static_cast<double>(mPcm.getBufferSize()) *
+							mPcm.getParams().rate / mPcm.getDeviceRate();
+
+		mDriftController.reset(new DriftController(bufferFrames + mRing.getSize() / mFrameSize / 2,
+												   mPcm.getParams().rate));
+	}
+
+	mPcm.setNonBlock(true);
+
+	mThread = thread(&AsyncPcmWriter::writerThread, this);
+}
+
+AsyncPcmWriter::~AsyncPcmWriter()
+{
+	mTerminate = true;
+
+	try
+	{
+		stop();
+	}
+	catch(const AlsaPcmException& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+
+	LOG(mLog, DEBUG) << "Delete async writer, dropped bytes: " << mDroppedBytes;
+
+	if (mDriftController)
+	{
+		LOG(mLog, DEBUG) << "Drift adjustment: " << mDriftController->getAdjustmentPpm() << " ppm";
+	}
+}
+
+void AsyncPcmWriter::write(const uint8_t* buffer, size_t size)
+{
+	DLOG(mLog, DEBUG) << "Queue data, size: " << size << ", filled: " << mRing.getFilled();
+
+	if (mError)
+	{
+		throw AlsaPcmException("Async writer is stopped due to error");
+	}
+
+	size -= size % mFrameSize;
+
+	auto written = mRing.write(buffer, size);
+
+	if (written < size)
+	{
+		mDroppedBytes += size - written;
+
+		LOG(mLog, WARNING) << "Jitter buffer overflow, dropped: " << size - written;
+	}
+
+	mWakeup.signal();
+}
+
+void AsyncPcmWriter::drain()
+{
+	mDrain = true;
+
+	stop();
+}
+
+void AsyncPcmWriter::stop()
+{
+	if (mThread.joinable())
+	{
+		mWakeup.signal();
+
+		mThread.join();
+
+		mPcm.setNonBlock(false);
+	}
+}
+
+void AsyncPcmWriter::writerThread()
+{
+	XenBackend::ThreadPolicy::apply(XenBackend::ThreadPolicy::Group::DEVICE);
+
+	try
+	{
+		vector<pollfd> fds;
+
+		mPcm.getPollDescriptors(fds);
+
+		// The wakeup fd is always the last one
+		fds.push_back({ .fd = mWakeup.getFd(), .events = POLLIN, .revents = 0 });
+
+		while(!mTerminate)
+		{
+			bool isEmpty = mRing.getFilled() == 0;
+
+			if (isEmpty && mDrain)
+			{
+				break;
+			}
+
+			// Wait for the wakeup only if there is nothing to write
+			auto ret = poll(isEmpty ? &fds.back() : fds.data(),
+							isEmpty ? 1 : fds.size(),
+							mDrain ? cDrainTimeoutMs : -1);
+
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				throw AlsaPcmException("Can't poll pcm device: " + string(strerror(errno)));
+			}
+
+			if (ret == 0)
+			{
+				LOG(mLog, WARNING) << "Drain timeout, dropped: " << mRing.getFilled();
+
+				break;
+			}
+
+			if (fds.back().revents & POLLIN)
+			{
+				mWakeup.clear();
+			}
+
+			if (!isEmpty && (mPcm.getPollEvents(fds.data(), fds.size() - 1) & (POLLOUT | POLLERR)))
+			{
+				writeChunk();
+			}
+		}
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+
+		mError = true;
+	}
+}
+
+void AsyncPcmWriter::writeChunk()
+{
+	const uint8_t* data = nullptr;
+
+	auto size = mRing.getReadRegion(data);
+
+	mRing.consume(mPcm.tryWrite(data, size - size % mFrameSize));
+
+	if (mDriftController)
+	{
+		mPcm.setRateAdjustment(mDriftController->update(mPcm.getDelay() +
+														mRing.getFilled() / mFrameSize));
+	}
+}
+
+}
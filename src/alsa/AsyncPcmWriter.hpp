@@ -0,0 +1,100 @@
+/*
+ *  Asynchronous PCM writer
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_ALSA_ASYNCPCMWRITER_HPP_
+#define SRC_ALSA_ASYNCPCMWRITER_HPP_
+
+#include <atomic>
+#include <thread>
+
+#include "AlsaPcm.hpp"
+#include "DriftController.hpp"
+#include "EventFd.hpp"
+#include "PcmRing.hpp"
+#include "Log.hpp"
+
+namespace Alsa {
+
+/***************************************************************************//**
+ * Decouples the playback device from the ring buffer thread.
+ * write() puts the data into the jitter buffer and returns immediately. The
+ * writer thread waits for the PCM poll descriptors and feeds the device from
+ * the jitter buffer. If the jitter buffer is full the data which doesn't fit
+ * is dropped. If the pcm is adaptive, the writer keeps the jitter buffer half
+ * full by adjusting the pcm resampling ratio.
+ ******************************************************************************/
+class AsyncPcmWriter
+{
+public:
+	/**
+	 * @param[in] pcm        opened playback pcm, switched to non block mode
+	 *                       for the writer life time
+	 * @param[in] bufferSize jitter buffer size in bytes
+	 */
+	AsyncPcmWriter(AlsaPcm& pcm, size_t bufferSize);
+	AsyncPcmWriter(const AsyncPcmWriter&) = delete;
+	AsyncPcmWriter& operator=(AsyncPcmWriter const&) = delete;
+	~AsyncPcmWriter();
+
+	/**
+	 * Queues the data for playing.
+	 * @param[in] buffer pointer to the data
+	 * @param[in] size   data size in bytes
+	 */
+	void write(const uint8_t* buffer, size_t size);
+
+	/**
+	 * Writes the rest of the jitter buffer to the device and stops the writer
+	 * thread.
+	 */
+	void drain();
+
+	/**
+	 * Returns number of bytes dropped due to jitter buffer overflow
+	 */
+	uint64_t getDroppedBytes() const { return mDroppedBytes; }
+
+private:
+
+	const int cDrainTimeoutMs = 1000;
+
+	AlsaPcm& mPcm;
+	PcmRing mRing;
+	size_t mFrameSize;
+	std::unique_ptr<DriftController> mDriftController;
+
+	XenBackend::EventFd mWakeup;
+
+	std::thread mThread;
+	std::atomic_bool mTerminate;
+	std::atomic_bool mDrain;
+	std::atomic_bool mError;
+	std::atomic<uint64_t> mDroppedBytes;
+
+	XenBackend::Log mLog;
+
+	void stop();
+	void writerThread();
+	void writeChunk();
+};
+
+}
+
+#endif /* SRC_ALSA_ASYNCPCMWRITER_HPP_ */
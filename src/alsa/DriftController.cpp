@@ -0,0 +1,91 @@
+/*
+ *  Clock drift controller
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "DriftController.hpp"
+
+#include <algorithm>
+
+using std::chrono::duration;
+using std::max;
+using std::min;
+
+namespace Alsa {
+
+DriftController::DriftController(double targetFrames, unsigned rate) :
+	mTargetFrames(targetFrames),
+	mRate(rate),
+	mStarted(false),
+	mLevel(0.0),
+	mIntegral(0.0),
+	mAdjustment(0.0),
+	mLog("DriftController")
+{
+	LOG(mLog, DEBUG) << "Create drift controller, target: " << mTargetFrames;
+}
+
+void DriftController::reset()
+{
+	mStarted = false;
+	mIntegral = 0.0;
+	mAdjustment = 0.0;
+}
+
+double DriftController::update(double levelFrames)
+{
+	auto now = Clock::now();
+
+	if (!mStarted)
+	{
+		mStarted = true;
+		mLastUpdate = now;
+		mLastLog = now;
+		mLevel = levelFrames;
+
+		return 1.0;
+	}
+
+	double dt = duration<double>(now - mLastUpdate).count();
+
+	mLastUpdate = now;
+
+	// Filter out the level jumps caused by the block wise writes
+	mLevel += min(1.0, dt / cFilterTimeS) * (levelFrames - mLevel);
+
+	double error = (mLevel - mTargetFrames) / mRate;
+
+	// Limit the integral term to avoid wind up
+	mIntegral += error * dt;
+	mIntegral = max(-cMaxAdjustment, min(cMaxAdjustment, mIntegral * cIntegralGain)) / cIntegralGain;
+
+	mAdjustment = cProportionalGain * error + cIntegralGain * mIntegral;
+	mAdjustment = max(-cMaxAdjustment, min(cMaxAdjustment, mAdjustment));
+
+	if (duration<double>(now - mLastLog).count() >= cLogIntervalS)
+	{
+		mLastLog = now;
+
+		DLOG(mLog, DEBUG) << "Level: " << mLevel << ", target: " << mTargetFrames
+						  << ", adjustment: " << getAdjustmentPpm() << " ppm";
+	}
+
+	return 1.0 + mAdjustment;
+}
+
+}
@@ -0,0 +1,89 @@
+/*
+ *  Clock drift controller
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_ALSA_DRIFTCONTROLLER_HPP_
+#define SRC_ALSA_DRIFTCONTROLLER_HPP_
+
+#include <chrono>
+
+#include "Log.hpp"
+
+namespace Alsa {
+
+/***************************************************************************//**
+ * Keeps the playback queue level at the target by fine tuning the resampling
+ * ratio.
+ * The queue level is low pass filtered and fed into a PI controller. The
+ * controller output is the factor applied to the resampling ratio: above 1
+ * the stream is consumed faster. The adjustment is limited to a range which
+ * is not audible.
+ ******************************************************************************/
+class DriftController
+{
+public:
+	/**
+	 * @param[in] targetFrames target queue level in frames
+	 * @param[in] rate         stream rate
+	 */
+	DriftController(double targetFrames, unsigned rate);
+
+	/**
+	 * Updates the controller with the current queue level.
+	 * @param[in] levelFrames queued frames
+	 * @return resampling ratio factor
+	 */
+	double update(double levelFrames);
+
+	/**
+	 * Restarts the control from the initial state.
+	 */
+	void reset();
+
+	/**
+	 * Returns the current adjustment in ppm
+	 */
+	double getAdjustmentPpm() const { return mAdjustment * 1e6; }
+
+private:
+
+	typedef std::chrono::steady_clock Clock;
+
+	const double cMaxAdjustment = 0.002;
+	const double cProportionalGain = 0.02;
+	const double cIntegralGain = 0.0001;
+	const double cFilterTimeS = 1.0;
+	const double cLogIntervalS = 10.0;
+
+	double mTargetFrames;
+	double mRate;
+
+	bool mStarted;
+	Clock::time_point mLastUpdate;
+	Clock::time_point mLastLog;
+	double mLevel;
+	double mIntegral;
+	double mAdjustment;
+
+	XenBackend::Log mLog;
+};
+
+}
+
+#endif /* SRC_ALSA_DRIFTCONTROLLER_HPP_ */
@@ -0,0 +1,754 @@
+/*
+ *  PCM sample format converter
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "FormatConverter.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "AlsaPcm.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_KERNELS_X86
+#endif
+
+using std::min;
+using std::numeric_limits;
+using std::string;
+
+namespace Alsa {
+
+namespace {
+
+/*******************************************************************************
+ * Generic kernels
+ ******************************************************************************/
+
+void swap16Generic(const uint8_t* src, uint8_t* dst, size_t count)
+{
+	auto in = reinterpret_cast<const uint16_t*>(src);
+	auto out = reinterpret_cast<uint16_t*>(dst);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = __builtin_bswap16(in[i]);
+	}
+}
+
+void swap32Generic(const uint8_t* src, uint8_t* dst, size_t count)
+{
+	auto in = reinterpret_cast<const uint32_t*>(src);
+	auto out = reinterpret_cast<uint32_t*>(dst);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = __builtin_bswap32(in[i]);
+	}
+}
+
+void swap64Generic(const uint8_t* src, uint8_t* dst, size_t count)
+{
+	auto in = reinterpret_cast<const uint64_t*>(src);
+	auto out = reinterpret_cast<uint64_t*>(dst);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = __builtin_bswap64(in[i]);
+	}
+}
+
+void decodeS16Generic(const int16_t* src, int32_t* dst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		dst[i] = static_cast<uint32_t>(static_cast<uint16_t>(src[i])) << 16;
+	}
+}
+
+void encodeS16Generic(const int32_t* src, int16_t* dst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		dst[i] = src[i] >> 16;
+	}
+}
+
+void decodeF32Generic(const float* src, int32_t* dst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		float value = src[i] * 2147483648.0f;
+
+		if (value >= 2147483648.0f)
+		{
+			dst[i] = numeric_limits<int32_t>::max();
+		}
+		else if (value > -2147483648.0f)
+		{
+			dst[i] = lrintf(value);
+		}
+		else
+		{
+			// NaN goes here as well
+			dst[i] = numeric_limits<int32_t>::min();
+		}
+	}
+}
+
+void encodeF32Generic(const int32_t* src, float* dst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		dst[i] = src[i] * (1.0f / 2147483648.0f);
+	}
+}
+
+void decodeF64(const double* src, int32_t* dst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		double value = src[i] * 2147483648.0;
+
+		if (value >= 2147483647.0)
+		{
+			dst[i] = numeric_limits<int32_t>::max();
+		}
+		else if (value > -2147483648.0)
+		{
+			dst[i] = lrint(value);
+		}
+		else
+		{
+			dst[i] = numeric_limits<int32_t>::min();
+		}
+	}
+}
+
+void encodeF64(const int32_t* src, double* dst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		dst[i] = src[i] * (1.0 / 2147483648.0);
+	}
+}
+
+void decodeS8(const int8_t* src, int32_t* dst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		dst[i] = static_cast<uint32_t>(static_cast<uint8_t>(src[i])) << 24;
+	}
+}
+
+void encodeS8(const int32_t* src, int8_t* dst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		dst[i] = src[i] >> 24;
+	}
+}
+
+void decodeS24(const uint32_t* src, int32_t* dst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		dst[i] = src[i] << 8;
+	}
+}
+
+void encodeS24(const int32_t* src, int32_t* dst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		dst[i] = src[i] >> 8;
+	}
+}
+
+void encodeU24(const int32_t* src, uint32_t* dst, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		dst[i] = static_cast<uint32_t>(src[i]) >> 8;
+	}
+}
+
+void flipSign(int32_t* data, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		data[i] ^= numeric_limits<int32_t>::min();
+	}
+}
+
+/*******************************************************************************
+ * x86 kernels
+ ******************************************************************************/
+
+#ifdef CONVERT_KERNELS_X86
+
+__attribute__((target("sse2")))
+void decodeS16Sse2(const int16_t* src, int32_t* dst, size_t count)
+{
+	const auto zero = _mm_setzero_si128();
+
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i]));
+
+		// Interleaving with zero puts the sample to the upper half
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[i]),
+						 _mm_unpacklo_epi16(zero, v));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[i + 4]),
+						 _mm_unpackhi_epi16(zero, v));
+	}
+
+	decodeS16Generic(&src[i], &dst[i], count - i);
+}
+
+__attribute__((target("sse2")))
+void encodeS16Sse2(const int32_t* src, int16_t* dst, size_t count)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		auto lo = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i])), 16);
+		auto hi = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i + 4])), 16);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[i]), _mm_packs_epi32(lo, hi));
+	}
+
+	encodeS16Generic(&src[i], &dst[i], count - i);
+}
+
+__attribute__((target("sse2")))
+void decodeF32Sse2(const float* src, int32_t* dst, size_t count)
+{
+	const auto scale = _mm_set1_ps(2147483648.0f);
+
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		auto v = _mm_mul_ps(_mm_loadu_ps(&src[i]), scale);
+
+		// cvtps returns INT32_MIN for out of range values and NaN:
+		// flip it to INT32_MAX for positive overflow
+		auto overflow = _mm_castps_si128(_mm_cmpge_ps(v, scale));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[i]),
+						 _mm_xor_si128(_mm_cvtps_epi32(v), overflow));
+	}
+
+	decodeF32Generic(&src[i], &dst[i], count - i);
+}
+
+__attribute__((target("sse2")))
+void encodeF32Sse2(const int32_t* src, float* dst, size_t count)
+{
+	const auto scale = _mm_set1_ps(1.0f / 2147483648.0f);
+
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i]));
+
+		_mm_storeu_ps(&dst[i], _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+	}
+
+	encodeF32Generic(&src[i], &dst[i], count - i);
+}
+
+__attribute__((target("ssse3")))
+void swapSsse3(const uint8_t* src, uint8_t* dst, size_t size, const __m128i& mask)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= size; i += 16)
+	{
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i]));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[i]), _mm_shuffle_epi8(v, mask));
+	}
+}
+
+__attribute__((target("ssse3")))
+void swap16Ssse3(const uint8_t* src, uint8_t* dst, size_t count)
+{
+	auto head = count & ~static_cast<size_t>(7);
+
+	swapSsse3(src, dst, head * 2, _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+												9, 8, 11, 10, 13, 12, 15, 14));
+	swap16Generic(&src[head * 2], &dst[head * 2], count - head);
+}
+
+__attribute__((target("ssse3")))
+void swap32Ssse3(const uint8_t* src, uint8_t* dst, size_t count)
+{
+	auto head = count & ~static_cast<size_t>(3);
+
+	swapSsse3(src, dst, head * 4, _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+												11, 10, 9, 8, 15, 14, 13, 12));
+	swap32Generic(&src[head * 4], &dst[head * 4], count - head);
+}
+
+__attribute__((target("ssse3")))
+void swap64Ssse3(const uint8_t* src, uint8_t* dst, size_t count)
+{
+	auto head = count & ~static_cast<size_t>(1);
+
+	swapSsse3(src, dst, head * 8, _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,
+												15, 14, 13, 12, 11, 10, 9, 8));
+	swap64Generic(&src[head * 8], &dst[head * 8], count - head);
+}
+
+__attribute__((target("avx2")))
+void decodeS16Avx2(const int16_t* src, int32_t* dst, size_t count)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i]));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[i]),
+							_mm256_slli_epi32(_mm256_cvtepi16_epi32(v), 16));
+	}
+
+	decodeS16Generic(&src[i], &dst[i], count - i);
+}
+
+__attribute__((target("avx2")))
+void encodeS16Avx2(const int32_t* src, int16_t* dst, size_t count)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		auto lo = _mm256_srai_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&src[i])), 16);
+		auto hi = _mm256_srai_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&src[i + 8])), 16);
+
+		// packs works within 128 bit lanes: restore the order
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[i]),
+							_mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8));
+	}
+
+	encodeS16Sse2(&src[i], &dst[i], count - i);
+}
+
+__attribute__((target("avx2")))
+void decodeF32Avx2(const float* src, int32_t* dst, size_t count)
+{
+	const auto scale = _mm256_set1_ps(2147483648.0f);
+
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		auto v = _mm256_mul_ps(_mm256_loadu_ps(&src[i]), scale);
+		auto overflow = _mm256_castps_si256(_mm256_cmp_ps(v, scale, _CMP_GE_OQ));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[i]),
+							_mm256_xor_si256(_mm256_cvtps_epi32(v), overflow));
+	}
+
+	decodeF32Sse2(&src[i], &dst[i], count - i);
+}
+
+__attribute__((target("avx2")))
+void encodeF32Avx2(const int32_t* src, float* dst, size_t count)
+{
+	const auto scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&src[i]));
+
+		_mm256_storeu_ps(&dst[i], _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+	}
+
+	encodeF32Sse2(&src[i], &dst[i], count - i);
+}
+
+__attribute__((target("avx2")))
+void swapAvx2(const uint8_t* src, uint8_t* dst, size_t size, const __m256i& mask)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= size; i += 32)
+	{
+		auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&src[i]));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[i]), _mm256_shuffle_epi8(v, mask));
+	}
+}
+
+__attribute__((target("avx2")))
+void swap16Avx2(const uint8_t* src, uint8_t* dst, size_t count)
+{
+	auto head = count & ~static_cast<size_t>(15);
+
+	swapAvx2(src, dst, head * 2, _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+												  9, 8, 11, 10, 13, 12, 15, 14,
+												  1, 0, 3, 2, 5, 4, 7, 6,
+												  9, 8, 11, 10, 13, 12, 15, 14));
+	swap16Ssse3(&src[head * 2], &dst[head * 2], count - head);
+}
+
+__attribute__((target("avx2")))
+void swap32Avx2(const uint8_t* src, uint8_t* dst, size_t count)
+{
+	auto head = count & ~static_cast<size_t>(7);
+
+	swapAvx2(src, dst, head * 4, _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+												  11, 10, 9, 8, 15, 14, 13, 12,
+												  3, 2, 1, 0, 7, 6, 5, 4,
+												  11, 10, 9, 8, 15, 14, 13, 12));
+	swap32Ssse3(&src[head * 4], &dst[head * 4], count - head);
+}
+
+__attribute__((target("avx2")))
+void swap64Avx2(const uint8_t* src, uint8_t* dst, size_t count)
+{
+	auto head = count & ~static_cast<size_t>(3);
+
+	swapAvx2(src, dst, head * 8, _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,
+												  15, 14, 13, 12, 11, 10, 9, 8,
+												  7, 6, 5, 4, 3, 2, 1, 0,
+												  15, 14, 13, 12, 11, 10, 9, 8));
+	swap64Ssse3(&src[head * 8], &dst[head * 8], count - head);
+}
+
+#endif
+
+/*******************************************************************************
+ * Dispatch
+ ******************************************************************************/
+
+typedef void (*SwapFn)(const uint8_t*, uint8_t*, size_t);
+
+struct Kernels
+{
+	SwapFn swap16;
+	SwapFn swap32;
+	SwapFn swap64;
+	void (*decodeS16)(const int16_t*, int32_t*, size_t);
+	void (*encodeS16)(const int32_t*, int16_t*, size_t);
+	void (*decodeF32)(const float*, int32_t*, size_t);
+	void (*encodeF32)(const int32_t*, float*, size_t);
+};
+
+Kernels gKernels =
+{
+	swap16Generic, swap32Generic, swap64Generic,
+	decodeS16Generic, encodeS16Generic, decodeF32Generic, encodeF32Generic
+};
+
+const char* selectKernels()
+{
+#ifdef CONVERT_KERNELS_X86
+
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		gKernels = { swap16Avx2, swap32Avx2, swap64Avx2,
+					 decodeS16Avx2, encodeS16Avx2, decodeF32Avx2, encodeF32Avx2 };
+
+		return "avx2";
+	}
+
+	if (__builtin_cpu_supports("ssse3"))
+	{
+		gKernels = { swap16Ssse3, swap32Ssse3, swap64Ssse3,
+					 decodeS16Sse2, encodeS16Sse2, decodeF32Sse2, encodeF32Sse2 };
+
+		return "ssse3";
+	}
+
+	if (__builtin_cpu_supports("sse2"))
+	{
+		gKernels.decodeS16 = decodeS16Sse2;
+		gKernels.encodeS16 = encodeS16Sse2;
+		gKernels.decodeF32 = decodeF32Sse2;
+		gKernels.encodeF32 = encodeF32Sse2;
+
+		return "sse2";
+	}
+
+#endif
+
+	return "generic";
+}
+
+const char* gImplementation = selectKernels();
+
+void swap(const uint8_t* src, uint8_t* dst, size_t count, int size)
+{
+	switch(size)
+	{
+	case 2:
+		gKernels.swap16(src, dst, count);
+		break;
+
+	case 4:
+		gKernels.swap32(src, dst, count);
+		break;
+
+	case 8:
+		gKernels.swap64(src, dst, count);
+		break;
+
+	default:
+		memmove(dst, src, count * size);
+		break;
+	}
+}
+
+}
+
+/*******************************************************************************
+ * FormatConverter
+ ******************************************************************************/
+
+FormatConverter::FormatConverter(snd_pcm_format_t src, snd_pcm_format_t dst) :
+	mSrc(getSampleFormat(src)),
+	mDst(getSampleFormat(dst))
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool FormatConverter::isSupported(snd_pcm_format_t format)
+{
+	auto width = snd_pcm_format_width(format);
+	auto physicalWidth = snd_pcm_format_physical_width(format);
+
+	if (snd_pcm_format_float(format) == 1)
+	{
+		return width == physicalWidth && (width == 32 || width == 64);
+	}
+
+	if (snd_pcm_format_linear(format) != 1)
+	{
+		return false;
+	}
+
+	return (width == physicalWidth && (width == 8 || width == 16 || width == 32)) ||
+		   (width == 24 && physicalWidth == 32);
+}
+
+const char* FormatConverter::getImplementation()
+{
+	return gImplementation;
+}
+
+void FormatConverter::convert(const uint8_t* src, uint8_t* dst,
+							  size_t numSamples) const
+{
+	if (mSrc.format == mDst.format)
+	{
+		memcpy(dst, src, numSamples * mSrc.size);
+
+		return;
+	}
+
+	if (mSrc.type == mDst.type && mSrc.width == mDst.width &&
+		mSrc.size == mDst.size)
+	{
+		swap(src, dst, numSamples, mSrc.size);
+
+		return;
+	}
+
+	// Unsigned samples are decoded and encoded as signed with the sign bit
+	// flipped, so the flip is required only if one of the formats is unsigned
+	bool flip = (mSrc.type == Type::UINT) != (mDst.type == Type::UINT);
+
+	alignas(32) int32_t buffer[cChunkSize];
+	alignas(32) uint8_t swapBuffer[cChunkSize * sizeof(double)];
+
+	while(numSamples)
+	{
+		auto count = min(numSamples, cChunkSize);
+
+		if (mSrc.swap)
+		{
+			swap(src, swapBuffer, count, mSrc.size);
+			decode(swapBuffer, buffer, count);
+		}
+		else
+		{
+			decode(src, buffer, count);
+		}
+
+		if (flip)
+		{
+			flipSign(buffer, count);
+		}
+
+		if (mDst.swap)
+		{
+			encode(buffer, swapBuffer, count);
+			swap(swapBuffer, dst, count, mDst.size);
+		}
+		else
+		{
+			encode(buffer, dst, count);
+		}
+
+		src += count * mSrc.size;
+		dst += count * mDst.size;
+		numSamples -= count;
+	}
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+FormatConverter::SampleFormat FormatConverter::getSampleFormat(
+		snd_pcm_format_t format)
+{
+	if (!isSupported(format))
+	{
+		throw AlsaPcmException(string("Conversion is not supported for format: ") +
+							   snd_pcm_format_name(format));
+	}
+
+	SampleFormat sampleFormat;
+
+	sampleFormat.format = format;
+	sampleFormat.width = snd_pcm_format_width(format);
+	sampleFormat.size = snd_pcm_format_physical_width(format) / 8;
+	sampleFormat.swap = sampleFormat.size > 1 &&
+						snd_pcm_format_cpu_endian(format) == 0;
+
+	if (snd_pcm_format_float(format) == 1)
+	{
+		sampleFormat.type = Type::FLOAT;
+	}
+	else if (snd_pcm_format_signed(format) == 1)
+	{
+		sampleFormat.type = Type::INT;
+	}
+	else
+	{
+		sampleFormat.type = Type::UINT;
+	}
+
+	return sampleFormat;
+}
+
+void FormatConverter::decode(const uint8_t* src, int32_t* dst,
+							 size_t numSamples) const
+{
+	if (mSrc.type == Type::FLOAT)
+	{
+		if (mSrc.size == sizeof(float))
+		{
+			gKernels.decodeF32(reinterpret_cast<const float*>(src), dst, numSamples);
+		}
+		else
+		{
+			decodeF64(reinterpret_cast<const double*>(src), dst, numSamples);
+		}
+
+		return;
+	}
+
+	switch(mSrc.size)
+	{
+	case 1:
+		decodeS8(reinterpret_cast<const int8_t*>(src), dst, numSamples);
+		break;
+
+	case 2:
+		gKernels.decodeS16(reinterpret_cast<const int16_t*>(src), dst, numSamples);
+		break;
+
+	default:
+		if (mSrc.width == 24)
+		{
+			decodeS24(reinterpret_cast<const uint32_t*>(src), dst, numSamples);
+		}
+		else
+		{
+			memcpy(dst, src, numSamples * sizeof(int32_t));
+		}
+		break;
+	}
+}
+
+void FormatConverter::encode(const int32_t* src, uint8_t* dst,
+							 size_t numSamples) const
+{
+	if (mDst.type == Type::FLOAT)
+	{
+		if (mDst.size == sizeof(float))
+		{
+			gKernels.encodeF32(src, reinterpret_cast<float*>(dst), numSamples);
+		}
+		else
+		{
+			encodeF64(src, reinterpret_cast<double*>(dst), numSamples);
+		}
+
+		return;
+	}
+
+	switch(mDst.size)
+	{
+	case 1:
+		encodeS8(src, reinterpret_cast<int8_t*>(dst), numSamples);
+		break;
+
+	case 2:
+		gKernels.encodeS16(src, reinterpret_cast<int16_t*>(dst), numSamples);
+		break;
+
+	default:
+		if (mDst.width == 24 && mDst.type == Type::UINT)
+		{
+			encodeU24(src, reinterpret_cast<uint32_t*>(dst), numSamples);
+		}
+		else if (mDst.width == 24)
+		{
+			encodeS24(src, reinterpret_cast<int32_t*>(dst), numSamples);
+		}
+		else
+		{
+			memcpy(dst, src, numSamples * sizeof(int32_t));
+		}
+		break;
+	}
+}
+
+}
@@ -0,0 +1,96 @@
+/*
+ *  PCM sample format converter
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_ALSA_FORMATCONVERTER_HPP_
+#define SRC_ALSA_FORMATCONVERTER_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <alsa/asoundlib.h>
+
+namespace Alsa {
+
+/***************************************************************************//**
+ * Converts samples between linear PCM formats.
+ * Supported formats: U8, S8, U16, S16, U24, S24 (in 32 bit container), U32,
+ * S32, FLOAT and FLOAT64 in both endiannesses. Samples are converted through
+ * the native S32 representation, float to integer conversion is saturating.
+ * The conversion kernels are selected at run time according to the CPU
+ * features: AVX2, SSSE3, SSE2 or generic.
+ ******************************************************************************/
+class FormatConverter
+{
+public:
+	/**
+	 * @param[in] src source format
+	 * @param[in] dst destination format
+	 */
+	FormatConverter(snd_pcm_format_t src, snd_pcm_format_t dst);
+
+	/**
+	 * Checks if the format is supported by the converter.
+	 * @param[in] format pcm format
+	 */
+	static bool isSupported(snd_pcm_format_t format);
+
+	/**
+	 * Returns name of the selected kernels implementation
+	 */
+	static const char* getImplementation();
+
+	/**
+	 * Converts samples.
+	 * @param[in]  src        source samples
+	 * @param[out] dst        destination samples
+	 * @param[in]  numSamples number of samples (frames * channels)
+	 */
+	void convert(const uint8_t* src, uint8_t* dst, size_t numSamples) const;
+
+	snd_pcm_format_t getSrcFormat() const { return mSrc.format; }
+	snd_pcm_format_t getDstFormat() const { return mDst.format; }
+
+private:
+
+	static const size_t cChunkSize = 256;
+
+	enum class Type { INT, UINT, FLOAT };
+
+	struct SampleFormat
+	{
+		snd_pcm_format_t format;
+		Type type;
+		int width;
+		int size;
+		bool swap;
+	};
+
+	SampleFormat mSrc;
+	SampleFormat mDst;
+
+	static SampleFormat getSampleFormat(snd_pcm_format_t format);
+
+	void decode(const uint8_t* src, int32_t* dst, size_t numSamples) const;
+	void encode(const int32_t* src, uint8_t* dst, size_t numSamples) const;
+};
+
+}
+
+#endif /* SRC_ALSA_FORMATCONVERTER_HPP_ */
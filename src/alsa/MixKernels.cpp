@@ -0,0 +1,121 @@
+/*
+ *  Saturating mix kernels
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "MixKernels.hpp"
+
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIX_KERNELS_X86
+#endif
+
+using std::numeric_limits;
+
+namespace Alsa {
+
+namespace {
+
+void mixS16Generic(int16_t* dst, const int16_t* src, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		int32_t sum = static_cast<int32_t>(dst[i]) + src[i];
+
+		if (sum > numeric_limits<int16_t>::max())
+		{
+			sum = numeric_limits<int16_t>::max();
+		}
+		else if (sum < numeric_limits<int16_t>::min())
+		{
+			sum = numeric_limits<int16_t>::min();
+		}
+
+		dst[i] = sum;
+	}
+}
+
+#ifdef MIX_KERNELS_X86
+
+__attribute__((target("sse2")))
+void mixS16Sse2(int16_t* dst, const int16_t* src, size_t count)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&dst[i]));
+		auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[i]));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[i]), _mm_adds_epi16(a, b));
+	}
+
+	mixS16Generic(&dst[i], &src[i], count - i);
+}
+
+__attribute__((target("avx2")))
+void mixS16Avx2(int16_t* dst, const int16_t* src, size_t count)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&dst[i]));
+		auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&src[i]));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[i]), _mm256_adds_epi16(a, b));
+	}
+
+	mixS16Sse2(&dst[i], &src[i], count - i);
+}
+
+#endif
+
+}
+
+MixKernels::MixS16Fn MixKernels::sMixS16 = mixS16Generic;
+const char* MixKernels::sImplementation = MixKernels::selectImplementation();
+
+const char* MixKernels::selectImplementation()
+{
+#ifdef MIX_KERNELS_X86
+
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		sMixS16 = mixS16Avx2;
+
+		return "avx2";
+	}
+
+	if (__builtin_cpu_supports("sse2"))
+	{
+		sMixS16 = mixS16Sse2;
+
+		return "sse2";
+	}
+
+#endif
+
+	return "generic";
+}
+
+}
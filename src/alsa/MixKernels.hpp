@@ -0,0 +1,64 @@
+/*
+ *  Saturating mix kernels
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_ALSA_MIXKERNELS_HPP_
+#define SRC_ALSA_MIXKERNELS_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Alsa {
+
+/***************************************************************************//**
+ * Saturating mix kernels.
+ * The implementation is selected at run time according to the CPU features:
+ * AVX2, SSE2 or generic.
+ ******************************************************************************/
+class MixKernels
+{
+public:
+	/**
+	 * Adds src samples to dst samples with saturation.
+	 * @param[in,out] dst   destination samples
+	 * @param[in]     src   source samples
+	 * @param[in]     count number of samples
+	 */
+	static void mixS16(int16_t* dst, const int16_t* src, size_t count)
+	{
+		sMixS16(dst, src, count);
+	}
+
+	/**
+	 * Returns name of the selected implementation
+	 */
+	static const char* getImplementation() { return sImplementation; }
+
+private:
+	typedef void (*MixS16Fn)(int16_t*, const int16_t*, size_t);
+
+	static const char* sImplementation;
+	static MixS16Fn sMixS16;
+
+	static const char* selectImplementation();
+};
+
+}
+
+#endif /* SRC_ALSA_MIXKERNELS_HPP_ */
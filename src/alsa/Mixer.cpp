@@ -0,0 +1,348 @@
+/*
+ *  Playback mixer
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "Mixer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include "MixKernels.hpp"
+#include "ThreadPolicy.hpp"
+
+using std::chrono::milliseconds;
+using std::exception;
+using std::find;
+using std::lock_guard;
+using std::map;
+using std::max;
+using std::min;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+using std::weak_ptr;
+
+namespace Alsa {
+
+/*******************************************************************************
+ * MixerInput
+ ******************************************************************************/
+
+MixerInput::MixerInput(size_t bufferSize, const AlsaPcmParams& params,
+					   snd_pcm_format_t format, int domId) :
+	mRing(bufferSize - bufferSize % snd_pcm_format_size(params.format, params.numChannels)),
+	mFrameSize(snd_pcm_format_size(params.format, params.numChannels)),
+	mInputFrameSize(snd_pcm_format_size(format, params.numChannels)),
+	mNumChannels(params.numChannels),
+	mDroppedBytes(0),
+	mLog("MixerInput", domId)
+{
+	if (format != params.format)
+	{
+		mConverter.reset(new FormatConverter(format, params.format));
+	}
+
+	LOG(mLog, DEBUG) << "Create mixer input, jitter buffer size: " << mRing.getSize()
+					 << ", format: " << snd_pcm_format_name(format);
+}
+
+void MixerInput::write(const uint8_t* buffer, size_t size)
+{
+	DLOG(mLog, DEBUG) << "Queue data, size: " << size << ", filled: " << mRing.getFilled();
+
+	size -= size % mInputFrameSize;
+
+	auto written = mConverter ? convert(buffer, size) : mRing.write(buffer, size);
+
+	if (written < size)
+	{
+		mDroppedBytes += size - written;
+
+		LOG(mLog, WARNING) << "Jitter buffer overflow, dropped: " << size - written;
+	}
+}
+
+void MixerInput::drain()
+{
+	unique_lock<mutex> lock(mMutex);
+
+	if (!mCondVar.wait_for(lock, milliseconds(cDrainTimeoutMs),
+						   [this] { return mRing.getFilled() == 0; }))
+	{
+		LOG(mLog, WARNING) << "Drain timeout, dropped: " << mRing.getFilled();
+	}
+}
+
+size_t MixerInput::convert(const uint8_t* buffer, size_t size)
+{
+	size_t numFrames = size / mInputFrameSize;
+	size_t converted = 0;
+
+	// Convert directly into the ring, the free space is split into two
+	// regions at most
+	while(converted < numFrames)
+	{
+		uint8_t* region = nullptr;
+
+		auto frames = min(numFrames - converted, mRing.getWriteRegion(region) / mFrameSize);
+
+		if (frames == 0)
+		{
+			break;
+		}
+
+		mConverter->convert(&buffer[converted * mInputFrameSize], region,
+							frames * mNumChannels);
+
+		mRing.commit(frames * mFrameSize);
+
+		converted += frames;
+	}
+
+	return converted * mInputFrameSize;
+}
+
+void MixerInput::notifyConsumed()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mCondVar.notify_all();
+}
+
+/*******************************************************************************
+ * Mixer
+ ******************************************************************************/
+
+mutex Mixer::sInstancesMutex;
+map<string, weak_ptr<Mixer>> Mixer::sInstances;
+
+Mixer::Mixer(const string& device, const AlsaPcmParams& params) :
+	mPcm(StreamType::PLAYBACK, device),
+	mFrameSize(0),
+	mPendingSize(0),
+	mTerminate(false),
+	mLog("Mixer")
+{
+	LOG(mLog, INFO) << "Create mixer: " << device << ", kernels: "
+					<< MixKernels::getImplementation();
+
+	open(params);
+
+	mThread = thread(&Mixer::mixerThread, this);
+}
+
+Mixer::~Mixer()
+{
+	mTerminate = true;
+
+	mWakeup.signal();
+
+	if (mThread.joinable())
+	{
+		mThread.join();
+	}
+
+	mPcm.setNonBlock(false);
+
+	LOG(mLog, INFO) << "Delete mixer";
+}
+
+shared_ptr<Mixer> Mixer::getInstance(const string& device,
+									 const AlsaPcmParams& params)
+{
+	lock_guard<mutex> lock(sInstancesMutex);
+
+	auto mixer = sInstances[device].lock();
+
+	if (!mixer)
+	{
+		mixer.reset(new Mixer(device, params));
+
+		sInstances[device] = mixer;
+	}
+
+	return mixer;
+}
+
+shared_ptr<MixerInput> Mixer::addInput(size_t bufferSize, snd_pcm_format_t format,
+									   int domId)
+{
+	// The input holds at least one mixer period
+	shared_ptr<MixerInput> input(new MixerInput(max(bufferSize, mPcm.getPeriodBytes()),
+												mPcm.getParams(), format, domId));
+
+	lock_guard<mutex> lock(mMutex);
+
+	mInputs.push_back(input);
+
+	LOG(mLog, DEBUG) << "Add input, num inputs: " << mInputs.size();
+
+	return input;
+}
+
+void Mixer::removeInput(shared_ptr<MixerInput> input)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = find(mInputs.begin(), mInputs.end(), input);
+
+	if (it != mInputs.end())
+	{
+		mInputs.erase(it);
+	}
+
+	LOG(mLog, DEBUG) << "Remove input, num inputs: " << mInputs.size();
+}
+
+void Mixer::open(const AlsaPcmParams& params)
+{
+	if (params.format != SND_PCM_FORMAT_S16)
+	{
+		throw AlsaPcmException("Mixer supports S16 format only");
+	}
+
+	// The device format is converted by the pcm device, open errors are
+	// propagated to the stream
+	mPcm.open(params);
+
+	mPcm.setNonBlock(true);
+
+	mFrameSize = mPcm.getFrameSize();
+
+	mMixBuffer.resize(mPcm.getPeriodSize() * mFrameSize);
+	mInputBuffer.resize(mPcm.getPeriodSize() * mFrameSize);
+}
+
+void Mixer::mixerThread()
+{
+	XenBackend::ThreadPolicy::apply(XenBackend::ThreadPolicy::Group::DEVICE);
+
+	try
+	{
+		vector<pollfd> fds;
+
+		mPcm.getPollDescriptors(fds);
+
+		// The wakeup fd is always the last one
+		fds.push_back({ .fd = mWakeup.getFd(), .events = POLLIN, .revents = 0 });
+
+		while(!mTerminate)
+		{
+			if (poll(fds.data(), fds.size(), -1) < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				throw AlsaPcmException("Can't poll pcm device: " + string(strerror(errno)));
+			}
+
+			if (fds.back().revents & POLLIN)
+			{
+				mWakeup.clear();
+			}
+
+			if (mPcm.getPollEvents(fds.data(), fds.size() - 1) & (POLLOUT | POLLERR))
+			{
+				// The tail not accepted by the device goes first, the inputs
+				// are not pulled until it is written
+				if (!writePending())
+				{
+					continue;
+				}
+
+				auto avail = mPcm.getAvail();
+
+				while(avail > 0 && !mTerminate)
+				{
+					auto numFrames = min(avail, mPcm.getPeriodSize());
+
+					mixPeriod(numFrames);
+
+					avail -= numFrames;
+
+					if (!writePending())
+					{
+						break;
+					}
+				}
+			}
+		}
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
+void Mixer::mixPeriod(snd_pcm_uframes_t numFrames)
+{
+	auto size = numFrames * mFrameSize;
+
+	memset(mMixBuffer.data(), 0, size);
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		for (auto& input : mInputs)
+		{
+			auto read = input->mRing.read(mInputBuffer.data(), size);
+
+			if (read)
+			{
+				MixKernels::mixS16(reinterpret_cast<int16_t*>(mMixBuffer.data()),
+								   reinterpret_cast<const int16_t*>(mInputBuffer.data()),
+								   read / sizeof(int16_t));
+
+				input->notifyConsumed();
+			}
+		}
+	}
+
+	mPendingSize = size;
+}
+
+bool Mixer::writePending()
+{
+	if (!mPendingSize)
+	{
+		return true;
+	}
+
+	auto written = mPcm.tryWrite(mMixBuffer.data(), mPendingSize);
+
+	mPendingSize -= written;
+
+	if (mPendingSize)
+	{
+		memmove(mMixBuffer.data(), &mMixBuffer[written], mPendingSize);
+
+		return false;
+	}
+
+	return true;
+}
+
+}
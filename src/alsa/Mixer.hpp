@@ -0,0 +1,175 @@
+/*
+ *  Playback mixer
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_ALSA_MIXER_HPP_
+#define SRC_ALSA_MIXER_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AlsaPcm.hpp"
+#include "EventFd.hpp"
+#include "FormatConverter.hpp"
+#include "PcmRing.hpp"
+#include "Log.hpp"
+
+namespace Alsa {
+
+/***************************************************************************//**
+ * Playback stream attached to the mixer.
+ * The stream data is queued into the input jitter buffer and consumed by the
+ * mixer thread. The data which doesn't fit into the jitter buffer is dropped.
+ * The data is converted to the mixer format when it is queued.
+ ******************************************************************************/
+class MixerInput
+{
+public:
+	/**
+	 * @param[in] bufferSize jitter buffer size in bytes of the mixer format
+	 * @param[in] params     mixer parameters
+	 * @param[in] format     input format
+	 * @param[in] domId      domain the input serves
+	 */
+	MixerInput(size_t bufferSize, const AlsaPcmParams& params, snd_pcm_format_t format,
+			   int domId = XenBackend::Log::cNoDomain);
+	MixerInput(const MixerInput&) = delete;
+	MixerInput& operator=(MixerInput const&) = delete;
+
+	/**
+	 * Queues the data for mixing.
+	 * @param[in] buffer pointer to the data
+	 * @param[in] size   data size in bytes
+	 */
+	void write(const uint8_t* buffer, size_t size);
+
+	/**
+	 * Waits until the mixer consumes the queued data.
+	 */
+	void drain();
+
+	/**
+	 * Returns number of bytes dropped due to jitter buffer overflow
+	 */
+	uint64_t getDroppedBytes() const { return mDroppedBytes; }
+
+private:
+	friend class Mixer;
+
+	const int cDrainTimeoutMs = 1000;
+
+	PcmRing mRing;
+	size_t mFrameSize;
+	size_t mInputFrameSize;
+	unsigned mNumChannels;
+	std::unique_ptr<FormatConverter> mConverter;
+	std::atomic<uint64_t> mDroppedBytes;
+
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+
+	XenBackend::Log mLog;
+
+	size_t convert(const uint8_t* buffer, size_t size);
+	void notifyConsumed();
+};
+
+/***************************************************************************//**
+ * Mixes playback streams into one playback device.
+ * One mixer instance is created per device. The mixer thread waits for the
+ * device, pulls one period from each input, mixes inputs with saturation
+ * and writes the result to the device. Inputs should have the mixer rate and
+ * number of channels, linear formats are converted to the mixer format.
+ ******************************************************************************/
+class Mixer
+{
+public:
+	/**
+	 * @param[in] device device name
+	 * @param[in] params device parameters, S16 format is supported
+	 */
+	Mixer(const std::string& device, const AlsaPcmParams& params);
+	Mixer(const Mixer&) = delete;
+	Mixer& operator=(Mixer const&) = delete;
+	~Mixer();
+
+	/**
+	 * Returns the mixer of the device. The mixer is created on the first
+	 * request and destroyed when the last reference is released.
+	 * @param[in] device device name
+	 * @param[in] params parameters used to create the mixer
+	 */
+	static std::shared_ptr<Mixer> getInstance(const std::string& device,
+											  const AlsaPcmParams& params);
+
+	/**
+	 * Returns the device parameters
+	 */
+	const AlsaPcmParams& getParams() const { return mPcm.getParams(); }
+
+	/**
+	 * Creates new input.
+	 * @param[in] bufferSize jitter buffer size in bytes of the mixer format
+	 * @param[in] format     input format
+	 * @param[in] domId      domain the input serves
+	 */
+	std::shared_ptr<MixerInput> addInput(size_t bufferSize, snd_pcm_format_t format,
+										 int domId = XenBackend::Log::cNoDomain);
+
+	/**
+	 * Removes the input. Not consumed data is dropped.
+	 */
+	void removeInput(std::shared_ptr<MixerInput> input);
+
+private:
+
+	static std::mutex sInstancesMutex;
+	static std::map<std::string, std::weak_ptr<Mixer>> sInstances;
+
+	AlsaPcm mPcm;
+	size_t mFrameSize;
+
+	std::vector<std::shared_ptr<MixerInput>> mInputs;
+	std::mutex mMutex;
+
+	std::vector<uint8_t> mMixBuffer;
+	std::vector<uint8_t> mInputBuffer;
+	size_t mPendingSize;
+
+	XenBackend::EventFd mWakeup;
+	std::thread mThread;
+	std::atomic_bool mTerminate;
+
+	XenBackend::Log mLog;
+
+	void open(const AlsaPcmParams& params);
+	void mixerThread();
+	void mixPeriod(snd_pcm_uframes_t numFrames);
+	bool writePending();
+};
+
+}
+
+#endif /* SRC_ALSA_MIXER_HPP_ */
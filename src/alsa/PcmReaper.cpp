@@ -0,0 +1,188 @@
+/*
+ *  Background pcm stream closing
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "PcmReaper.hpp"
+
+#include "AlsaPcmPool.hpp"
+
+using std::atomic;
+using std::condition_variable;
+using std::exception;
+using std::list;
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::shared_future;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+namespace Alsa {
+
+mutex PcmReaper::sMutex;
+condition_variable PcmReaper::sCondVar;
+list<PcmReaper::Job> PcmReaper::sJobs;
+vector<thread> PcmReaper::sThreads;
+atomic<size_t> PcmReaper::sInFlight(0);
+bool PcmReaper::sTerminate = false;
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+shared_future<void> PcmReaper::reap(Stream stream, Policy policy)
+{
+	Job job;
+
+	job.stream = move(stream);
+	job.policy = policy;
+
+	shared_future<void> done(job.done.get_future());
+
+	lock_guard<mutex> lock(sMutex);
+
+	if (sThreads.empty())
+	{
+		sTerminate = false;
+
+		for (int i = 0; i < cNumThreads; i++)
+		{
+			sThreads.emplace_back(&PcmReaper::reaperThread);
+		}
+	}
+
+	sJobs.push_back(move(job));
+
+	sInFlight++;
+
+	DLOG("PcmReaper", DEBUG) << "Reap stream, policy: "
+							 << (policy == Policy::DRAIN ? "drain" : "drop")
+							 << ", in flight: " << sInFlight;
+
+	sCondVar.notify_one();
+
+	return done;
+}
+
+void PcmReaper::stop()
+{
+	vector<thread> threads;
+
+	{
+		lock_guard<mutex> lock(sMutex);
+
+		sTerminate = true;
+
+		threads.swap(sThreads);
+
+		sCondVar.notify_all();
+	}
+
+	// The threads finish the queued jobs before exit
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void PcmReaper::reaperThread()
+{
+	while(true)
+	{
+		list<Job> jobs;
+
+		{
+			unique_lock<mutex> lock(sMutex);
+
+			sCondVar.wait(lock, [] { return sTerminate || !sJobs.empty(); });
+
+			if (sJobs.empty())
+			{
+				return;
+			}
+
+			jobs.splice(jobs.end(), sJobs, sJobs.begin());
+		}
+
+		auto& job = jobs.front();
+
+		close(job);
+
+		sInFlight--;
+
+		job.done.set_value();
+	}
+}
+
+void PcmReaper::close(Job& job)
+{
+	bool drain = job.policy == Policy::DRAIN;
+	auto& stream = job.stream;
+
+	try
+	{
+		if (stream.writer)
+		{
+			if (drain)
+			{
+				stream.writer->drain();
+			}
+
+			stream.writer.reset();
+		}
+
+		stream.reader.reset();
+
+		if (stream.mixerInput)
+		{
+			if (drain)
+			{
+				stream.mixerInput->drain();
+			}
+
+			stream.mixer->removeInput(stream.mixerInput);
+		}
+
+		if (stream.splitterOutput)
+		{
+			stream.splitter->removeOutput(stream.splitterOutput);
+		}
+
+		if (stream.pcm && !drain)
+		{
+			stream.pcm->drop();
+		}
+
+		AlsaPcmPool::release(move(stream.pcm));
+	}
+	catch(const exception& e)
+	{
+		LOG("PcmReaper", ERROR) << e.what();
+	}
+
+	// Release the parts out of the try block: destructors don't throw
+	stream = Stream();
+}
+
+}
@@ -0,0 +1,113 @@
+/*
+ *  Background pcm stream closing
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_ALSA_PCMREAPER_HPP_
+#define SRC_ALSA_PCMREAPER_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "AlsaPcm.hpp"
+#include "AsyncPcmReader.hpp"
+#include "AsyncPcmWriter.hpp"
+#include "Mixer.hpp"
+#include "Splitter.hpp"
+
+namespace Alsa {
+
+/***************************************************************************//**
+ * Closes pcm streams in background threads.
+ * The stream parts are handed off to the reaper which drains or drops the
+ * queued data according to the stream policy and returns the pcm device to
+ * the pool, so the caller is not blocked by the drain.
+ ******************************************************************************/
+class PcmReaper
+{
+public:
+	/**
+	 * Close policies:
+	 * DRAIN - play the queued data before closing;
+	 * DROP  - discard the queued data.
+	 */
+	enum class Policy { DRAIN, DROP };
+
+	/**
+	 * Stream parts to close, any of them may be empty
+	 */
+	struct Stream
+	{
+		std::unique_ptr<AlsaPcm> pcm;
+		std::unique_ptr<AsyncPcmWriter> writer;
+		std::unique_ptr<AsyncPcmReader> reader;
+		std::shared_ptr<Mixer> mixer;
+		std::shared_ptr<MixerInput> mixerInput;
+		std::shared_ptr<Splitter> splitter;
+		std::shared_ptr<SplitterOutput> splitterOutput;
+	};
+
+	/**
+	 * Hands off the stream to the reaper.
+	 * @param[in] stream stream parts
+	 * @param[in] policy close policy
+	 * @return future which is ready when the stream is closed
+	 */
+	static std::shared_future<void> reap(Stream stream, Policy policy);
+
+	/**
+	 * Returns number of streams being closed
+	 */
+	static size_t getInFlight() { return sInFlight; }
+
+	/**
+	 * Waits for the streams being closed and stops the reaper threads.
+	 */
+	static void stop();
+
+private:
+
+	static const int cNumThreads = 2;
+
+	struct Job
+	{
+		Stream stream;
+		Policy policy;
+		std::promise<void> done;
+	};
+
+	static std::mutex sMutex;
+	static std::condition_variable sCondVar;
+	static std::list<Job> sJobs;
+	static std::vector<std::thread> sThreads;
+	static std::atomic<size_t> sInFlight;
+	static bool sTerminate;
+
+	static void reaperThread();
+	static void close(Job& job);
+};
+
+}
+
+#endif /* SRC_ALSA_PCMREAPER_HPP_ */
@@ -0,0 +1,129 @@
+/*
+ *  Lock-free PCM ring buffer
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "PcmRing.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::min;
+
+namespace Alsa {
+
+PcmRing::PcmRing(size_t size) :
+	mBuffer(size),
+	mReadPos(0),
+	mWritePos(0)
+{
+	// Positions are wrapped by the size
+	assert(size);
+}
+
+size_t PcmRing::write(const uint8_t* data, size_t size)
+{
+	auto writePos = mWritePos.load(memory_order_relaxed);
+	auto readPos = mReadPos.load(memory_order_acquire);
+
+	size = min(size, getSize() - (writePos - readPos));
+
+	auto index = writePos % getSize();
+	auto first = min(size, getSize() - index);
+
+	memcpy(&mBuffer[index], data, first);
+	memcpy(&mBuffer[0], &data[first], size - first);
+
+	mWritePos.store(writePos + size, memory_order_release);
+
+	return size;
+}
+
+size_t PcmRing::read(uint8_t* data, size_t size)
+{
+	auto readPos = mReadPos.load(memory_order_relaxed);
+	auto writePos = mWritePos.load(memory_order_acquire);
+
+	size = min(size, writePos - readPos);
+
+	auto index = readPos % getSize();
+	auto first = min(size, getSize() - index);
+
+	memcpy(data, &mBuffer[index], first);
+	memcpy(&data[first], &mBuffer[0], size - first);
+
+	mReadPos.store(readPos + size, memory_order_release);
+
+	return size;
+}
+
+size_t PcmRing::getReadRegion(const uint8_t*& data) const
+{
+	auto readPos = mReadPos.load(memory_order_relaxed);
+	auto writePos = mWritePos.load(memory_order_acquire);
+
+	auto index = readPos % getSize();
+
+	data = &mBuffer[index];
+
+	return min(writePos - readPos, getSize() - index);
+}
+
+void PcmRing::consume(size_t size)
+{
+	mReadPos.store(mReadPos.load(memory_order_relaxed) + size,
+				   memory_order_release);
+}
+
+size_t PcmRing::getWriteRegion(uint8_t*& data)
+{
+	auto writePos = mWritePos.load(memory_order_relaxed);
+	auto readPos = mReadPos.load(memory_order_acquire);
+
+	auto index = writePos % getSize();
+
+	data = &mBuffer[index];
+
+	return min(getSize() - (writePos - readPos), getSize() - index);
+}
+
+void PcmRing::commit(size_t size)
+{
+	mWritePos.store(mWritePos.load(memory_order_relaxed) + size,
+					memory_order_release);
+}
+
+size_t PcmRing::getFilled() const
+{
+	// Read position is loaded first so the result never underflows
+	auto readPos = mReadPos.load(memory_order_acquire);
+
+	return mWritePos.load(memory_order_acquire) - readPos;
+}
+
+void PcmRing::clear()
+{
+	mReadPos = 0;
+	mWritePos = 0;
+}
+
+}
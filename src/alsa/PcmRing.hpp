@@ -0,0 +1,120 @@
+/*
+ *  Lock-free PCM ring buffer
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_ALSA_PCMRING_HPP_
+#define SRC_ALSA_PCMRING_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Alsa {
+
+/***************************************************************************//**
+ * Single producer single consumer byte ring used to pass PCM data between
+ * the ring buffer thread and a device thread without locking.
+ * write() and getWriteRegion()/commit() may be called from the producer
+ * thread only, read() and getReadRegion()/consume() from the consumer thread
+ * only.
+ ******************************************************************************/
+class PcmRing
+{
+public:
+	/**
+	 * @param[in] size ring size in bytes, must not be zero
+	 */
+	explicit PcmRing(size_t size);
+	PcmRing(const PcmRing&) = delete;
+	PcmRing& operator=(PcmRing const&) = delete;
+
+	/**
+	 * Copies data into the ring.
+	 * @param[in] data pointer to the data
+	 * @param[in] size data size in bytes
+	 * @return number of bytes copied, less than size if the ring is full
+	 */
+	size_t write(const uint8_t* data, size_t size);
+
+	/**
+	 * Copies data out of the ring.
+	 * @param[out] data pointer to the destination
+	 * @param[in]  size number of bytes requested
+	 * @return number of bytes copied
+	 */
+	size_t read(uint8_t* data, size_t size);
+
+	/**
+	 * Returns the contiguous readable region.
+	 * @param[out] data pointer to the region
+	 * @return region size in bytes
+	 */
+	size_t getReadRegion(const uint8_t*& data) const;
+
+	/**
+	 * Releases bytes obtained by getReadRegion().
+	 * @param[in] size number of bytes
+	 */
+	void consume(size_t size);
+
+	/**
+	 * Returns the contiguous writable region.
+	 * @param[out] data pointer to the region
+	 * @return region size in bytes
+	 */
+	size_t getWriteRegion(uint8_t*& data);
+
+	/**
+	 * Publishes bytes filled through getWriteRegion().
+	 * @param[in] size number of bytes
+	 */
+	void commit(size_t size);
+
+	/**
+	 * Returns number of bytes available for reading
+	 */
+	size_t getFilled() const;
+
+	/**
+	 * Returns number of bytes available for writing
+	 */
+	size_t getFree() const { return getSize() - getFilled(); }
+
+	/**
+	 * Returns the ring size
+	 */
+	size_t getSize() const { return mBuffer.size(); }
+
+	/**
+	 * Drops all data. Must not be called concurrently with other methods.
+	 */
+	void clear();
+
+private:
+	std::vector<uint8_t> mBuffer;
+
+	// Free running positions, the index is position modulo the ring size
+	std::atomic<size_t> mReadPos;
+	std::atomic<size_t> mWritePos;
+};
+
+}
+
+#endif /* SRC_ALSA_PCMRING_HPP_ */
@@ -0,0 +1,444 @@
+/*
+ *  Polyphase sample rate converter
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "Resampler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLER_KERNELS_X86
+#endif
+
+using std::atomic;
+using std::fill;
+using std::min;
+using std::string;
+
+namespace Alsa {
+
+namespace {
+
+struct Preset
+{
+	size_t numTaps;
+	size_t numPhases;
+	double rolloff;
+	double beta;
+};
+
+const Preset cPresets[] =
+{
+	{ .numTaps = 16, .numPhases = 32,  .rolloff = 0.80, .beta = 5.0 },	// LOW
+	{ .numTaps = 32, .numPhases = 128, .rolloff = 0.90, .beta = 7.0 },	// MEDIUM
+	{ .numTaps = 64, .numPhases = 256, .rolloff = 0.95, .beta = 9.0 }	// HIGH
+};
+
+// Kernels process multiples of this number of taps
+const size_t cTapsAlign = 8;
+
+/*******************************************************************************
+ * Generic kernels
+ ******************************************************************************/
+
+float dotGeneric(const float* a, const float* b, size_t count)
+{
+	float sum = 0.0f;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		sum += a[i] * b[i];
+	}
+
+	return sum;
+}
+
+void interpolateGeneric(const float* a, const float* b, float frac,
+						float* out, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = a[i] + frac * (b[i] - a[i]);
+	}
+}
+
+/*******************************************************************************
+ * x86 kernels
+ ******************************************************************************/
+
+#ifdef RESAMPLER_KERNELS_X86
+
+__attribute__((target("sse")))
+float dotSse(const float* a, const float* b, size_t count)
+{
+	auto sum0 = _mm_setzero_ps();
+	auto sum1 = _mm_setzero_ps();
+
+	for (size_t i = 0; i < count; i += 8)
+	{
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(&a[i]), _mm_loadu_ps(&b[i])));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(&a[i + 4]), _mm_loadu_ps(&b[i + 4])));
+	}
+
+	auto sum = _mm_add_ps(sum0, sum1);
+
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+
+	return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("sse")))
+void interpolateSse(const float* a, const float* b, float frac,
+					float* out, size_t count)
+{
+	auto f = _mm_set1_ps(frac);
+
+	for (size_t i = 0; i < count; i += 4)
+	{
+		auto va = _mm_loadu_ps(&a[i]);
+		auto vb = _mm_loadu_ps(&b[i]);
+
+		_mm_storeu_ps(&out[i], _mm_add_ps(va, _mm_mul_ps(f, _mm_sub_ps(vb, va))));
+	}
+}
+
+__attribute__((target("avx2,fma")))
+float dotAvx2(const float* a, const float* b, size_t count)
+{
+	auto sum0 = _mm256_setzero_ps();
+	auto sum1 = _mm256_setzero_ps();
+
+	size_t i = 0;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(&a[i]), _mm256_loadu_ps(&b[i]), sum0);
+		sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(&a[i + 8]), _mm256_loadu_ps(&b[i + 8]), sum1);
+	}
+
+	if (i < count)
+	{
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(&a[i]), _mm256_loadu_ps(&b[i]), sum0);
+	}
+
+	auto sum256 = _mm256_add_ps(sum0, sum1);
+	auto sum = _mm_add_ps(_mm256_castps256_ps128(sum256), _mm256_extractf128_ps(sum256, 1));
+
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+
+	return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma")))
+void interpolateAvx2(const float* a, const float* b, float frac,
+					 float* out, size_t count)
+{
+	auto f = _mm256_set1_ps(frac);
+
+	for (size_t i = 0; i < count; i += 8)
+	{
+		auto va = _mm256_loadu_ps(&a[i]);
+		auto vb = _mm256_loadu_ps(&b[i]);
+
+		_mm256_storeu_ps(&out[i], _mm256_fmadd_ps(f, _mm256_sub_ps(vb, va), va));
+	}
+}
+
+#endif
+
+/*******************************************************************************
+ * Dispatch
+ ******************************************************************************/
+
+struct Kernels
+{
+	float (*dot)(const float*, const float*, size_t);
+	void (*interpolate)(const float*, const float*, float, float*, size_t);
+};
+
+Kernels gKernels = { dotGeneric, interpolateGeneric };
+
+const char* selectKernels()
+{
+#ifdef RESAMPLER_KERNELS_X86
+
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		gKernels = { dotAvx2, interpolateAvx2 };
+
+		return "avx2";
+	}
+
+	if (__builtin_cpu_supports("sse"))
+	{
+		gKernels = { dotSse, interpolateSse };
+
+		return "sse";
+	}
+
+#endif
+
+	return "generic";
+}
+
+const char* gImplementation = selectKernels();
+
+double besselI0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+
+	for (int k = 1; k < 50; k++)
+	{
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+
+		if (term < sum * 1e-12)
+		{
+			break;
+		}
+	}
+
+	return sum;
+}
+
+}
+
+/*******************************************************************************
+ * Resampler
+ ******************************************************************************/
+
+atomic<Resampler::Quality> Resampler::sQuality(Resampler::Quality::MEDIUM);
+
+Resampler::Resampler(unsigned numChannels, unsigned inRate, unsigned outRate,
+					 Quality quality) :
+	mNumChannels(numChannels),
+	mBaseStep(static_cast<double>(inRate) / outRate),
+	mStep(mBaseStep),
+	mPos(0.0),
+	mCapacity(0),
+	mFilled(0)
+{
+	auto& preset = cPresets[static_cast<int>(quality)];
+
+	// On downsampling the filter is stretched to cut off above the output
+	// Nyquist frequency
+	double scale = min(1.0, static_cast<double>(outRate) / inRate);
+
+	mNumTaps = static_cast<size_t>(ceil(preset.numTaps / scale));
+	mNumTaps = (mNumTaps + cTapsAlign - 1) / cTapsAlign * cTapsAlign;
+	mNumPhases = preset.numPhases;
+
+	createFilter(preset.rolloff * scale, preset.beta);
+
+	mCoeffs.resize(mNumTaps);
+
+	mCapacity = mNumTaps + cBlockFrames;
+	mHistory.resize(mCapacity * mNumChannels);
+
+	reset();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool Resampler::setQuality(const string& quality)
+{
+	if (quality == "low")
+	{
+		setQuality(Quality::LOW);
+	}
+	else if (quality == "medium")
+	{
+		setQuality(Quality::MEDIUM);
+	}
+	else if (quality == "high")
+	{
+		setQuality(Quality::HIGH);
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+const char* Resampler::getImplementation()
+{
+	return gImplementation;
+}
+
+void Resampler::process(const float* in, size_t& numInFrames,
+						float* out, size_t& numOutFrames)
+{
+	size_t maxIn = numInFrames;
+	size_t maxOut = numOutFrames;
+
+	numInFrames = 0;
+	numOutFrames = 0;
+
+	while(true)
+	{
+		while(numOutFrames < maxOut)
+		{
+			auto index = static_cast<size_t>(mPos);
+
+			if (index + mNumTaps > mFilled)
+			{
+				break;
+			}
+
+			double position = (mPos - index) * mNumPhases;
+			auto phase = static_cast<size_t>(position);
+
+			gKernels.interpolate(&mFilter[phase * mNumTaps],
+								 &mFilter[(phase + 1) * mNumTaps],
+								 position - phase, mCoeffs.data(), mNumTaps);
+
+			for (unsigned channel = 0; channel < mNumChannels; channel++)
+			{
+				*out++ = gKernels.dot(&mHistory[channel * mCapacity + index],
+									  mCoeffs.data(), mNumTaps);
+			}
+
+			numOutFrames++;
+			mPos += mStep;
+		}
+
+		shift(min(static_cast<size_t>(mPos), mFilled));
+
+		if (numInFrames == maxIn || numOutFrames == maxOut)
+		{
+			break;
+		}
+
+		auto count = min(maxIn - numInFrames, mCapacity - mFilled);
+
+		append(&in[numInFrames * mNumChannels], count);
+
+		numInFrames += count;
+	}
+}
+
+size_t Resampler::getInputFrames(size_t numOutFrames) const
+{
+	if (numOutFrames == 0)
+	{
+		return 0;
+	}
+
+	auto required = static_cast<size_t>(mPos + (numOutFrames - 1) * mStep) + mNumTaps;
+
+	return required > mFilled ? required - mFilled : 0;
+}
+
+void Resampler::reset()
+{
+	fill(mHistory.begin(), mHistory.end(), 0.0f);
+
+	// Zero history aligns the filter center to the first input frame
+	mFilled = mNumTaps / 2 - 1;
+	mPos = 0.0;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void Resampler::createFilter(double cutoff, double beta)
+{
+	mFilter.resize((mNumPhases + 1) * mNumTaps);
+
+	double halfLength = mNumTaps / 2.0;
+	double norm = besselI0(beta);
+
+	for (size_t phase = 0; phase <= mNumPhases; phase++)
+	{
+		auto coeffs = &mFilter[phase * mNumTaps];
+		double sum = 0.0;
+
+		for (size_t tap = 0; tap < mNumTaps; tap++)
+		{
+			double x = tap - (halfLength - 1.0) - static_cast<double>(phase) / mNumPhases;
+			double window = 1.0 - (x / halfLength) * (x / halfLength);
+			double value = 0.0;
+
+			if (window > 0.0)
+			{
+				double arg = M_PI * cutoff * x;
+				double sinc = fabs(arg) < 1e-9 ? 1.0 : sin(arg) / arg;
+
+				value = cutoff * sinc * besselI0(beta * sqrt(window)) / norm;
+			}
+
+			coeffs[tap] = value;
+			sum += value;
+		}
+
+		// Unity gain at DC for every phase
+		for (size_t tap = 0; tap < mNumTaps; tap++)
+		{
+			coeffs[tap] /= sum;
+		}
+	}
+}
+
+void Resampler::append(const float* in, size_t numFrames)
+{
+	for (unsigned channel = 0; channel < mNumChannels; channel++)
+	{
+		auto history = &mHistory[channel * mCapacity + mFilled];
+
+		for (size_t i = 0; i < numFrames; i++)
+		{
+			history[i] = in[i * mNumChannels + channel];
+		}
+	}
+
+	mFilled += numFrames;
+}
+
+void Resampler::shift(size_t numFrames)
+{
+	if (numFrames == 0)
+	{
+		return;
+	}
+
+	for (unsigned channel = 0; channel < mNumChannels; channel++)
+	{
+		auto history = &mHistory[channel * mCapacity];
+
+		memmove(history, &history[numFrames], (mFilled - numFrames) * sizeof(float));
+	}
+
+	mFilled -= numFrames;
+	mPos -= numFrames;
+}
+
+}
@@ -0,0 +1,144 @@
+/*
+ *  Polyphase sample rate converter
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_ALSA_RESAMPLER_HPP_
+#define SRC_ALSA_RESAMPLER_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace Alsa {
+
+/***************************************************************************//**
+ * Polyphase sample rate converter with arbitrary ratio.
+ * Converts interleaved float frames. The filter is a Kaiser windowed sinc
+ * sampled at a number of phases, coefficients between phases are linearly
+ * interpolated. The dot product kernels are selected at run time according
+ * to the CPU features: AVX2+FMA, SSE or generic.
+ ******************************************************************************/
+class Resampler
+{
+public:
+
+	/**
+	 * Quality presets: number of taps per phase, number of phases and
+	 * pass band width. LOW, MEDIUM and HIGH use 16, 32 and 64 taps, scaled
+	 * up when downsampling. The cost per output frame grows with the taps.
+	 */
+	enum class Quality { LOW, MEDIUM, HIGH };
+
+	/**
+	 * @param[in] numChannels number of channels
+	 * @param[in] inRate      input rate
+	 * @param[in] outRate     output rate
+	 * @param[in] quality     quality preset
+	 */
+	Resampler(unsigned numChannels, unsigned inRate, unsigned outRate,
+			  Quality quality);
+	Resampler(const Resampler&) = delete;
+	Resampler& operator=(Resampler const&) = delete;
+
+	/**
+	 * Sets the quality used for new resamplers
+	 */
+	static void setQuality(Quality quality) { sQuality = quality; }
+
+	/**
+	 * Sets the quality used for new resamplers
+	 * @param[in] quality low, medium or high
+	 * @return false if the quality name is invalid
+	 */
+	static bool setQuality(const std::string& quality);
+
+	/**
+	 * Returns the quality used for new resamplers
+	 */
+	static Quality getQuality() { return sQuality; }
+
+	/**
+	 * Returns name of the selected kernels implementation
+	 */
+	static const char* getImplementation();
+
+	/**
+	 * Converts frames.
+	 * @param[in]     in           input frames
+	 * @param[in,out] numInFrames  number of input frames, returns number of
+	 *                             consumed frames
+	 * @param[out]    out          output frames
+	 * @param[in,out] numOutFrames size of the output buffer in frames,
+	 *                             returns number of produced frames
+	 */
+	void process(const float* in, size_t& numInFrames,
+				 float* out, size_t& numOutFrames);
+
+	/**
+	 * Fine tunes the conversion ratio, used for the clock drift compensation.
+	 * @param[in] factor ratio factor, above 1 the input is consumed faster
+	 */
+	void setRatioAdjustment(double factor) { mStep = mBaseStep * factor; }
+
+	/**
+	 * Returns number of input frames required to produce the output frames
+	 * @param[in] numOutFrames number of output frames
+	 */
+	size_t getInputFrames(size_t numOutFrames) const;
+
+	/**
+	 * Returns number of taps per channel: multiply-adds per output sample
+	 */
+	size_t getNumTaps() const { return mNumTaps; }
+
+	/**
+	 * Drops the history.
+	 */
+	void reset();
+
+private:
+
+	static const size_t cBlockFrames = 1024;
+
+	static std::atomic<Quality> sQuality;
+
+	unsigned mNumChannels;
+	size_t mNumTaps;
+	size_t mNumPhases;
+	double mBaseStep;
+	double mStep;
+	double mPos;
+
+	std::vector<float> mFilter;
+	std::vector<float> mCoeffs;
+
+	// Planar history: mCapacity frames per channel
+	std::vector<float> mHistory;
+	size_t mCapacity;
+	size_t mFilled;
+
+	void createFilter(double cutoff, double beta);
+	void append(const float* in, size_t numFrames);
+	void shift(size_t numFrames);
+};
+
+}
+
+#endif /* SRC_ALSA_RESAMPLER_HPP_ */
@@ -0,0 +1,385 @@
+/*
+ *  Capture splitter
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "Splitter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "ThreadPolicy.hpp"
+
+using std::exception;
+using std::find;
+using std::lock_guard;
+using std::map;
+using std::max;
+using std::min;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::vector;
+using std::weak_ptr;
+
+namespace Alsa {
+
+/*******************************************************************************
+ * SplitterOutput
+ ******************************************************************************/
+
+SplitterOutput::SplitterOutput(size_t bufferSize, const AlsaPcmParams& params,
+							   snd_pcm_format_t format, unsigned rate, int domId) :
+	mRing(bufferSize - bufferSize % snd_pcm_format_size(format, params.numChannels)),
+	mFrameSize(snd_pcm_format_size(format, params.numChannels)),
+	mNumChannels(params.numChannels),
+	mRate(rate),
+	mInputRate(params.rate),
+	mOverrunBytes(0),
+	mError(false),
+	mLog("SplitterOutput", domId),
+	mOverrunLimit(cOverrunLogIntervalMs)
+{
+	if (format != params.format)
+	{
+		mConverter.reset(new FormatConverter(params.format, format));
+	}
+
+	if (rate != params.rate)
+	{
+		mResampler.reset(new Resampler(mNumChannels, params.rate, rate,
+									   Resampler::getQuality()));
+	}
+
+	LOG(mLog, DEBUG) << "Create splitter output, buffer size: " << mRing.getSize()
+					 << ", format: " << snd_pcm_format_name(format) << ", rate: " << rate;
+}
+
+void SplitterOutput::read(uint8_t* buffer, size_t size)
+{
+	DLOG(mLog, DEBUG) << "Read data, size: " << size << ", filled: " << mRing.getFilled();
+
+	size_t done = 0;
+
+	while(true)
+	{
+		done += mRing.read(&buffer[done], size - done);
+
+		if (done == size)
+		{
+			break;
+		}
+
+		if (mError)
+		{
+			throw AlsaPcmException("Splitter is stopped due to error");
+		}
+
+		pollfd fd = { .fd = mDataReady.getFd(), .events = POLLIN, .revents = 0 };
+
+		auto ret = poll(&fd, 1, cReadTimeoutMs);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			throw AlsaPcmException("Can't poll capture data: " + string(strerror(errno)));
+		}
+
+		if (ret == 0)
+		{
+			throw AlsaPcmException("Capture data timeout");
+		}
+
+		mDataReady.clear();
+	}
+}
+
+void SplitterOutput::push(const float* data, size_t numFrames)
+{
+	size_t pushed = 0;
+	size_t dropped = 0;
+
+	if (mResampler)
+	{
+		size_t bufferFrames = static_cast<uint64_t>(numFrames) * mRate / mInputRate + 1;
+
+		mResampleBuffer.resize(max(mResampleBuffer.size(), bufferFrames * mNumChannels));
+
+		while(numFrames > 0)
+		{
+			size_t numIn = numFrames;
+			size_t numOut = mResampleBuffer.size() / mNumChannels;
+
+			mResampler->process(data, numIn, mResampleBuffer.data(), numOut);
+
+			auto written = convert(mResampleBuffer.data(), numOut);
+
+			pushed += written;
+			dropped += numOut - written;
+
+			data = &data[numIn * mNumChannels];
+			numFrames -= numIn;
+
+			if (numIn == 0 && numOut == 0)
+			{
+				break;
+			}
+		}
+	}
+	else
+	{
+		pushed = convert(data, numFrames);
+		dropped = numFrames - pushed;
+	}
+
+	if (dropped)
+	{
+		mOverrunBytes += dropped * mFrameSize;
+
+		LOG_LIMIT(mLog, WARNING, mOverrunLimit) << "Output buffer overrun, dropped: " << dropped * mFrameSize;
+	}
+
+	if (pushed)
+	{
+		mDataReady.signal();
+	}
+}
+
+void SplitterOutput::setError()
+{
+	mError = true;
+
+	mDataReady.signal();
+}
+
+size_t SplitterOutput::convert(const float* data, size_t numFrames)
+{
+	auto src = reinterpret_cast<const uint8_t*>(data);
+
+	if (!mConverter)
+	{
+		return mRing.write(src, numFrames * mFrameSize) / mFrameSize;
+	}
+
+	size_t converted = 0;
+
+	// Convert directly into the ring, the free space is split into two
+	// regions at most
+	while(converted < numFrames)
+	{
+		uint8_t* region = nullptr;
+
+		auto frames = min(numFrames - converted, mRing.getWriteRegion(region) / mFrameSize);
+
+		if (frames == 0)
+		{
+			break;
+		}
+
+		mConverter->convert(&src[converted * mNumChannels * sizeof(float)], region,
+							frames * mNumChannels);
+
+		mRing.commit(frames * mFrameSize);
+
+		converted += frames;
+	}
+
+	return converted;
+}
+
+/*******************************************************************************
+ * Splitter
+ ******************************************************************************/
+
+mutex Splitter::sInstancesMutex;
+map<string, weak_ptr<Splitter>> Splitter::sInstances;
+
+Splitter::Splitter(const string& device, const AlsaPcmParams& params) :
+	mPcm(StreamType::CAPTURE, device),
+	mPeriodFrames(0),
+	mTerminate(false),
+	mError(false),
+	mLog("Splitter")
+{
+	LOG(mLog, INFO) << "Create splitter: " << device;
+
+	open(params);
+
+	mThread = thread(&Splitter::splitterThread, this);
+}
+
+Splitter::~Splitter()
+{
+	mTerminate = true;
+
+	mWakeup.signal();
+
+	if (mThread.joinable())
+	{
+		mThread.join();
+	}
+
+	LOG(mLog, INFO) << "Delete splitter";
+}
+
+shared_ptr<Splitter> Splitter::getInstance(const string& device,
+										   const AlsaPcmParams& params)
+{
+	lock_guard<mutex> lock(sInstancesMutex);
+
+	auto splitter = sInstances[device].lock();
+
+	// The failed splitter is replaced, its outputs are already stopped
+	if (!splitter || splitter->mError)
+	{
+		splitter.reset(new Splitter(device, params));
+
+		sInstances[device] = splitter;
+	}
+
+	return splitter;
+}
+
+shared_ptr<SplitterOutput> Splitter::addOutput(size_t bufferSize, snd_pcm_format_t format,
+											   unsigned rate, int domId)
+{
+	// The output holds at least one splitter period
+	shared_ptr<SplitterOutput> output(new SplitterOutput(max(bufferSize, mPcm.getPeriodBytes()),
+														 mPcm.getParams(), format, rate, domId));
+
+	lock_guard<mutex> lock(mMutex);
+
+	mOutputs.push_back(output);
+
+	LOG(mLog, DEBUG) << "Add output, num outputs: " << mOutputs.size();
+
+	return output;
+}
+
+void Splitter::removeOutput(shared_ptr<SplitterOutput> output)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = find(mOutputs.begin(), mOutputs.end(), output);
+
+	if (it != mOutputs.end())
+	{
+		mOutputs.erase(it);
+	}
+
+	LOG(mLog, DEBUG) << "Remove output, num outputs: " << mOutputs.size();
+}
+
+void Splitter::open(const AlsaPcmParams& params)
+{
+	AlsaPcmParams pcmParams(params);
+
+	// Outputs are resampled from float
+	pcmParams.format = SND_PCM_FORMAT_FLOAT;
+
+	mPcm.open(pcmParams);
+
+	// Period counted in stream frames
+	mPeriodFrames = max<size_t>(static_cast<uint64_t>(mPcm.getPeriodSize()) *
+								mPcm.getParams().rate / mPcm.getDeviceRate(), 1);
+
+	mPeriodBuffer.resize(mPeriodFrames * mPcm.getParams().numChannels);
+}
+
+void Splitter::splitterThread()
+{
+	XenBackend::ThreadPolicy::apply(XenBackend::ThreadPolicy::Group::DEVICE);
+
+	try
+	{
+		vector<pollfd> fds;
+
+		mPcm.getPollDescriptors(fds);
+
+		// The wakeup fd is always the last one
+		fds.push_back({ .fd = mWakeup.getFd(), .events = POLLIN, .revents = 0 });
+
+		// Prepared capture is not polled until started: the first read starts it
+		readPeriod();
+
+		while(!mTerminate)
+		{
+			if (poll(fds.data(), fds.size(), -1) < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				throw AlsaPcmException("Can't poll pcm device: " + string(strerror(errno)));
+			}
+
+			if (fds.back().revents & POLLIN)
+			{
+				mWakeup.clear();
+			}
+
+			if (mPcm.getPollEvents(fds.data(), fds.size() - 1) & (POLLIN | POLLERR))
+			{
+				readPeriod();
+			}
+		}
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+
+		stopOutputs();
+	}
+}
+
+void Splitter::stopOutputs()
+{
+	// Free the device for the splitter which replaces this one
+	mPcm.close();
+
+	mError = true;
+
+	lock_guard<mutex> lock(mMutex);
+
+	for (auto& output : mOutputs)
+	{
+		output->setError();
+	}
+}
+
+void Splitter::readPeriod()
+{
+	mPcm.read(reinterpret_cast<uint8_t*>(mPeriodBuffer.data()),
+			  mPeriodFrames * mPcm.getFrameSize());
+
+	lock_guard<mutex> lock(mMutex);
+
+	for (auto& output : mOutputs)
+	{
+		output->push(mPeriodBuffer.data(), mPeriodFrames);
+	}
+}
+
+}
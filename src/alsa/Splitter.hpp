@@ -0,0 +1,188 @@
+/*
+ *  Capture splitter
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_ALSA_SPLITTER_HPP_
+#define SRC_ALSA_SPLITTER_HPP_
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AlsaPcm.hpp"
+#include "EventFd.hpp"
+#include "FormatConverter.hpp"
+#include "PcmRing.hpp"
+#include "Resampler.hpp"
+#include "Log.hpp"
+
+namespace Alsa {
+
+/***************************************************************************//**
+ * Capture stream attached to the splitter.
+ * The splitter thread converts the captured data to the output rate and
+ * format and queues it into the output buffer. The data which doesn't fit
+ * into the output buffer is dropped.
+ ******************************************************************************/
+class SplitterOutput
+{
+public:
+	/**
+	 * @param[in] bufferSize output buffer size in bytes of the output format
+	 * @param[in] params     splitter parameters
+	 * @param[in] format     output format
+	 * @param[in] rate       output rate
+	 * @param[in] domId      domain the output serves
+	 */
+	SplitterOutput(size_t bufferSize, const AlsaPcmParams& params,
+				   snd_pcm_format_t format, unsigned rate,
+				   int domId = XenBackend::Log::cNoDomain);
+	SplitterOutput(const SplitterOutput&) = delete;
+	SplitterOutput& operator=(SplitterOutput const&) = delete;
+
+	/**
+	 * Copies the captured data, waits if there is not enough data. Throws
+	 * if the splitter is stopped due to error.
+	 * @param[out] buffer pointer to the destination
+	 * @param[in]  size   number of bytes requested
+	 */
+	void read(uint8_t* buffer, size_t size);
+
+	/**
+	 * Returns number of bytes in the output buffer
+	 */
+	size_t getFilled() const { return mRing.getFilled(); }
+
+	/**
+	 * Returns number of bytes dropped due to output buffer overrun
+	 */
+	uint64_t getOverrunBytes() const { return mOverrunBytes; }
+
+private:
+	friend class Splitter;
+
+	const int cReadTimeoutMs = 1000;
+	const unsigned cOverrunLogIntervalMs = 1000;
+
+	PcmRing mRing;
+	size_t mFrameSize;
+	unsigned mNumChannels;
+	unsigned mRate;
+	unsigned mInputRate;
+	std::unique_ptr<FormatConverter> mConverter;
+	std::unique_ptr<Resampler> mResampler;
+	std::vector<float> mResampleBuffer;
+	std::atomic<uint64_t> mOverrunBytes;
+	std::atomic_bool mError;
+
+	XenBackend::EventFd mDataReady;
+
+	XenBackend::Log mLog;
+	XenBackend::LogRateLimit mOverrunLimit;
+
+	void push(const float* data, size_t numFrames);
+	void setError();
+	size_t convert(const float* data, size_t numFrames);
+};
+
+/***************************************************************************//**
+ * Feeds capture streams from one capture device.
+ * One splitter instance is created per device. The device is opened once in
+ * the float format, the splitter thread reads it by periods and pushes them
+ * to each output. Outputs should have the splitter
+ * number of channels, the rate and linear formats are converted per output.
+ * Outputs may be added at any time, they get the data from the next period.
+ * If the capture fails, the outputs are stopped with error and the next
+ * getInstance() creates a new splitter.
+ ******************************************************************************/
+class Splitter
+{
+public:
+	/**
+	 * @param[in] device device name
+	 * @param[in] params device parameters, the format is ignored
+	 */
+	Splitter(const std::string& device, const AlsaPcmParams& params);
+	Splitter(const Splitter&) = delete;
+	Splitter& operator=(Splitter const&) = delete;
+	~Splitter();
+
+	/**
+	 * Returns the splitter of the device. The splitter is created on the
+	 * first request and destroyed when the last reference is released.
+	 * @param[in] device device name
+	 * @param[in] params parameters used to create the splitter
+	 */
+	static std::shared_ptr<Splitter> getInstance(const std::string& device,
+												 const AlsaPcmParams& params);
+
+	/**
+	 * Returns the device parameters
+	 */
+	const AlsaPcmParams& getParams() const { return mPcm.getParams(); }
+
+	/**
+	 * Creates new output.
+	 * @param[in] bufferSize output buffer size in bytes of the output format
+	 * @param[in] format     output format
+	 * @param[in] rate       output rate
+	 * @param[in] domId      domain the output serves
+	 */
+	std::shared_ptr<SplitterOutput> addOutput(size_t bufferSize, snd_pcm_format_t format,
+											  unsigned rate,
+											  int domId = XenBackend::Log::cNoDomain);
+
+	/**
+	 * Removes the output. Not read data is dropped.
+	 */
+	void removeOutput(std::shared_ptr<SplitterOutput> output);
+
+private:
+
+	static std::mutex sInstancesMutex;
+	static std::map<std::string, std::weak_ptr<Splitter>> sInstances;
+
+	AlsaPcm mPcm;
+	size_t mPeriodFrames;
+
+	std::vector<std::shared_ptr<SplitterOutput>> mOutputs;
+	std::mutex mMutex;
+
+	std::vector<float> mPeriodBuffer;
+
+	XenBackend::EventFd mWakeup;
+	std::thread mThread;
+	std::atomic_bool mTerminate;
+	std::atomic_bool mError;
+
+	XenBackend::Log mLog;
+
+	void open(const AlsaPcmParams& params);
+	void splitterThread();
+	void stopOutputs();
+	void readPeriod();
+};
+
+}
+
+#endif /* SRC_ALSA_SPLITTER_HPP_ */
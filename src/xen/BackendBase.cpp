@@ -20,19 +20,21 @@
 
 #include "BackendBase.hpp"
 
-#include <chrono>
+#include <cerrno>
 #include <thread>
 
+#include <poll.h>
+
 #include "Utils.hpp"
 
-using std::chrono::milliseconds;
 using std::make_pair;
+using std::move;
 using std::unique_ptr;
 using std::pair;
 using std::shared_ptr;
 using std::stoi;
 using std::string;
-using std::this_thread::sleep_for;
+using std::thread;
 using std::vector;
 
 namespace XenBackend {
@@ -55,8 +57,22 @@ BackendBase::BackendBase(int domId, const string& deviceName, int id) :
 
 BackendBase::~BackendBase()
 {
+	// Frontends are independent, tear them down in parallel
+	vector<thread> threads;
+
+	for (auto& handler : mFrontendHandlers)
+	{
+		threads.emplace_back([](shared_ptr<FrontendHandlerBase> handler) {},
+							 move(handler.second));
+	}
+
 	mFrontendHandlers.clear();
 
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
 	LOG(mLog, DEBUG) << "Delete backend: " << mDeviceName << ", " << mId;
 }
 
@@ -79,13 +95,16 @@ void BackendBase::run()
 
 		checkTerminatedFrontends();
 
-		sleep_for(milliseconds(cPollFrontendIntervalMs));
+		waitTerminate();
 	}
 }
 
 void BackendBase::stop()
 {
+	// Called from signal handlers: only the atomic and write() are used
 	mTerminate = true;
+
+	mTerminateEvent.signal();
 }
 
 /***************************************************************************//**
@@ -140,6 +159,16 @@ bool BackendBase::getNewFrontend(int& domId, int& id)
  * Private
  ******************************************************************************/
 
+void BackendBase::waitTerminate()
+{
+	pollfd fds = { .fd = mTerminateEvent.getFd(), .events = POLLIN, .revents = 0 };
+
+	if (poll(&fds, 1, cPollFrontendIntervalMs) < 0 && errno != EINTR)
+	{
+		throw BackendException("Can't poll terminate event");
+	}
+}
+
 void BackendBase::createFrontendHandler(const std::pair<int, int>& ids)
 {
 	if ((ids.first > 0) &&
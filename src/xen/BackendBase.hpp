@@ -28,6 +28,7 @@
 #include <string>
 #include <utility>
 
+#include "EventFd.hpp"
 #include "FrontendHandlerBase.hpp"
 #include "XenException.hpp"
 #include "XenStore.hpp"
@@ -166,11 +167,13 @@ private:
 			 std::shared_ptr<FrontendHandlerBase>> mFrontendHandlers;
 
 	std::atomic_bool mTerminate;
+	EventFd mTerminateEvent;
 
 	Log mLog;
 
 	void createFrontendHandler(const std::pair<int, int>& ids);
 	void checkTerminatedFrontends();
+	void waitTerminate();
 };
 
 }
@@ -0,0 +1,72 @@
+/*
+ *  Event fd wrapper
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "EventFd.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using std::string;
+
+namespace XenBackend {
+
+EventFd::EventFd()
+{
+	mFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (mFd < 0)
+	{
+		throw EventFdException("Can't create event fd: " +
+							   string(strerror(errno)));
+	}
+}
+
+EventFd::~EventFd()
+{
+	close(mFd);
+}
+
+void EventFd::signal()
+{
+	uint64_t value = 1;
+
+	if (::write(mFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+	{
+		throw EventFdException("Can't signal event fd: " +
+							   string(strerror(errno)));
+	}
+}
+
+void EventFd::clear()
+{
+	uint64_t value;
+
+	if (::read(mFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+	{
+		throw EventFdException("Can't clear event fd: " +
+							   string(strerror(errno)));
+	}
+}
+
+}
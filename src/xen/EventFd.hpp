@@ -0,0 +1,70 @@
+/*
+ *  Event fd wrapper
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_XEN_EVENTFD_HPP_
+#define SRC_XEN_EVENTFD_HPP_
+
+#include "XenException.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by EventFd
+ * @ingroup Xen
+ ******************************************************************************/
+class EventFdException : public XenException
+{
+	using XenException::XenException;
+};
+
+/***************************************************************************//**
+ * Wakes up a thread which polls the fd together with other descriptors.
+ * @ingroup Xen
+ ******************************************************************************/
+class EventFd
+{
+public:
+	EventFd();
+	EventFd(const EventFd&) = delete;
+	EventFd& operator=(EventFd const&) = delete;
+	~EventFd();
+
+	/**
+	 * Returns the fd which becomes readable (POLLIN) when signaled
+	 */
+	int getFd() const { return mFd; }
+
+	/**
+	 * Makes the fd readable
+	 */
+	void signal();
+
+	/**
+	 * Resets the signaled state
+	 */
+	void clear();
+
+private:
+	int mFd;
+};
+
+}
+
+#endif /* SRC_XEN_EVENTFD_HPP_ */
@@ -0,0 +1,424 @@
+/*
+ *  Work stealing executor
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "Executor.hpp"
+
+#include <cstring>
+
+#include <pthread.h>
+
+#include "ThreadPolicy.hpp"
+
+using std::atomic;
+using std::atomic_bool;
+using std::exception;
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::shared_ptr;
+using std::thread;
+using std::unique_lock;
+using std::unique_ptr;
+using std::weak_ptr;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * Executor
+ ******************************************************************************/
+
+mutex Executor::sInstanceMutex;
+weak_ptr<Executor> Executor::sInstance;
+atomic<size_t> Executor::sNumWorkers(0);
+atomic<size_t> Executor::sQueueDepth(64);
+atomic_bool Executor::sPinning(false);
+
+thread_local Executor* Executor::sCurrent = nullptr;
+thread_local size_t Executor::sCurrentWorker = 0;
+
+Executor::Executor(size_t numWorkers, size_t queueDepth, bool pinning) :
+	mQueueDepth(queueDepth),
+	mPinning(pinning),
+	mNumQueued(0),
+	mNext(0),
+	mOverflows(0),
+	mTerminate(false),
+	mLog("Executor")
+{
+	LOG(mLog, INFO) << "Create executor, workers: " << numWorkers
+					<< ", queue depth: " << queueDepth
+					<< ", pinning: " << (pinning ? "on" : "off");
+
+	for (size_t i = 0; i < numWorkers; i++)
+	{
+		unique_ptr<Worker> worker(new Worker());
+
+		worker->executed = 0;
+		worker->stolen = 0;
+
+		mWorkers.push_back(move(worker));
+	}
+
+	for (size_t i = 0; i < numWorkers; i++)
+	{
+		mWorkers[i]->thread = thread(&Executor::workerThread, this, i);
+
+		if (pinning)
+		{
+			pin(i);
+		}
+	}
+}
+
+Executor::~Executor()
+{
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mTerminate = true;
+
+		mCondVar.notify_all();
+	}
+
+	for (auto& worker : mWorkers)
+	{
+		if (worker->thread.joinable())
+		{
+			worker->thread.join();
+		}
+	}
+
+	logStats();
+
+	LOG(mLog, INFO) << "Delete executor";
+}
+
+shared_ptr<Executor> Executor::getInstance()
+{
+	lock_guard<mutex> lock(sInstanceMutex);
+
+	auto executor = sInstance.lock();
+
+	if (!executor)
+	{
+		executor.reset(new Executor(sNumWorkers, sQueueDepth, sPinning));
+
+		sInstance = executor;
+	}
+
+	return executor;
+}
+
+void Executor::submit(Task task)
+{
+	if (queue(task))
+	{
+		return;
+	}
+
+	mOverflows++;
+
+	DLOG(mLog, DEBUG) << "All queues are full, run task in place";
+
+	task();
+}
+
+bool Executor::trySubmit(Task task)
+{
+	return queue(task);
+}
+
+bool Executor::queue(Task& task)
+{
+	auto numWorkers = mWorkers.size();
+
+	// Keep the task on the current worker: its data is hot in the cache
+	size_t first = sCurrent == this ? sCurrentWorker : mNext++ % numWorkers;
+
+	for (size_t i = 0; i < numWorkers; i++)
+	{
+		if (push((first + i) % numWorkers, task))
+		{
+			lock_guard<mutex> lock(mMutex);
+
+			mNumQueued++;
+
+			mCondVar.notify_one();
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+size_t Executor::getQueueSize(size_t worker) const
+{
+	lock_guard<mutex> lock(mWorkers[worker]->mutex);
+
+	return mWorkers[worker]->tasks.size();
+}
+
+void Executor::logStats()
+{
+	for (size_t i = 0; i < mWorkers.size(); i++)
+	{
+		LOG(mLog, INFO) << "Worker: " << i << ", queued: " << getQueueSize(i)
+						<< ", executed: " << getExecuted(i)
+						<< ", stolen: " << getStolen(i);
+	}
+
+	LOG(mLog, INFO) << "Run in place: " << mOverflows;
+}
+
+bool Executor::push(size_t worker, Task& task)
+{
+	auto& item = *mWorkers[worker];
+
+	lock_guard<mutex> lock(item.mutex);
+
+	if (item.tasks.size() >= mQueueDepth)
+	{
+		return false;
+	}
+
+	item.tasks.push_back(move(task));
+
+	return true;
+}
+
+bool Executor::pop(size_t worker, Task& task)
+{
+	auto& item = *mWorkers[worker];
+
+	lock_guard<mutex> lock(item.mutex);
+
+	if (item.tasks.empty())
+	{
+		return false;
+	}
+
+	task = move(item.tasks.front());
+
+	item.tasks.pop_front();
+
+	return true;
+}
+
+bool Executor::steal(size_t worker, Task& task)
+{
+	for (size_t i = 1; i < mWorkers.size(); i++)
+	{
+		auto& item = *mWorkers[(worker + i) % mWorkers.size()];
+
+		lock_guard<mutex> lock(item.mutex);
+
+		if (!item.tasks.empty())
+		{
+			task = move(item.tasks.back());
+
+			item.tasks.pop_back();
+
+			mWorkers[worker]->stolen++;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void Executor::pin(size_t worker)
+{
+	auto& ringCpus = ThreadPolicy::getCpus(ThreadPolicy::Group::RING);
+	auto numCpus = ringCpus.empty() ? thread::hardware_concurrency() : ringCpus.size();
+
+	if (numCpus == 0)
+	{
+		return;
+	}
+
+	// Spread the workers over the ring threads CPUs if they are configured
+	auto cpu = ringCpus.empty() ? worker % numCpus : ringCpus[worker % numCpus];
+
+	cpu_set_t cpuSet;
+
+	CPU_ZERO(&cpuSet);
+	CPU_SET(cpu, &cpuSet);
+
+	if (auto ret = pthread_setaffinity_np(mWorkers[worker]->thread.native_handle(),
+										  sizeof(cpuSet), &cpuSet))
+	{
+		LOG(mLog, WARNING) << "Can't pin worker: " << worker << ", error: " << strerror(ret);
+	}
+}
+
+void Executor::workerThread(size_t worker)
+{
+	sCurrent = this;
+	sCurrentWorker = worker;
+
+	// Pinned workers get own CPU from pin()
+	ThreadPolicy::apply(ThreadPolicy::Group::RING, !mPinning);
+
+	while(true)
+	{
+		Task task;
+
+		if (pop(worker, task) || steal(worker, task))
+		{
+			mNumQueued--;
+
+			try
+			{
+				task();
+			}
+			catch(const exception& e)
+			{
+				LOG(mLog, ERROR) << e.what();
+			}
+
+			mWorkers[worker]->executed++;
+
+			continue;
+		}
+
+		unique_lock<mutex> lock(mMutex);
+
+		mCondVar.wait(lock, [this] { return mTerminate || mNumQueued > 0; });
+
+		if (mTerminate)
+		{
+			return;
+		}
+	}
+}
+
+/*******************************************************************************
+ * SerialQueue
+ ******************************************************************************/
+
+SerialQueue::SerialQueue(shared_ptr<Executor> executor) :
+	mExecutor(executor),
+	mScheduled(false),
+	mStopped(false)
+{
+}
+
+SerialQueue::~SerialQueue()
+{
+	stop();
+}
+
+void SerialQueue::stop()
+{
+	unique_lock<mutex> lock(mMutex);
+
+	mStopped = true;
+
+	mTasks.clear();
+
+	// The running task may stop own queue
+	if (mRunner == std::this_thread::get_id())
+	{
+		return;
+	}
+
+	mCondVar.wait(lock, [this] { return !mScheduled; });
+}
+
+void SerialQueue::post(Task task)
+{
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		if (mStopped)
+		{
+			return;
+		}
+
+		mTasks.push_back(move(task));
+
+		if (mScheduled)
+		{
+			return;
+		}
+
+		mScheduled = true;
+	}
+
+	mExecutor->submit([this] { run(); });
+}
+
+void SerialQueue::run()
+{
+	while(true)
+	{
+		for (size_t i = 0; i < cBatchSize; i++)
+		{
+			Task task;
+
+			{
+				lock_guard<mutex> lock(mMutex);
+
+				if (mTasks.empty())
+				{
+					mScheduled = false;
+					mRunner = std::thread::id();
+
+					// The destructor may proceed when the lock is released
+					mCondVar.notify_all();
+
+					return;
+				}
+
+				task = move(mTasks.front());
+
+				mTasks.pop_front();
+
+				mRunner = std::this_thread::get_id();
+			}
+
+			try
+			{
+				task();
+			}
+			catch(const exception& e)
+			{
+				LOG("SerialQueue", ERROR) << e.what();
+			}
+		}
+
+		{
+			lock_guard<mutex> lock(mMutex);
+
+			mRunner = std::thread::id();
+		}
+
+		// Yield the worker to other queues. If all queues are full, go on
+		// here: running in place would nest run() calls.
+		if (mExecutor->trySubmit([this] { run(); }))
+		{
+			return;
+		}
+	}
+}
+
+}
@@ -0,0 +1,221 @@
+/*
+ *  Work stealing executor
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_XEN_EXECUTOR_HPP_
+#define SRC_XEN_EXECUTOR_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Log.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Runs tasks on a pool of worker threads.
+ * Each worker has own task queue. A task submitted from a worker goes to its
+ * queue, other tasks are spread over the workers round robin. A worker takes
+ * tasks from the front of own queue and steals from the back of other queues
+ * when own queue is empty. If all queues are at the configured depth, the
+ * task is run by the submitter.
+ * @ingroup Xen
+ ******************************************************************************/
+class Executor
+{
+public:
+	typedef std::function<void()> Task;
+
+	/**
+	 * @param[in] numWorkers number of worker threads
+	 * @param[in] queueDepth maximal number of tasks per worker queue
+	 * @param[in] pinning    pin worker N to CPU N
+	 */
+	Executor(size_t numWorkers, size_t queueDepth, bool pinning);
+	Executor(const Executor&) = delete;
+	Executor& operator=(Executor const&) = delete;
+	~Executor();
+
+	/**
+	 * Returns the executor. The executor is created on the first request and
+	 * destroyed when the last reference is released.
+	 */
+	static std::shared_ptr<Executor> getInstance();
+
+	/**
+	 * Sets number of workers of new executors, 0 - disable the executor
+	 */
+	static void setNumWorkers(size_t numWorkers) { sNumWorkers = numWorkers; }
+
+	/**
+	 * Returns number of workers of new executors
+	 */
+	static size_t getNumWorkers() { return sNumWorkers; }
+
+	/**
+	 * Sets maximal number of tasks per worker queue of new executors
+	 */
+	static void setQueueDepth(size_t queueDepth) { sQueueDepth = queueDepth; }
+
+	/**
+	 * Enables pinning workers of new executors to CPUs
+	 */
+	static void setPinning(bool pinning) { sPinning = pinning; }
+
+	/**
+	 * Queues the task.
+	 * @param[in] task task
+	 */
+	void submit(Task task);
+
+	/**
+	 * Queues the task if there is a free queue slot, never runs it in place.
+	 * @param[in] task task
+	 * @return <i>true</i> if the task is queued
+	 */
+	bool trySubmit(Task task);
+
+	/**
+	 * Returns number of tasks in the worker queue
+	 * @param[in] worker worker index
+	 */
+	size_t getQueueSize(size_t worker) const;
+
+	/**
+	 * Returns number of tasks executed by the worker
+	 * @param[in] worker worker index
+	 */
+	uint64_t getExecuted(size_t worker) const { return mWorkers[worker]->executed; }
+
+	/**
+	 * Returns number of tasks the worker stole from other queues
+	 * @param[in] worker worker index
+	 */
+	uint64_t getStolen(size_t worker) const { return mWorkers[worker]->stolen; }
+
+	/**
+	 * Returns number of tasks run by the submitter due to full queues
+	 */
+	uint64_t getOverflows() const { return mOverflows; }
+
+	/**
+	 * Logs the worker counters
+	 */
+	void logStats();
+
+private:
+
+	struct Worker
+	{
+		mutable std::mutex mutex;
+		std::deque<Task> tasks;
+		std::thread thread;
+		std::atomic<uint64_t> executed;
+		std::atomic<uint64_t> stolen;
+	};
+
+	static std::mutex sInstanceMutex;
+	static std::weak_ptr<Executor> sInstance;
+	static std::atomic<size_t> sNumWorkers;
+	static std::atomic<size_t> sQueueDepth;
+	static std::atomic_bool sPinning;
+
+	static thread_local Executor* sCurrent;
+	static thread_local size_t sCurrentWorker;
+
+	std::vector<std::unique_ptr<Worker>> mWorkers;
+	size_t mQueueDepth;
+	bool mPinning;
+
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::atomic<size_t> mNumQueued;
+	std::atomic<size_t> mNext;
+	std::atomic<uint64_t> mOverflows;
+	bool mTerminate;
+
+	Log mLog;
+
+	bool queue(Task& task);
+	bool push(size_t worker, Task& task);
+	bool pop(size_t worker, Task& task);
+	bool steal(size_t worker, Task& task);
+	void pin(size_t worker);
+	void workerThread(size_t worker);
+};
+
+/***************************************************************************//**
+ * Runs tasks one by one in the posting order on the executor.
+ * At most one task of the queue is running at a time, so the tasks of one
+ * queue are serialized while different queues run in parallel. stop() and
+ * the destructor drop not started tasks and wait for the running one.
+ * @ingroup Xen
+ ******************************************************************************/
+class SerialQueue
+{
+public:
+	typedef std::function<void()> Task;
+
+	/**
+	 * @param[in] executor executor which runs the tasks
+	 */
+	explicit SerialQueue(std::shared_ptr<Executor> executor);
+	SerialQueue(const SerialQueue&) = delete;
+	SerialQueue& operator=(SerialQueue const&) = delete;
+	~SerialQueue();
+
+	/**
+	 * Queues the task.
+	 * @param[in] task task
+	 */
+	void post(Task task);
+
+	/**
+	 * Drops not started tasks and waits for the running one. The tasks
+	 * posted after are ignored.
+	 */
+	void stop();
+
+private:
+
+	// Tasks run at once before the queue yields the worker
+	const size_t cBatchSize = 16;
+
+	std::shared_ptr<Executor> mExecutor;
+
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::deque<Task> mTasks;
+	bool mScheduled;
+	bool mStopped;
+	std::thread::id mRunner;
+
+	void run();
+};
+
+}
+
+#endif /* SRC_XEN_EXECUTOR_HPP_ */
@@ -31,12 +31,12 @@ extern "C" {
 
 #include "BackendBase.hpp"
 #include "Utils.hpp"
+#include "XenGnttab.hpp"
 
 using std::bind;
 using std::exception;
 using std::find;
 using std::lock_guard;
-using std::make_pair;
 using std::mutex;
 using std::placeholders::_1;
 using std::shared_ptr;
@@ -45,6 +45,7 @@ using std::string;
 using std::stringstream;
 using std::to_string;
 using std::vector;
+using std::weak_ptr;
 
 namespace XenBackend {
 
@@ -58,7 +59,7 @@ FrontendHandlerBase::FrontendHandlerBase(int domId,
 	mFrontendState(XenbusStateUnknown),
 	mXenStore(bind(&FrontendHandlerBase::onXenError, this, _1)),
 	mWaitForFrontendInitialising(true),
-	mLog("Frontend")
+	mLog("Frontend", domId)
 {
 	mLogId = Utils::logDomId(mDomId, mId) + " - ";
 
@@ -77,23 +78,119 @@ FrontendHandlerBase::FrontendHandlerBase(int domId,
 
 FrontendHandlerBase::~FrontendHandlerBase()
 {
+	// Wake up all event threads at once, the joins below don't wait in turn
+	for (auto& channel : mChannels)
+	{
+		channel.eventChannel->stop();
+	}
+
+	// The queued requests refer to the handler: drop them and wait for the
+	// running one
+	for (auto& channel : mChannels)
+	{
+		if (channel.queue)
+		{
+			channel.queue->stop();
+		}
+	}
+
+	vector<weak_ptr<XenEvtchn>> eventChannels;
+
+	for (auto& channel : mChannels)
+	{
+		eventChannels.push_back(channel.eventChannel);
+	}
+
+	// Joins the event threads and unbinds the ports
 	mChannels.clear();
 
+	// A channel which outlives the handler leaks its thread and evtchn handle
+	for (auto& eventChannel : eventChannels)
+	{
+		if (!eventChannel.expired())
+		{
+			LOG(mLog, ERROR) << mLogId << "Event channel is not deleted";
+		}
+	}
+
+	// The buffers released by the channels are not reused anymore
+	XenGnttabCache::invalidate(mDomId);
+
 	setBackendState(XenbusStateClosed);
 
 	LOG(mLog, DEBUG) << mLogId << "Delete frontend handler";
 }
 
 void FrontendHandlerBase::addChannel(int evtchnPort,
-									 shared_ptr<RingBufferItf> ringBuffer)
+									 shared_ptr<RingBufferItf> ringBuffer,
+									 unsigned busyPollUs)
 {
-	shared_ptr<XenEvtchn> eventChannel(new XenEvtchn(mDomId, evtchnPort,
-			[ringBuffer] { ringBuffer->onRequestReceived(); },
+	shared_ptr<SerialQueue> queue;
+	XenEvtchn::Callback callback = [ringBuffer] { ringBuffer->onRequestReceived(); };
+
+	// Process the requests on the executor, the queue keeps the stream order
+	if (Executor::getNumWorkers())
+	{
+		queue.reset(new SerialQueue(Executor::getInstance()));
+
+		weak_ptr<RingBufferItf> weakRingBuffer(ringBuffer);
+
+		// The queue is stopped before the handler is deleted, the ring buffer
+		// may be released while the task is queued
+		callback = [this, queue, weakRingBuffer]
+		{
+			queue->post([this, weakRingBuffer]
+			{
+				auto ringBuffer = weakRingBuffer.lock();
+
+				if (!ringBuffer)
+				{
+					return;
+				}
+
+				try
+				{
+					ringBuffer->onRequestReceived();
+				}
+				catch(const exception& e)
+				{
+					onXenError(e);
+				}
+			});
+		};
+	}
+
+	shared_ptr<XenEvtchn> eventChannel(new XenEvtchn(mDomId, evtchnPort, callback,
 			[this] (const exception& e) { onXenError(e); } ));
 
-	ringBuffer->setNotifyEventChannelCbk([eventChannel] { eventChannel->notify(); });
+	weak_ptr<XenEvtchn> weakChannel(eventChannel);
 
-	mChannels.push_back(make_pair(eventChannel, ringBuffer));
+	// The event channel holds the ring buffer by the callback: a strong
+	// reference back would keep both alive after the channel is removed
+	ringBuffer->setNotifyEventChannelCbk([weakChannel]
+	{
+		if (auto channel = weakChannel.lock())
+		{
+			channel->notify();
+		}
+	});
+
+	// Spinning makes sense only when the requests are processed in place
+	if (busyPollUs)
+	{
+		if (queue)
+		{
+			LOG(mLog, WARNING) << mLogId << "Busy poll is not supported "
+							   << "with workers, port: " << evtchnPort;
+		}
+		else
+		{
+			eventChannel->setBusyPoll(busyPollUs,
+				[ringBuffer] { return ringBuffer->isRequestPending(); });
+		}
+	}
+
+	mChannels.push_back(Channel{queue, ringBuffer, eventChannel});
 
 	LOG(mLog, INFO) << mLogId << "Add channel, evtchn port: "
 					<< eventChannel->getPort();
@@ -193,6 +290,9 @@ void FrontendHandlerBase::frontendStateChanged(xenbus_state state)
 	case XenbusStateClosing:
 	case XenbusStateClosed:
 
+		// The frontend is going to revoke the grants
+		XenGnttabCache::invalidate(mDomId);
+
 		setBackendState(XenbusStateClosing);
 
 		break;
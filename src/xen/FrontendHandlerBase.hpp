@@ -33,6 +33,7 @@ extern "C" {
 #include <xen/io/xenbus.h>
 }
 
+#include "Executor.hpp"
 #include "RingBufferBase.hpp"
 #include "XenEvtchn.hpp"
 #include "XenException.hpp"
@@ -109,6 +110,11 @@ public:
 	 */
 	const std::string& getXsFrontendPath() const { return mXsFrontendPath; }
 
+	/**
+	 * Returns backend xen store base path
+	 */
+	const std::string& getXsBackendPath() const { return mXsBackendPath; }
+
 	/**
 	 * Returns reference to the xen store instance accociated with the frontend
 	 */
@@ -131,8 +137,11 @@ protected:
 	 * Add new data channel to the frontend handler.
 	 * @param[in] evtchnPort port for the event channel
 	 * @param[in] ringBuffer the ring buffer instance
+	 * @param[in] busyPollUs time in us to busy poll the ring after an event,
+	 *                       0 - always wait for the event
 	 */
-	void addChannel(int evtchnPort, std::shared_ptr<RingBufferItf> ringBuffer);
+	void addChannel(int evtchnPort, std::shared_ptr<RingBufferItf> ringBuffer,
+					unsigned busyPollUs = 0);
 
 private:
 	int mId;
@@ -147,8 +156,16 @@ private:
 	std::string mXsBackendPath;
 	std::string mXsFrontendPath;
 
-	std::list<std::pair<std::shared_ptr<XenEvtchn>,
-						std::shared_ptr<RingBufferItf>>> mChannels;
+	// Members are destroyed in reverse order: the event channel stops posting
+	// before the queue drops the pending requests
+	struct Channel
+	{
+		std::shared_ptr<SerialQueue> queue;
+		std::shared_ptr<RingBufferItf> ringBuffer;
+		std::shared_ptr<XenEvtchn> eventChannel;
+	};
+
+	std::list<Channel> mChannels;
 
 	bool mWaitForFrontendInitialising;
 
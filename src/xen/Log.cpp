@@ -21,37 +21,258 @@
 #include "Log.hpp"
 
 #include <algorithm>
+#include <cctype>
 #include <chrono>
-#include <iomanip>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <iostream>
+#include <map>
+#include <set>
+#include <unordered_map>
 
+using std::all_of;
 using std::atomic;
 using std::atomic_bool;
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
-using std::chrono::system_clock;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::cout;
-using std::endl;
-using std::localtime;
 using std::lock_guard;
+using std::make_shared;
+using std::map;
+using std::min;
 using std::mutex;
-using std::ostringstream;
-using std::put_time;
-using std::setfill;
-using std::setw;
+using std::ostream;
+using std::set;
+using std::shared_ptr;
+using std::stable_sort;
+using std::stoi;
 using std::string;
+using std::thread;
 using std::to_string;
 using std::transform;
+using std::unique_lock;
+using std::unordered_map;
+using std::vector;
 
 namespace XenBackend {
 
 atomic<LogLevel> Log::sCurrentLevel(LogLevel::logINFO);
 atomic_bool Log::sShowFileAndLine(false);
+atomic_bool Log::sModuleLevelsSet(false);
+// Starts from 1: a default constructed cache entry is never valid
+atomic<uint64_t> Log::sLevelGeneration(1);
+
+atomic<size_t> LogFormatter::sAlignmentLength(0);
+
+atomic_bool LogWriter::sRunning(false);
+mutex LogWriter::sSyncMutex;
+const int LogWriter::cFlushIntervalMs;
+
+/*******************************************************************************
+ * Log
+ ******************************************************************************/
+
+// Registered instances and the levels set per module and per domain
+struct LogRegistry
+{
+	mutex mtx;
+	set<Log*> instances;
+	map<string, LogLevel> moduleLevels;
+	map<int, LogLevel> domainLevels;
+};
+
+static LogRegistry& getLogRegistry()
+{
+	// Never destroyed: the instances of static objects unregister at exit
+	static LogRegistry* registry = new LogRegistry();
+
+	return *registry;
+}
+
+Log::Log(const string& name, int domId, bool fileAndLine) :
+	mName(name),
+	mModule(name.substr(0, name.find('('))),
+	mDomId(domId),
+	mLevel(sCurrentLevel.load()),
+	mFileAndLine(fileAndLine)
+{
+	registerInstance();
+}
+
+Log::Log(const Log& log) :
+	mName(log.mName),
+	mModule(log.mModule),
+	mDomId(log.mDomId),
+	mLevel(log.mLevel.load()),
+	mFileAndLine(log.mFileAndLine)
+{
+	registerInstance();
+}
 
-size_t LogLine::sAlignmentLength = 0;
+Log::~Log()
+{
+	auto& registry = getLogRegistry();
+
+	lock_guard<mutex> lock(registry.mtx);
+
+	registry.instances.erase(this);
+}
+
+void Log::setLogLevel(LogLevel level)
+{
+	auto& registry = getLogRegistry();
+
+	lock_guard<mutex> lock(registry.mtx);
+
+	sCurrentLevel = level;
+	sLevelGeneration++;
 
-bool Log::setLogLevel(const string& strLevel)
+	for (auto instance : registry.instances)
+	{
+		instance->updateLevel();
+	}
+}
+
+bool Log::setLogLevel(const string& config)
+{
+	struct Entry
+	{
+		string key;
+		LogLevel level;
+		bool isDefault;
+	};
+
+	vector<Entry> entries;
+	size_t pos = 0;
+
+	// Parse all entries first to not apply the config partially
+	while(pos <= config.size())
+	{
+		auto next = min(config.find(',', pos), config.size());
+		auto item = config.substr(pos, next - pos);
+		auto sep = item.find('=');
+
+		Entry entry { sep == string::npos ? "" : item.substr(0, sep),
+					  LogLevel::logDISABLE, false };
+
+		if (!parseLevel(sep == string::npos ? item : item.substr(sep + 1),
+						entry.level, entry.isDefault))
+		{
+			return false;
+		}
+
+		if (entry.key.empty() && (sep != string::npos || entry.isDefault))
+		{
+			return false;
+		}
+
+		entries.push_back(entry);
+
+		pos = next + 1;
+	}
+
+	auto& registry = getLogRegistry();
+
+	lock_guard<mutex> lock(registry.mtx);
+
+	for (auto& entry : entries)
+	{
+		if (entry.key.empty())
+		{
+			sCurrentLevel = entry.level;
+		}
+		else if (entry.key.compare(0, 3, "dom") == 0 && entry.key.size() > 3 &&
+				 all_of(entry.key.begin() + 3, entry.key.end(), ::isdigit))
+		{
+			auto domId = stoi(entry.key.substr(3));
+
+			if (entry.isDefault)
+			{
+				registry.domainLevels.erase(domId);
+			}
+			else
+			{
+				registry.domainLevels[domId] = entry.level;
+			}
+		}
+		else
+		{
+			if (entry.isDefault)
+			{
+				registry.moduleLevels.erase(entry.key);
+			}
+			else
+			{
+				registry.moduleLevels[entry.key] = entry.level;
+			}
+		}
+	}
+
+	sModuleLevelsSet = !registry.moduleLevels.empty();
+	sLevelGeneration++;
+
+	for (auto instance : registry.instances)
+	{
+		instance->updateLevel();
+	}
+
+	return true;
+}
+
+void Log::setDomain(int domId)
+{
+	auto& registry = getLogRegistry();
+
+	lock_guard<mutex> lock(registry.mtx);
+
+	mDomId = domId;
+
+	updateLevel();
+}
+
+LogLevel Log::getLevel(const char* name)
+{
+	if (!sModuleLevelsSet.load(std::memory_order_relaxed) || !name)
+	{
+		return sCurrentLevel.load(std::memory_order_relaxed);
+	}
+
+	struct CachedLevel
+	{
+		uint64_t generation;
+		LogLevel level;
+	};
+
+	// Names are literals: the cache is keyed by the pointer and resolved
+	// again under the registry lock only when the levels are changed
+	thread_local unordered_map<const char*, CachedLevel> cache;
+
+	auto generation = sLevelGeneration.load(std::memory_order_acquire);
+	auto& cached = cache[name];
+
+	if (cached.generation == generation)
+	{
+		return cached.level;
+	}
+
+	auto& registry = getLogRegistry();
+
+	lock_guard<mutex> lock(registry.mtx);
+
+	auto module = registry.moduleLevels.find(string(name, strcspn(name, "(")));
+
+	cached.generation = generation;
+	cached.level = module != registry.moduleLevels.end() ? module->second :
+				   sCurrentLevel.load();
+
+	return cached.level;
+}
+
+bool Log::parseLevel(const string& strLevel, LogLevel& level, bool& isDefault)
 {
 	static const char* strLevelArray[] =
 	{
@@ -67,11 +288,18 @@ bool Log::setLogLevel(const string& strLevel)
 	transform(strLevelUp.begin(), strLevelUp.end(), strLevelUp.begin(),
 			  (int (*)(int))std::toupper);
 
+	isDefault = strLevelUp == "DEFAULT";
+
+	if (isDefault)
+	{
+		return true;
+	}
+
 	for(auto i = 0; i <= static_cast<int>(LogLevel::logDEBUG); i++)
 	{
 		if (strLevelUp == strLevelArray[i])
 		{
-			sCurrentLevel = static_cast<LogLevel>(i);
+			level = static_cast<LogLevel>(i);
 
 			return true;
 		}
@@ -80,98 +308,424 @@ bool Log::setLogLevel(const string& strLevel)
 	return false;
 }
 
-LogLine::LogLine()
+void Log::registerInstance()
 {
+	auto& registry = getLogRegistry();
+
+	lock_guard<mutex> lock(registry.mtx);
 
+	registry.instances.insert(this);
+
+	updateLevel();
 }
 
-LogLine::~LogLine()
+void Log::updateLevel()
 {
-	if (mCurrentLevel <= mSetLevel && mSetLevel > LogLevel::logDISABLE)
+	auto& registry = getLogRegistry();
+
+	// Called with the registry locked
+	auto domain = registry.domainLevels.find(mDomId);
+
+	if (mDomId != cNoDomain && domain != registry.domainLevels.end())
 	{
-		lock_guard<mutex> lock(mMutex);
+		mLevel = domain->second;
+
+		return;
+	}
 
-		mStream << endl;
+	auto module = registry.moduleLevels.find(mModule);
 
-		cout << mStream.str();
-		cout.flush();
+	if (module != registry.moduleLevels.end())
+	{
+		mLevel = module->second;
+
+		return;
 	}
+
+	mLevel = sCurrentLevel.load();
 }
 
-ostringstream& LogLine::get(Log& log, const char* file,
-							int line, LogLevel level)
+/*******************************************************************************
+ * LogRateLimit
+ ******************************************************************************/
+
+LogRateLimit::LogRateLimit(unsigned intervalMs) :
+	mIntervalNs(static_cast<int64_t>(intervalMs) * 1000000),
+	mLast(0),
+	mSuppressed(0)
 {
-	lock_guard<mutex> lock(mMutex);
+}
 
-	mCurrentLevel = level;
-	mSetLevel = log.mLevel;
+bool LogRateLimit::allow()
+{
+	auto now = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+	auto last = mLast.load();
 
-	if (log.mFileAndLine)
+	// 0 - nothing is displayed yet
+	if ((last == 0 || now - last >= mIntervalNs) &&
+		mLast.compare_exchange_strong(last, now))
 	{
-		putHeader(string(file) + " " + to_string(line));
+		return true;
 	}
-	else
+
+	mSuppressed++;
+
+	return false;
+}
+
+ostream& operator<<(ostream& stream, LogRateLimit& limit)
+{
+	if (auto suppressed = limit.takeSuppressed())
+	{
+		stream << "[suppressed " << suppressed << "] ";
+	}
+
+	return stream;
+}
+
+/*******************************************************************************
+ * LogLine
+ ******************************************************************************/
+
+LogLine::RecordBuffer::RecordBuffer(char* buffer, size_t size)
+{
+	setp(buffer, buffer + size);
+}
+
+LogLine::LogLine() :
+	mBuffer(mRecord.message, LogRecord::cMessageSize),
+	mStream(&mBuffer),
+	mEnabled(false)
+{
+
+}
+
+LogLine::~LogLine()
+{
+	if (mEnabled)
 	{
-		putHeader(log.mName);
+		mRecord.length = mBuffer.length();
+
+		LogWriter::write(mRecord);
 	}
+}
+
+ostream& LogLine::get(Log& log, const char* file,
+					  int line, LogLevel level)
+{
+	putHeader(level, log.mLevel, log.mFileAndLine ? nullptr : log.mName.c_str(),
+			  file, line);
+
+	return mStream;
+}
+
+ostream& LogLine::get(const char* name, const char* file,
+					  int line, LogLevel level)
+{
+	putHeader(level, Log::getLevel(name), name, file, line);
 
 	return mStream;
 }
 
-ostringstream& LogLine::get(const char* name, const char* file,
-							int line, LogLevel level)
+void LogLine::putHeader(LogLevel level, LogLevel setLevel, const char* name,
+						const char* file, int line)
 {
-	mCurrentLevel = level;
-	mSetLevel = Log::sCurrentLevel;
+	mEnabled = level <= setLevel && setLevel > LogLevel::logDISABLE;
+
+	if (!mEnabled)
+	{
+		// The inserters do nothing on the failed stream
+		mStream.setstate(std::ios_base::badbit);
+
+		return;
+	}
+
+	mRecord.time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+	mRecord.level = level;
 
 	if (name)
 	{
-		putHeader(name);
+		snprintf(mRecord.header, LogRecord::cHeaderSize, "%s", name);
 	}
 	else
 	{
-		putHeader(string(file) + " " + to_string(line));
+		snprintf(mRecord.header, LogRecord::cHeaderSize, "%s %d", file, line);
+	}
+}
+
+/*******************************************************************************
+ * LogRing
+ ******************************************************************************/
+
+bool LogRing::push(const LogRecord& record)
+{
+	auto head = mHead.load(std::memory_order_relaxed);
+
+	if (head - mTail.load(std::memory_order_acquire) == cSize)
+	{
+		return false;
 	}
 
-	return mStream;
+	auto& dst = mRecords[head % cSize];
+
+	dst.time = record.time;
+	dst.level = record.level;
+	dst.length = record.length;
+	memcpy(dst.header, record.header, LogRecord::cHeaderSize);
+	memcpy(dst.message, record.message, record.length);
+
+	mHead.store(head + 1, std::memory_order_release);
+
+	return true;
 }
 
+bool LogRing::pop(LogRecord& record)
+{
+	auto tail = mTail.load(std::memory_order_relaxed);
+
+	if (tail == mHead.load(std::memory_order_acquire))
+	{
+		return false;
+	}
+
+	auto& src = mRecords[tail % cSize];
+
+	record.time = src.time;
+	record.level = src.level;
+	record.length = src.length;
+	memcpy(record.header, src.header, LogRecord::cHeaderSize);
+	memcpy(record.message, src.message, src.length);
 
-void LogLine::putHeader(const string& header)
+	mTail.store(tail + 1, std::memory_order_release);
+
+	return true;
+}
+
+/*******************************************************************************
+ * LogFormatter
+ ******************************************************************************/
+
+void LogFormatter::format(const LogRecord& record, string& out)
 {
-	if (mCurrentLevel <= mSetLevel && mSetLevel > LogLevel::logDISABLE)
+	static const char* levels[] = {"", "ERR", "WRN", "INF", "DBG"};
+
+	auto second = record.time / 1000000000;
+
+	// localtime is called once per second
+	if (second != mSecond)
+	{
+		time_t time = second;
+		tm localTime;
+
+		localtime_r(&time, &localTime);
+		strftime(mTime, sizeof(mTime), "%d.%m.%y %X.", &localTime);
+
+		mSecond = second;
+	}
+
+	char ms[4];
+
+	snprintf(ms, sizeof(ms), "%03d", static_cast<int>(record.time / 1000000 % 1000));
+
+	size_t headerLength = strnlen(record.header, LogRecord::cHeaderSize);
+	size_t alignment = sAlignmentLength;
+
+	while(headerLength > alignment &&
+		  !sAlignmentLength.compare_exchange_weak(alignment, headerLength));
+
+	alignment = sAlignmentLength;
+
+	out.append(mTime).append(ms).append(" | ");
+	out.append(record.header, headerLength).append(" ");
+	out.append(alignment - headerLength, ' ').append("| ");
+	out.append(levels[static_cast<int>(record.level)]).append(" - ");
+	out.append(record.message, record.length).append("\n");
+}
+
+/*******************************************************************************
+ * LogWriter
+ ******************************************************************************/
+
+LogWriter::LogWriter() :
+	mTerminate(false)
+{
+	mThread = thread(&LogWriter::writerThread, this);
+
+	sRunning = true;
+}
+
+LogWriter::~LogWriter()
+{
+	// The lines logged from now on are written synchronously
+	sRunning = false;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mTerminate = true;
+	}
+
+	mCondVar.notify_all();
+
+	if (mThread.joinable())
 	{
-		if (header.length() > sAlignmentLength)
+		mThread.join();
+	}
+}
+
+LogWriter& LogWriter::getInstance()
+{
+	static LogWriter writer;
+
+	return writer;
+}
+
+void LogWriter::write(const LogRecord& record)
+{
+	static atomic_bool started(false);
+
+	// The writer is created by the first line and destroyed at exit
+	if (!started.exchange(true))
+	{
+		getInstance();
+	}
+
+	if (!sRunning)
+	{
+		writeSync(record);
+
+		return;
+	}
+
+	auto& ring = getInstance().getRing();
+
+	if (!ring.push(record))
+	{
+		ring.dropped++;
+	}
+}
+
+void LogWriter::writeSync(const LogRecord& record)
+{
+	static LogFormatter formatter;
+
+	lock_guard<mutex> lock(sSyncMutex);
+
+	string out;
+
+	formatter.format(record, out);
+
+	cout.write(out.data(), out.size());
+	cout.flush();
+}
+
+LogRing& LogWriter::getRing()
+{
+	// Marks the ring closed when the thread exits, the writer removes it
+	// after the remaining records are written
+	struct RingHolder
+	{
+		shared_ptr<LogRing> ring;
+
+		~RingHolder()
 		{
-			sAlignmentLength = header.length();
+			if (ring)
+			{
+				ring->closed = true;
+			}
 		}
+	};
+
+	static thread_local RingHolder holder;
+
+	if (!holder.ring)
+	{
+		holder.ring = make_shared<LogRing>();
 
-		mStream << nowTime()
-				<< " | " << header << " "
-				<< string(sAlignmentLength - header.length(), ' ') << "| "
-				<< levelToString(mCurrentLevel) << " - ";
+		lock_guard<mutex> lock(mMutex);
+
+		mRings.push_back(holder.ring);
 	}
+
+	return *holder.ring;
 }
 
-string LogLine::levelToString(LogLevel level)
+void LogWriter::writerThread()
 {
-	static const char* buffer[] = {"", "ERR", "WRN", "INF", "DBG"};
+	unique_lock<mutex> lock(mMutex);
+
+	while(!mTerminate)
+	{
+		mCondVar.wait_for(lock, milliseconds(cFlushIntervalMs));
+
+		lock.unlock();
+
+		flush();
+
+		lock.lock();
+	}
+
+	lock.unlock();
 
-	return buffer[static_cast<int>(level)];
+	flush();
 }
 
-string LogLine::nowTime()
+void LogWriter::flush()
 {
-	auto now = system_clock::now();
-	auto time = system_clock::to_time_t(now);
-	auto ms = duration_cast<milliseconds>(now.time_since_epoch()) % 1000;
+	uint64_t dropped = 0;
+	LogRecord record;
 
-	std::stringstream ss;
+	{
+		lock_guard<mutex> lock(mMutex);
 
-	ss << put_time(localtime(&time), "%d.%m.%y %X.")
-	   << setfill('0') << setw(3) << ms.count();
+		for (auto it = mRings.begin(); it != mRings.end();)
+		{
+			auto& ring = **it;
+			bool closed = ring.closed;
+
+			while(ring.pop(record))
+			{
+				mBatch.push_back(record);
+			}
+
+			dropped += ring.dropped.exchange(0);
+
+			if (closed)
+			{
+				it = mRings.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+
+	if (mBatch.empty() && !dropped)
+	{
+		return;
+	}
+
+	// Merge the threads records by time
+	stable_sort(mBatch.begin(), mBatch.end(),
+				[](const LogRecord& a, const LogRecord& b) { return a.time < b.time; });
+
+	mOutput.clear();
+
+	for (auto& batchRecord : mBatch)
+	{
+		mFormatter.format(batchRecord, mOutput);
+	}
+
+	mBatch.clear();
+
+	if (dropped)
+	{
+		mOutput.append("Log records dropped: ").append(to_string(dropped)).append("\n");
+	}
 
-	return ss.str();
+	cout.write(mOutput.data(), mOutput.size());
+	cout.flush();
 }
 
 }
@@ -22,23 +22,39 @@
 #define SRC_XEN_LOG_HPP_
 
 #include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
+#include <memory>
 #include <mutex>
-#include <sstream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
 
 /***************************************************************************//**
  * @defgroup Log
  * Backend log.
  * Special macros are designed to show logs: LOG() and DLOG().
  * DLOG is compiled to void in release build (NDEBUG is defined) and can be used
- * in time critical path. These macros returns a string stream object thus basic
+ * in time critical path. The level is checked before the log line is created,
+ * so the arguments of a filtered LOG are not evaluated. The levels above
+ * LOG_MIN_LEVEL (DISABLE, ERROR, WARNING, INFO, DEBUG) are removed at compile
+ * time. These macros returns a string stream object thus basic
  * c++ iostream operators can be used.
+ * The log lines are written asynchronously: LOG() puts a fixed size record
+ * into the ring of the calling thread and the writer thread outputs the
+ * records in batches. A line longer than the record is truncated. If the ring
+ * is full, the record is dropped and the number of dropped records is shown
+ * in the log later.
  * The macros take two parameters: first one could be
  * either instance of XenBackend::Log or string, second one is
  * XenBackend::LogLevel (for macro use DISABLE, ERROR, WARNING, INFO, DEBUG).
  * In case of XenBackend::Log instance all log parameters are kept inside
  * the instance. If the string is passed then it will be displayed as module
- * name. If <i>nullptr</i> is passed instead of string then the source file
+ * name, the string should be a literal: its level is cached by the pointer.
+ * If <i>nullptr</i> is passed instead of string then the source file
  * name and line number will be displayed in the log.
  *
  * Log with string module name:
@@ -70,11 +86,34 @@
  * 07.11.16 16:46:54.029 | MyModule | DBG - This is debug log
  * @endcode
  *
+ * The level of a XenBackend::Log instance can be set per module and per
+ * domain at runtime, see Log::setLogLevel(). Repeated messages can be rate
+ * limited by LOG_LIMIT():
+ * @code
+ * XenBackend::LogRateLimit xrunLimit(1000);
+ *
+ * LOG_LIMIT(myLog, WARNING, xrunLimit) << "Xrun";
+ *
+ * output:
+ *
+ * 07.11.16 16:46:54.029 | MyModule | WRN - Xrun
+ * 07.11.16 16:46:55.031 | MyModule | WRN - [suppressed 12] Xrun
+ * @endcode
+ *
  ******************************************************************************/
 
 #define __FILENAME__ (strrchr(__FILE__, '/') ? \
 					  strrchr(__FILE__, '/') + 1 : __FILE__)
 
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL DEBUG
+#endif
+
+/// @cond HIDDEN_SYMBOLS
+#define LOG_LEVEL(level) LOG_LEVEL_VALUE(level)
+#define LOG_LEVEL_VALUE(level) XenBackend::LogLevel::log ## level
+/// @endcond
+
 /**
  * @def LOG(instance, level)
  * Displays log with defined level.
@@ -84,8 +123,28 @@
  * @ingroup Log
  */
 #define LOG(instance, level) \
-	XenBackend::LogLine().get(instance, __FILENAME__, __LINE__, \
-							  XenBackend::LogLevel::log ## level)
+	(LOG_LEVEL(level) > LOG_LEVEL(LOG_MIN_LEVEL) || \
+	 !XenBackend::LogLine::isEnabled(instance, LOG_LEVEL(level))) ? (void) 0 : \
+	XenBackend::LogVoid() & \
+	XenBackend::LogLine().get(instance, __FILENAME__, __LINE__, LOG_LEVEL(level))
+
+/**
+ * @def LOG_LIMIT(instance, level, limit)
+ * Displays log with defined level not more often than the limit allows.
+ * The number of suppressed lines is shown in the next displayed line.
+ * @param[in] instance log instance (XenBackend::Log) or <i>const char*</i> or
+ *                         <i>nullptr</i>
+ * @param[in] level    log level
+ * @param[in] limit    rate limit (XenBackend::LogRateLimit)
+ * @ingroup Log
+ */
+#define LOG_LIMIT(instance, level, limit) \
+	(LOG_LEVEL(level) > LOG_LEVEL(LOG_MIN_LEVEL) || \
+	 !XenBackend::LogLine::isEnabled(instance, LOG_LEVEL(level)) || \
+	 !(limit).allow()) ? (void) 0 : \
+	XenBackend::LogVoid() & \
+	XenBackend::LogLine().get(instance, __FILENAME__, __LINE__, LOG_LEVEL(level)) \
+	<< (limit)
 
 /**
  * @def DLOG(instance, level)
@@ -103,7 +162,7 @@
 #else
 
 #define DLOG(instance, level) \
-	true ? (void) 0 : XenBackend::LogVoid() & LOG(instance, level)
+	true ? (void) 0 : LOG(instance, level)
 
 #endif
 
@@ -125,42 +184,138 @@ public:
 	LogVoid() { }
 	void operator&(std::ostream&) { }
 };
+
+struct LogRecord
+{
+	static const size_t cHeaderSize = 64;
+	static const size_t cMessageSize = 256;
+
+	int64_t time;
+	LogLevel level;
+	size_t length;
+	char header[cHeaderSize];
+	char message[cMessageSize];
+};
+
+// Single producer single consumer ring of records
+class LogRing
+{
+public:
+	static const size_t cSize = 128;
+
+	LogRing() : dropped(0), closed(false), mHead(0), mTail(0) {}
+
+	bool push(const LogRecord& record);
+	bool pop(LogRecord& record);
+
+	std::atomic<uint64_t> dropped;
+	std::atomic_bool closed;
+
+private:
+	LogRecord mRecords[cSize];
+	std::atomic<size_t> mHead;
+	std::atomic<size_t> mTail;
+};
+
+class LogFormatter
+{
+public:
+	LogFormatter() : mSecond(-1) {}
+
+	void format(const LogRecord& record, std::string& out);
+
+private:
+	static std::atomic<size_t> sAlignmentLength;
+
+	int64_t mSecond;
+	char mTime[32];
+};
+
+class LogWriter
+{
+public:
+	~LogWriter();
+
+	static void write(const LogRecord& record);
+
+private:
+	static const int cFlushIntervalMs = 10;
+
+	static std::atomic_bool sRunning;
+	static std::mutex sSyncMutex;
+
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::vector<std::shared_ptr<LogRing>> mRings;
+	std::thread mThread;
+	bool mTerminate;
+
+	LogFormatter mFormatter;
+	std::vector<LogRecord> mBatch;
+	std::string mOutput;
+
+	LogWriter();
+
+	static LogWriter& getInstance();
+	static void writeSync(const LogRecord& record);
+
+	LogRing& getRing();
+	void writerThread();
+	void flush();
+};
 /// @endcond
 
 
 /***************************************************************************//**
  * Log instance.
+ * The instance level is the level of its domain if set, otherwise the level
+ * of its module if set, otherwise the global level. The levels are applied to
+ * all existing instances at once. Logs by a module name string use the level
+ * of the module if set, otherwise the global level.
  * @ingroup Log
  ******************************************************************************/
 class Log
 {
 public:
 	/**
-	 * @param[in] name        module name which will be displayed in the log
-	 * @param[in] level       log level for this module
+	 * Instance which is not bound to a domain
+	 */
+	static const int cNoDomain = -1;
+
+	/**
+	 * @param[in] name        module name which will be displayed in the log,
+	 *                        the part before '(' is used to set the level
+	 * @param[in] domId       domain id to set the level per domain
 	 * @param[in] fileAndLine displays source file name and line number instead
 	 *                        of module name
 	 */
-	Log(const std::string& name, LogLevel level = sCurrentLevel,
-		bool fileAndLine = sShowFileAndLine) :
-		mName(name),  mLevel(level), mFileAndLine(fileAndLine) {}
+	Log(const std::string& name, int domId = cNoDomain,
+		bool fileAndLine = sShowFileAndLine);
+	Log(const Log& log);
+	Log& operator=(const Log& log) = delete;
+	~Log();
 
 	/**
-	 * Sets log level
+	 * Sets global log level
 	 * @param[in] level log level
 	 */
-	static void setLogLevel(LogLevel level) { sCurrentLevel = level; }
+	static void setLogLevel(LogLevel level);
 
 	/**
-	 * Sets log level
-	 * @param[in] strLevel string log level (<i>"disable", "error",
-	 * "warning", "info", "debug</i>)
-	 * @return <i>true</i> if log level is set successfully
+	 * Sets log levels
+	 * @param[in] config comma separated list of levels:
+	 *                   <level> - global level;
+	 *                   <module>=<level> - module level;
+	 *                   dom<id>=<level> - domain level.
+	 *                   Level is <i>"disable", "error", "warning", "info",
+	 *                   "debug"</i> or <i>"default"</i> to use the global
+	 *                   level for the module or domain.
+	 * @return <i>true</i> if log levels are set successfully
 	 */
-	static bool setLogLevel(const std::string& strLevel);
+	static bool setLogLevel(const std::string& config);
 
 	/**
-	 * Gets current log level
+	 * Gets global log level
 	 * @return current log level
 	 */
 	static LogLevel getLogLevel() { return sCurrentLevel; }
@@ -182,18 +337,68 @@ public:
 	 */
 	static bool getShowFileAndLine() { return sShowFileAndLine; }
 
+	/**
+	 * Binds the instance to the domain, used when the object serves another
+	 * domain during its life time
+	 * @param[in] domId domain id or cNoDomain
+	 */
+	void setDomain(int domId);
+
 private:
 
 	friend class LogLine;
 
 	static std::atomic<LogLevel> sCurrentLevel;
 	static std::atomic_bool sShowFileAndLine;
+	static std::atomic_bool sModuleLevelsSet;
+	static std::atomic<uint64_t> sLevelGeneration;
 
 	std::string mName;
-	LogLevel mLevel;
+	std::string mModule;
+	int mDomId;
+	std::atomic<LogLevel> mLevel;
 	bool mFileAndLine;
+
+	static bool parseLevel(const std::string& strLevel, LogLevel& level,
+						   bool& isDefault);
+	static LogLevel getLevel(const char* name);
+	void registerInstance();
+	void updateLevel();
+};
+
+/***************************************************************************//**
+ * Limits the rate of a repeated log line.
+ * @ingroup Log
+ ******************************************************************************/
+class LogRateLimit
+{
+public:
+	/**
+	 * @param[in] intervalMs minimal interval between the displayed lines
+	 */
+	explicit LogRateLimit(unsigned intervalMs);
+
+	/**
+	 * Returns <i>true</i> if the line can be displayed, otherwise counts the
+	 * line as suppressed
+	 */
+	bool allow();
+
+	/**
+	 * Returns and clears number of suppressed lines
+	 */
+	uint64_t takeSuppressed() { return mSuppressed.exchange(0); }
+
+private:
+	int64_t mIntervalNs;
+	std::atomic<int64_t> mLast;
+	std::atomic<uint64_t> mSuppressed;
 };
 
+/// @cond HIDDEN_SYMBOLS
+std::ostream& operator<<(std::ostream& stream, LogRateLimit& limit);
+/// @endcond
+
 /// @cond HIDDEN_SYMBOLS
 class LogLine
 {
@@ -201,23 +406,46 @@ public:
 	LogLine();
 	virtual ~LogLine();
 
-	std::ostringstream& get(Log& log, const char* file, int line,
-							LogLevel level = LogLevel::logDEBUG);
-	std::ostringstream& get(const char* name, const char* file, int line,
-							LogLevel level = LogLevel::logDEBUG);
+	static bool isEnabled(const Log& log, LogLevel level)
+	{
+		LogLevel setLevel = log.mLevel.load(std::memory_order_relaxed);
+
+		return level <= setLevel && setLevel > LogLevel::logDISABLE;
+	}
+
+	static bool isEnabled(const char* name, LogLevel level)
+	{
+		LogLevel setLevel = Log::getLevel(name);
+
+		return level <= setLevel && setLevel > LogLevel::logDISABLE;
+	}
+
+	std::ostream& get(Log& log, const char* file, int line,
+					  LogLevel level = LogLevel::logDEBUG);
+	std::ostream& get(const char* name, const char* file, int line,
+					  LogLevel level = LogLevel::logDEBUG);
 
 private:
-	static size_t sAlignmentLength;
+	// Writes the message into the record, the rest is truncated
+	class RecordBuffer : public std::streambuf
+	{
+	public:
+		RecordBuffer(char* buffer, size_t size);
 
-	std::ostringstream mStream;
-	LogLevel mCurrentLevel;
-	LogLevel mSetLevel;
+		size_t length() const { return pptr() - pbase(); }
 
-	std::mutex mMutex;
+	protected:
+		int_type overflow(int_type c) { return traits_type::not_eof(c); }
+
+	};
+
+	LogRecord mRecord;
+	RecordBuffer mBuffer;
+	std::ostream mStream;
+	bool mEnabled;
 
-	void putHeader(const std::string& header);
-	std::string nowTime();
-	std::string levelToString(LogLevel level);
+	void putHeader(LogLevel level, LogLevel setLevel, const char* name,
+				   const char* file, int line);
 };
 /// @endcond
 
@@ -0,0 +1,222 @@
+/*
+ *  Runtime log level control
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "LogControl.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string;
+using std::thread;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * LogControl
+ ******************************************************************************/
+
+LogControl::LogControl(const string& path) :
+	mPath(path),
+	mCreated(false),
+	mFd(-1),
+	mLog("LogControl")
+{
+	struct stat info;
+
+	if (mkfifo(mPath.c_str(), 0600) == 0)
+	{
+		mCreated = true;
+	}
+	else if (errno != EEXIST)
+	{
+		throw LogControlException("Can't create log control pipe: " + mPath +
+								  ", error: " + strerror(errno));
+	}
+	// The existing path is used only if it is a named pipe
+	else if (stat(mPath.c_str(), &info) < 0 || !S_ISFIFO(info.st_mode))
+	{
+		throw LogControlException("Log control path is not a named pipe: " + mPath);
+	}
+
+	// Opened for writing too, so the pipe never reports hang up when the
+	// last writer closes it
+	mFd = open(mPath.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+	if (mFd < 0)
+	{
+		string error = strerror(errno);
+
+		release();
+
+		throw LogControlException("Can't open log control pipe: " + mPath +
+								  ", error: " + error);
+	}
+
+	// The path may be replaced between the checks above and open()
+	if (fstat(mFd, &info) < 0 || !S_ISFIFO(info.st_mode))
+	{
+		release();
+
+		throw LogControlException("Log control path is not a named pipe: " + mPath);
+	}
+
+	LOG(mLog, DEBUG) << "Create log control: " << mPath;
+
+	mThread = thread(&LogControl::controlThread, this);
+}
+
+LogControl::~LogControl()
+{
+	mTerminate.signal();
+
+	if (mThread.joinable())
+	{
+		mThread.join();
+	}
+
+	release();
+
+	LOG(mLog, DEBUG) << "Delete log control: " << mPath;
+}
+
+void LogControl::release()
+{
+	if (mFd >= 0)
+	{
+		close(mFd);
+	}
+
+	mFd = -1;
+
+	// Only the pipe created by this process is removed
+	if (mCreated)
+	{
+		unlink(mPath.c_str());
+	}
+
+	mCreated = false;
+}
+
+void LogControl::controlThread()
+{
+	try
+	{
+		while(true)
+		{
+			pollfd fds[] = {{ .fd = mFd, .events = POLLIN, .revents = 0 },
+							{ .fd = mTerminate.getFd(), .events = POLLIN, .revents = 0 }};
+
+			if (poll(fds, 2, -1) < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				throw LogControlException("Can't poll log control pipe: " +
+										  string(strerror(errno)));
+			}
+
+			if (fds[1].revents)
+			{
+				break;
+			}
+
+			if (fds[0].revents && !readLines())
+			{
+				break;
+			}
+		}
+	}
+	catch(const std::exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
+bool LogControl::readLines()
+{
+	char buffer[256];
+
+	while(true)
+	{
+		auto size = read(mFd, buffer, sizeof(buffer));
+
+		if (size < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+			{
+				return true;
+			}
+
+			throw LogControlException("Can't read log control pipe: " +
+									  string(strerror(errno)));
+		}
+
+		if (size == 0)
+		{
+			return false;
+		}
+
+		for (ssize_t i = 0; i < size; i++)
+		{
+			if (buffer[i] == '\n')
+			{
+				applyLine();
+			}
+			else if (mLine.size() < cMaxLineSize)
+			{
+				mLine += buffer[i];
+			}
+		}
+	}
+}
+
+void LogControl::applyLine()
+{
+	string line;
+
+	line.swap(mLine);
+
+	auto end = line.find_last_not_of(" \t\r");
+
+	line.erase(end == string::npos ? 0 : end + 1);
+
+	if (line.empty())
+	{
+		return;
+	}
+
+	if (Log::setLogLevel(line))
+	{
+		LOG(mLog, INFO) << "Log level set: " << line;
+	}
+	else
+	{
+		LOG(mLog, ERROR) << "Invalid log level: " << line;
+	}
+}
+
+}
@@ -0,0 +1,82 @@
+/*
+ *  Runtime log level control
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_XEN_LOGCONTROL_HPP_
+#define SRC_XEN_LOGCONTROL_HPP_
+
+#include <string>
+#include <thread>
+
+#include "EventFd.hpp"
+#include "Log.hpp"
+#include "XenException.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by LogControl
+ * @ingroup Log
+ ******************************************************************************/
+class LogControlException : public XenException
+{
+	using XenException::XenException;
+};
+
+/***************************************************************************//**
+ * Changes log levels at runtime.
+ * Creates a named pipe and applies each line written to it as a log level
+ * configuration, see Log::setLogLevel(const std::string&). An existing
+ * named pipe is reused and kept on exit, other files are refused. For example:
+ * @code
+ * echo "warning,CommandHandler=debug,dom3=debug" > /run/snd_be.log
+ * @endcode
+ * @ingroup Log
+ ******************************************************************************/
+class LogControl
+{
+public:
+	/**
+	 * @param[in] path path to the control pipe
+	 */
+	explicit LogControl(const std::string& path);
+	LogControl(const LogControl&) = delete;
+	LogControl& operator=(LogControl const&) = delete;
+	~LogControl();
+
+private:
+	const size_t cMaxLineSize = 1024;
+
+	std::string mPath;
+	bool mCreated;
+	int mFd;
+	EventFd mTerminate;
+	std::string mLine;
+	std::thread mThread;
+	Log mLog;
+
+	void release();
+	void controlThread();
+	bool readLines();
+	void applyLine();
+};
+
+}
+
+#endif /* SRC_XEN_LOGCONTROL_HPP_ */
@@ -21,7 +21,11 @@
 #ifndef INCLUDE_RINGBUFFERBASE_HPP_
 #define INCLUDE_RINGBUFFERBASE_HPP_
 
+#include <condition_variable>
+#include <cstdint>
 #include <functional>
+#include <mutex>
+#include <set>
 
 extern "C" {
 #include "xenctrl.h"
@@ -66,6 +70,12 @@ public:
 	 * @param[in] cbk <i>std::function</i> callback
 	 */
 	virtual void setNotifyEventChannelCbk(NotifyEventCallback cbk) = 0;
+
+	/**
+	 * Checks if the frontend has produced not consumed requests. Used to
+	 * busy poll the ring without waiting for the event channel.
+	 */
+	virtual bool isRequestPending() const { return false; }
 };
 
 /***************************************************************************//**
@@ -106,13 +116,79 @@ public:
 	 * @param[in] pageSize ring buffer page size
 	 */
 	RingBufferBase(int domId, int ref, int pageSize = 4096) :
-		mBuffer(domId, ref, PROT_READ | PROT_WRITE)
+		mBuffer(domId, ref, PROT_READ | PROT_WRITE),
+		mBatchResponses(false),
+		mInBatch(false),
+		mNumPending(0),
+		mNumBatches(0),
+		mNumBatchedResponses(0),
+		mMaxBatchSize(0),
+		mSavedPushes(0),
+		mNextToken(0)
 	{
 		BACK_RING_INIT(&mRing, static_cast<SRing*>(mBuffer.get()), pageSize);
 	}
 
+	/**
+	 * Creates the ring buffer on several pages mapped contiguously.
+	 * @param[in] domId frontend domain id
+	 * @param[in] refs  ring buffer page refs
+	 * @param[in] count number of refs
+	 */
+	RingBufferBase(int domId, const uint32_t* refs, size_t count) :
+		mBuffer(domId, refs, count, PROT_READ | PROT_WRITE),
+		mBatchResponses(false),
+		mInBatch(false),
+		mNumPending(0),
+		mNumBatches(0),
+		mNumBatchedResponses(0),
+		mMaxBatchSize(0),
+		mSavedPushes(0),
+		mNextToken(0)
+	{
+		BACK_RING_INIT(&mRing, static_cast<SRing*>(mBuffer.get()), mBuffer.size());
+	}
+
+	/**
+	 * Returns number of request slots in the ring
+	 */
+	unsigned getRingSize() const { return RING_SIZE(&mRing); }
+
+	/**
+	 * Enables batched responses: the responses sent while the received
+	 * requests are processed are pushed to the frontend once after the last
+	 * request, with one notification at most.
+	 * @param[in] batch enable batching
+	 */
+	void setBatchResponses(bool batch) { mBatchResponses = batch; }
+
+	/**
+	 * Returns number of pushed batches
+	 */
+	uint64_t getNumBatches() const { return mNumBatches; }
+
+	/**
+	 * Returns number of responses pushed in batches
+	 */
+	uint64_t getNumBatchedResponses() const { return mNumBatchedResponses; }
+
+	/**
+	 * Returns the largest pushed batch
+	 */
+	uint64_t getMaxBatchSize() const { return mMaxBatchSize; }
+
+	/**
+	 * Returns number of pushes and possible notifications saved by batching
+	 */
+	uint64_t getSavedPushes() const { return mSavedPushes; }
+
 protected:
 
+	/**
+	 * Identifies the request whose response is deferred
+	 */
+	typedef uint64_t CompletionToken;
+
 	/**
 	 * Processes frontend requests.
 	 * This function is called when the request from the frontend is received
@@ -122,18 +198,29 @@ protected:
 	virtual void processRequest(const Req& req) = 0;
 
 	/**
-	 * Sends the response to the frontend
+	 * Sends the response to the frontend. May be called from any thread.
 	 * @param rsp[in] response
 	 */
 	void sendResponse(const Rsp& rsp)
 	{
 		bool notify = false;
 
-		*RING_GET_RESPONSE(&mRing, mRing.rsp_prod_pvt) = rsp;
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+
+			*RING_GET_RESPONSE(&mRing, mRing.rsp_prod_pvt) = rsp;
 
-		mRing.rsp_prod_pvt++;
+			mRing.rsp_prod_pvt++;
 
-		RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&mRing, notify);
+			if (mInBatch)
+			{
+				mNumPending++;
+
+				return;
+			}
+
+			RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&mRing, notify);
+		}
 
 		if (notify)
 		{
@@ -141,16 +228,148 @@ protected:
 		}
 	}
 
+	/**
+	 * Defers the response of the request being processed.
+	 * processRequest() may return without the response, the request is
+	 * completed later by complete() from any thread. Requests may be completed
+	 * in any order: the response should echo the request id.
+	 * @return completion token
+	 */
+	CompletionToken deferResponse()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		auto token = mNextToken++;
+
+		mDeferred.insert(token);
+
+		return token;
+	}
+
+	/**
+	 * Sends the response of the deferred request. May be called from any
+	 * thread.
+	 * @param token[in] completion token returned by deferResponse()
+	 * @param rsp[in]   response
+	 */
+	void complete(CompletionToken token, const Rsp& rsp)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+
+			if (!mDeferred.erase(token))
+			{
+				throw RingBufferException("Unknown completion token");
+			}
+		}
+
+		sendResponse(rsp);
+
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mCondVar.notify_all();
+	}
+
+	/**
+	 * Waits until all deferred requests are completed. Should be called by
+	 * the derived class destructor if it completes requests from other
+	 * threads.
+	 */
+	void waitDeferred()
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+
+		mCondVar.wait(lock, [this] { return mDeferred.empty(); });
+	}
+
 private:
 	Ring mRing;
 	XenGnttabBuffer mBuffer;
 	NotifyEventCallback mNotifyEventChannelCbk;
 
+	bool mBatchResponses;
+	bool mInBatch;
+	uint64_t mNumPending;
+	uint64_t mNumBatches;
+	uint64_t mNumBatchedResponses;
+	uint64_t mMaxBatchSize;
+	uint64_t mSavedPushes;
+
+	// Protects the response production and the deferred requests
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::set<CompletionToken> mDeferred;
+	CompletionToken mNextToken;
+
+	void startBatch()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		mInBatch = mBatchResponses;
+	}
+
+	void pushBatch()
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+
+		mInBatch = false;
+
+		if (mNumPending == 0)
+		{
+			return;
+		}
+
+		bool notify = false;
+
+		RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&mRing, notify);
+
+		mNumBatches++;
+		mNumBatchedResponses += mNumPending;
+		mMaxBatchSize = mNumPending > mMaxBatchSize ? mNumPending : mMaxBatchSize;
+		mSavedPushes += mNumPending - 1;
+		mNumPending = 0;
+
+		lock.unlock();
+
+		if (notify)
+		{
+			mNotifyEventChannelCbk();
+		}
+	}
+
+	// The checks read the response producer which may be changed by complete()
+
+	bool isProdOverflow(RING_IDX rp)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		return RING_REQUEST_PROD_OVERFLOW(&mRing, rp);
+	}
+
+	bool isConsOverflow(RING_IDX rc)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		return RING_REQUEST_CONS_OVERFLOW(&mRing, rc);
+	}
+
+	void finalCheck(int& numPendingRequests)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		RING_FINAL_CHECK_FOR_REQUESTS(&mRing, numPendingRequests);
+	}
+
 	void setNotifyEventChannelCbk(NotifyEventCallback cbk)
 	{
 		mNotifyEventChannelCbk = cbk;
 	}
 
+	bool isRequestPending() const
+	{
+		return *static_cast<volatile RING_IDX*>(&mRing.sring->req_prod) != mRing.req_cons;
+	}
+
 	void onRequestReceived()
 	{
 		int numPendingRequests = 0;
@@ -163,28 +382,43 @@ private:
 
 			xen_rmb();
 
-			if (RING_REQUEST_PROD_OVERFLOW(&mRing, rp))
+			if (isProdOverflow(rp))
 			{
 				throw RingBufferException("Ring buffer producer overflow");
 			}
 
-			while (rc != rp) {
+			startBatch();
 
-				if (RING_REQUEST_CONS_OVERFLOW(&mRing, rc))
-				{
-					throw RingBufferException("Ring buffer consumer overflow");
-				}
+			try
+			{
+				while (rc != rp) {
 
-				req = *RING_GET_REQUEST(&mRing, rc);
+					if (isConsOverflow(rc))
+					{
+						throw RingBufferException("Ring buffer consumer overflow");
+					}
 
-				mRing.req_cons = ++rc;
+					req = *RING_GET_REQUEST(&mRing, rc);
 
-				xen_mb();
+					mRing.req_cons = ++rc;
 
-				processRequest(req);
+					xen_mb();
+
+					processRequest(req);
+				}
+			}
+			catch(...)
+			{
+				pushBatch();
+
+				throw;
 			}
 
-			RING_FINAL_CHECK_FOR_REQUESTS(&mRing, numPendingRequests);
+			// Push before the final check: the frontend may wait for the
+			// responses to send next requests
+			pushBatch();
+
+			finalCheck(numPendingRequests);
 
 		} while (numPendingRequests);
 	}
@@ -0,0 +1,284 @@
+/*
+ *  Thread scheduling policy
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "ThreadPolicy.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Log.hpp"
+
+using std::stoi;
+using std::string;
+using std::vector;
+
+namespace XenBackend {
+
+ThreadPolicy::Policy ThreadPolicy::sPolicies[] =
+{
+	{ SCHED_OTHER, 0, {} },
+	{ SCHED_OTHER, 0, {} },
+	{ SCHED_OTHER, 0, {} }
+};
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool ThreadPolicy::setPolicy(const string& config)
+{
+	// <group>:<sched>[:<priority>][@<cpus>]
+	auto cpusSep = config.find('@');
+	auto sched = config.substr(0, cpusSep);
+	auto groupSep = sched.find(':');
+
+	if (groupSep == string::npos)
+	{
+		return false;
+	}
+
+	Group group;
+	auto groupName = sched.substr(0, groupSep);
+
+	if (groupName == "ring")
+	{
+		group = Group::RING;
+	}
+	else if (groupName == "device")
+	{
+		group = Group::DEVICE;
+	}
+	else if (groupName == "control")
+	{
+		group = Group::CONTROL;
+	}
+	else
+	{
+		return false;
+	}
+
+	Policy policy { SCHED_OTHER, 0, {} };
+
+	auto prioSep = sched.find(':', groupSep + 1);
+	auto policyName = sched.substr(groupSep + 1, prioSep - groupSep - 1);
+
+	if (policyName == "fifo")
+	{
+		policy.policy = SCHED_FIFO;
+	}
+	else if (policyName == "rr")
+	{
+		policy.policy = SCHED_RR;
+	}
+	else if (policyName != "other")
+	{
+		return false;
+	}
+
+	if (prioSep != string::npos)
+	{
+		policy.priority = stoi(sched.substr(prioSep + 1));
+	}
+	else
+	{
+		policy.priority = sched_get_priority_min(policy.policy);
+	}
+
+	if (policy.priority < sched_get_priority_min(policy.policy) ||
+		policy.priority > sched_get_priority_max(policy.policy))
+	{
+		LOG("ThreadPolicy", ERROR) << "Priority " << policy.priority
+								   << " is out of range for " << policyName;
+
+		return false;
+	}
+
+	if (cpusSep != string::npos &&
+		!parseCpus(config.substr(cpusSep + 1), policy.cpus))
+	{
+		return false;
+	}
+
+	sPolicies[static_cast<int>(group)] = policy;
+
+	return true;
+}
+
+void ThreadPolicy::apply(Group group, bool affinity)
+{
+	auto& policy = sPolicies[static_cast<int>(group)];
+
+	if (policy.policy != SCHED_OTHER)
+	{
+		sched_param param {};
+
+		param.sched_priority = policy.priority;
+
+		if (auto ret = pthread_setschedparam(pthread_self(), policy.policy, &param))
+		{
+			LOG("ThreadPolicy", WARNING) << "Can't set " << getGroupName(group)
+										 << " thread priority " << policy.priority
+										 << ": " << strerror(ret);
+		}
+	}
+
+	if (affinity && !policy.cpus.empty())
+	{
+		cpu_set_t cpuSet;
+
+		CPU_ZERO(&cpuSet);
+
+		for (auto cpu : policy.cpus)
+		{
+			CPU_SET(cpu, &cpuSet);
+		}
+
+		if (auto ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet))
+		{
+			LOG("ThreadPolicy", WARNING) << "Can't set " << getGroupName(group)
+										 << " thread affinity: " << strerror(ret);
+		}
+	}
+}
+
+const vector<int>& ThreadPolicy::getCpus(Group group)
+{
+	return sPolicies[static_cast<int>(group)].cpus;
+}
+
+bool ThreadPolicy::lockMemory(size_t heapSize)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+	{
+		LOG("ThreadPolicy", ERROR) << "Can't lock memory: " << strerror(errno);
+
+		return false;
+	}
+
+	// Keep the freed heap in the process instead of returning it to the system
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	prefaultStack();
+
+	if (heapSize)
+	{
+		auto heap = static_cast<char*>(malloc(heapSize));
+
+		if (!heap)
+		{
+			LOG("ThreadPolicy", ERROR) << "Can't pre-fault heap: " << heapSize;
+
+			return false;
+		}
+
+		for (size_t i = 0; i < heapSize; i += sysconf(_SC_PAGESIZE))
+		{
+			heap[i] = 0;
+		}
+
+		free(heap);
+	}
+
+	LOG("ThreadPolicy", INFO) << "Memory locked, pre-faulted heap: " << heapSize;
+
+	return true;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+const char* ThreadPolicy::getGroupName(Group group)
+{
+	switch(group)
+	{
+	case Group::RING:
+		return "ring";
+
+	case Group::DEVICE:
+		return "device";
+
+	default:
+		return "control";
+	}
+}
+
+bool ThreadPolicy::parseCpus(const string& list, vector<int>& cpus)
+{
+	// 0,2-3
+	size_t pos = 0;
+
+	while(pos < list.size())
+	{
+		auto next = list.find(',', pos);
+		auto item = list.substr(pos, next - pos);
+		auto rangeSep = item.find('-');
+
+		if (item.empty())
+		{
+			return false;
+		}
+
+		int first = stoi(item.substr(0, rangeSep));
+		int last = rangeSep == string::npos ? first : stoi(item.substr(rangeSep + 1));
+
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+		{
+			return false;
+		}
+
+		for (int cpu = first; cpu <= last; cpu++)
+		{
+			cpus.push_back(cpu);
+		}
+
+		if (next == string::npos)
+		{
+			break;
+		}
+
+		pos = next + 1;
+	}
+
+	return !cpus.empty();
+}
+
+void ThreadPolicy::prefaultStack()
+{
+	char stack[cPrefaultStackSize];
+
+	// Written through volatile so the stores are not optimized out
+	volatile char* pages = stack;
+
+	for (size_t i = 0; i < cPrefaultStackSize; i += sysconf(_SC_PAGESIZE))
+	{
+		pages[i] = 0;
+	}
+}
+
+}
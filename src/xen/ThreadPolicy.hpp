@@ -0,0 +1,98 @@
+/*
+ *  Thread scheduling policy
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_XEN_THREADPOLICY_HPP_
+#define SRC_XEN_THREADPOLICY_HPP_
+
+#include <string>
+#include <vector>
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Scheduling class, priority and CPU affinity of the backend threads.
+ * The threads are grouped by role, each thread applies the policy of its
+ * group when started. A policy which can't be applied is reported and the
+ * thread continues with the default scheduling.
+ * @ingroup Xen
+ ******************************************************************************/
+class ThreadPolicy
+{
+public:
+
+	/**
+	 * Thread groups
+	 */
+	enum class Group
+	{
+		RING,    //!< event channel, reactor, worker and pipeline threads
+		DEVICE,  //!< mixer, splitter and async pcm threads
+		CONTROL  //!< XenStore watches threads
+	};
+
+	/**
+	 * Sets the policy of the thread group
+	 * @param[in] config <group>:<other|fifo|rr>[:<priority>][@<cpu list>],
+	 *                   e.g. ring:fifo:40@2-3
+	 * @return <i>false</i> if the config is invalid
+	 */
+	static bool setPolicy(const std::string& config);
+
+	/**
+	 * Applies the group policy to the calling thread
+	 * @param[in] group    thread group
+	 * @param[in] affinity apply the CPU affinity
+	 */
+	static void apply(Group group, bool affinity = true);
+
+	/**
+	 * Returns the CPU list of the group, empty if not set
+	 */
+	static const std::vector<int>& getCpus(Group group);
+
+	/**
+	 * Locks current and future memory and pre-faults the stack and the heap
+	 * to avoid page faults in the audio path
+	 * @param[in] heapSize heap size to pre-fault in bytes
+	 * @return <i>false</i> if the memory can't be locked
+	 */
+	static bool lockMemory(size_t heapSize);
+
+private:
+
+	static const size_t cPrefaultStackSize = 256 * 1024;
+
+	struct Policy
+	{
+		int policy;
+		int priority;
+		std::vector<int> cpus;
+	};
+
+	static Policy sPolicies[];
+
+	static const char* getGroupName(Group group);
+	static bool parseCpus(const std::string& list, std::vector<int>& cpus);
+	static void prefaultStack();
+};
+
+}
+
+#endif /* SRC_XEN_THREADPOLICY_HPP_ */
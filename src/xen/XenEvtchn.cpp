@@ -20,9 +20,17 @@
 
 #include "XenEvtchn.hpp"
 
+#include <chrono>
+
 #include <poll.h>
 
+#include "ThreadPolicy.hpp"
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
 using std::exception;
+using std::function;
 using std::lock_guard;
 using std::mutex;
 using std::thread;
@@ -35,14 +43,25 @@ XenEvtchn::XenEvtchn(int domId, int port, Callback callback,
 	mPort(-1),
 	mCallback(callback),
 	mErrorCallback(errorCallback),
+	mUnbound(false),
 	mTerminate(false),
+	mStopped(false),
+	mBusyPollUs(0),
+	mSpinPeriods(0),
+	mSpinHits(0),
+	mSpinTimeUs(0),
 	mLog("XenEvtchn")
 {
 	try
 	{
 		init(domId, port);
 
-		mThread = thread(&XenEvtchn::eventThread, this);
+		if (!mReactor)
+		{
+			mTerminateEvent.reset(new EventFd());
+
+			mThread = thread(&XenEvtchn::eventThread, this);
+		}
 	}
 	catch(const XenException& e)
 	{
@@ -54,7 +73,7 @@ XenEvtchn::XenEvtchn(int domId, int port, Callback callback,
 
 XenEvtchn::~XenEvtchn()
 {
-	mTerminate = true;
+	stop();
 
 	if (mThread.joinable())
 	{
@@ -64,10 +83,55 @@ XenEvtchn::~XenEvtchn()
 	release();
 }
 
+void XenEvtchn::stop()
+{
+	mTerminate = true;
+
+	if (mTerminateEvent)
+	{
+		mTerminateEvent->signal();
+	}
+
+	// The reactor holds the callbacks until the port is unbound
+	if (mReactor && !mUnbound.exchange(true))
+	{
+		mReactor->unbind(mPort);
+	}
+
+	if (!mStopped.exchange(true) && mSpinPeriods)
+	{
+		LOG(mLog, INFO) << "Busy poll, port: " << mPort << ", periods: " << mSpinPeriods
+						<< ", hits: " << mSpinHits << " ("
+						<< mSpinHits * 100 / mSpinPeriods << "%), spin time: "
+						<< mSpinTimeUs / 1000 << " ms";
+	}
+}
+
+void XenEvtchn::setBusyPoll(unsigned budgetUs, function<bool()> pending)
+{
+	if (mReactor)
+	{
+		LOG(mLog, WARNING) << "Busy poll is not supported by reactor, port: " << mPort;
+
+		return;
+	}
+
+	mPending = pending;
+
+	// Published after the pending function
+	mBusyPollUs = mPending ? budgetUs : 0;
+}
+
 void XenEvtchn::notify()
 {
 	DLOG(mLog, DEBUG) << "Notify event channel, port: " << mPort;
 
+	// The frontend is not served anymore
+	if (mUnbound)
+	{
+		return;
+	}
+
 	if (xenevtchn_notify(mHandle, mPort) < 0)
 	{
 		throw XenEvtchnException("Can't notify event channel");
@@ -76,6 +140,15 @@ void XenEvtchn::notify()
 
 void XenEvtchn::init(int domId, int port)
 {
+	if (XenEvtchnReactor::getNumHandles())
+	{
+		mReactor = XenEvtchnReactor::getInstance();
+
+		mPort = mReactor->bind(domId, port, mCallback, mErrorCallback, mHandle);
+
+		return;
+	}
+
 	mHandle = xenevtchn_open(nullptr, 0);
 
 	if (!mHandle)
@@ -97,6 +170,18 @@ void XenEvtchn::init(int domId, int port)
 
 void XenEvtchn::release()
 {
+	if (mReactor)
+	{
+		if (!mUnbound.exchange(true))
+		{
+			mReactor->unbind(mPort);
+		}
+
+		mReactor.reset();
+
+		return;
+	}
+
 	if (mPort != -1)
 	{
 		xenevtchn_unbind(mHandle, mPort);
@@ -112,6 +197,8 @@ void XenEvtchn::release()
 
 void XenEvtchn::eventThread()
 {
+	ThreadPolicy::apply(ThreadPolicy::Group::RING);
+
 	try
 	{
 		while(!mTerminate)
@@ -119,6 +206,11 @@ void XenEvtchn::eventThread()
 			if (waitEvent() && mCallback)
 			{
 				mCallback();
+
+				if (mBusyPollUs)
+				{
+					busyPoll();
+				}
 			}
 		}
 	}
@@ -135,21 +227,60 @@ void XenEvtchn::eventThread()
 	}
 }
 
-bool XenEvtchn::waitEvent()
+void XenEvtchn::busyPoll()
 {
-	pollfd fds;
+	auto budget = microseconds(mBusyPollUs);
+	auto start = steady_clock::now();
+	auto idleStart = start;
+	bool hit = false;
+
+	while(!mTerminate)
+	{
+		auto now = steady_clock::now();
+
+		if (mPending())
+		{
+			hit = true;
+
+			mCallback();
+
+			idleStart = steady_clock::now();
+
+			continue;
+		}
+
+		if (now - idleStart >= budget)
+		{
+			break;
+		}
 
-	fds.fd = xenevtchn_fd(mHandle);
-	fds.events = POLLIN;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+
+	mSpinPeriods++;
+	mSpinHits += hit ? 1 : 0;
+	mSpinTimeUs += duration_cast<microseconds>(steady_clock::now() - start).count();
+}
 
-	auto ret = poll(&fds, 1, cPoolEventTimeoutMs);
+bool XenEvtchn::waitEvent()
+{
+	pollfd fds[] = {{ .fd = xenevtchn_fd(mHandle), .events = POLLIN, .revents = 0 },
+					{ .fd = mTerminateEvent->getFd(), .events = POLLIN, .revents = 0 }};
 
-	if (ret < 0)
+	if (poll(fds, 2, -1) < 0)
 	{
 		throw XenEvtchnException("Can't poll watches");
 	}
 
-	if (ret > 0)
+	// Terminated, the pending event is not needed anymore
+	if (fds[1].revents)
+	{
+		return false;
+	}
+
+	if (fds[0].revents)
 	{
 		auto port = xenevtchn_pending(mHandle);
 
@@ -22,12 +22,17 @@
 #define SRC_XEN_XENEVTCHN_HPP_
 
 #include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <thread>
 
 extern "C" {
 #include <xenevtchn.h>
 }
 
+#include "EventFd.hpp"
+#include "XenEvtchnReactor.hpp"
 #include "XenException.hpp"
 #include "Log.hpp"
 
@@ -44,6 +49,8 @@ class XenEvtchnException : public XenException
 
 /***************************************************************************//**
  * Implements xen event channel.
+ * The channel has own evtchn handle and thread, or is served by the shared
+ * XenEvtchnReactor if the reactor handles are configured.
  * @ingroup Xen
  ******************************************************************************/
 class XenEvtchn
@@ -75,9 +82,40 @@ public:
 	 */
 	int getPort() const { return mPort; }
 
-private:
+	/**
+	 * Requests the event thread to terminate without waiting for it. Used to
+	 * wake up all channels before joining them one by one. In reactor mode
+	 * unbinds the port: the callbacks are not called after return. The busy
+	 * poll counters are logged on the first call.
+	 */
+	void stop();
 
-	const int cPoolEventTimeoutMs = 100;
+	/**
+	 * Enables busy polling: after the callback the thread spins checking the
+	 * pending function and calls the callback if it returns true. The thread
+	 * waits for the event again when nothing is pending during the budget.
+	 * Not supported by the reactor.
+	 * @param[in] budgetUs idle spin time in us, 0 - disable
+	 * @param[in] pending  returns true if there is work for the callback
+	 */
+	void setBusyPoll(unsigned budgetUs, std::function<bool()> pending);
+
+	/**
+	 * Returns number of busy poll periods
+	 */
+	uint64_t getSpinPeriods() const { return mSpinPeriods; }
+
+	/**
+	 * Returns number of busy poll periods which caught the work
+	 */
+	uint64_t getSpinHits() const { return mSpinHits; }
+
+	/**
+	 * Returns time spent in busy polling in us
+	 */
+	uint64_t getSpinTimeUs() const { return mSpinTimeUs; }
+
+private:
 
 	int mPort;
 
@@ -85,9 +123,19 @@ private:
 	ErrorCallback mErrorCallback;
 
 	xenevtchn_handle *mHandle;
+	std::shared_ptr<XenEvtchnReactor> mReactor;
+	std::atomic_bool mUnbound;
 
 	std::thread mThread;
 	std::atomic_bool mTerminate;
+	std::atomic_bool mStopped;
+	std::unique_ptr<EventFd> mTerminateEvent;
+
+	std::function<bool()> mPending;
+	std::atomic<unsigned> mBusyPollUs;
+	std::atomic<uint64_t> mSpinPeriods;
+	std::atomic<uint64_t> mSpinHits;
+	std::atomic<uint64_t> mSpinTimeUs;
 
 	Log mLog;
 
@@ -95,6 +143,7 @@ private:
 	void release();
 	void eventThread();
 	bool waitEvent();
+	void busyPoll();
 };
 
 }
@@ -0,0 +1,375 @@
+/*
+ *  Xen evtchn reactor
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include "XenEvtchnReactor.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "ThreadPolicy.hpp"
+
+using std::atomic;
+using std::exception;
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+using std::unique_lock;
+using std::string;
+using std::thread;
+using std::vector;
+using std::weak_ptr;
+
+namespace XenBackend {
+
+mutex XenEvtchnReactor::sInstanceMutex;
+weak_ptr<XenEvtchnReactor> XenEvtchnReactor::sInstance;
+atomic<size_t> XenEvtchnReactor::sNumHandles(0);
+
+XenEvtchnReactor::XenEvtchnReactor(size_t numHandles) :
+	mEpollFd(-1),
+	mTerminate(false),
+	mLog("XenEvtchnReactor")
+{
+	try
+	{
+		init(numHandles);
+
+		mThread = thread(&XenEvtchnReactor::reactorThread, this);
+	}
+	catch(const XenException& e)
+	{
+		release();
+
+		throw;
+	}
+
+	LOG(mLog, DEBUG) << "Create reactor, handles: " << mHandles.size();
+}
+
+XenEvtchnReactor::~XenEvtchnReactor()
+{
+	mTerminate = true;
+
+	mWakeup.signal();
+
+	if (mThread.joinable())
+	{
+		mThread.join();
+	}
+
+	release();
+
+	LOG(mLog, DEBUG) << "Delete reactor";
+}
+
+shared_ptr<XenEvtchnReactor> XenEvtchnReactor::getInstance()
+{
+	lock_guard<mutex> lock(sInstanceMutex);
+
+	auto reactor = sInstance.lock();
+
+	if (!reactor)
+	{
+		reactor.reset(new XenEvtchnReactor(sNumHandles));
+
+		sInstance = reactor;
+	}
+
+	return reactor;
+}
+
+int XenEvtchnReactor::bind(int domId, int port, Callback callback,
+						   ErrorCallback errorCallback, xenevtchn_handle*& handle)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (mHandles.empty())
+	{
+		throw XenEvtchnReactorException("No event channel handles");
+	}
+
+	auto least = &mHandles.front();
+
+	for (auto& item : mHandles)
+	{
+		if (item.numPorts < least->numPorts)
+		{
+			least = &item;
+		}
+	}
+
+	int localPort = xenevtchn_bind_interdomain(least->handle, domId, port);
+
+	if (localPort == -1)
+	{
+		throw XenEvtchnReactorException("Can't bind event channel");
+	}
+
+	if (static_cast<size_t>(localPort) >= mChannels.size())
+	{
+		mChannels.resize(localPort + 1, Channel{nullptr, nullptr, nullptr, false, false});
+	}
+
+	mChannels[localPort] = Channel{least->handle, callback, errorCallback, true, false};
+
+	least->numPorts++;
+
+	handle = least->handle;
+
+	DLOG(mLog, DEBUG) << "Bind event channel, dom: " << domId
+					  << ", remote port: " << port << ", local port: "
+					  << localPort;
+
+	return localPort;
+}
+
+void XenEvtchnReactor::unbind(int port)
+{
+	unique_lock<mutex> lock(mMutex);
+
+	if (port < 0 || static_cast<size_t>(port) >= mChannels.size() ||
+		!mChannels[port].handle)
+	{
+		return;
+	}
+
+	// Waits for the callback of this channel if it is running, unless called
+	// from the callback itself
+	if (std::this_thread::get_id() != mThread.get_id())
+	{
+		mCallbackDone.wait(lock, [this, port] { return !mChannels[port].inUse; });
+	}
+
+	auto& channel = mChannels[port];
+
+	xenevtchn_unbind(channel.handle, port);
+
+	for (auto& item : mHandles)
+	{
+		if (item.handle == channel.handle)
+		{
+			item.numPorts--;
+		}
+	}
+
+	channel = Channel{nullptr, nullptr, nullptr, false, false};
+
+	DLOG(mLog, DEBUG) << "Unbind event channel, local port: " << port;
+}
+
+void XenEvtchnReactor::init(size_t numHandles)
+{
+	mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (mEpollFd < 0)
+	{
+		throw XenEvtchnReactorException("Can't create epoll: " +
+										string(strerror(errno)));
+	}
+
+	epoll_event event {};
+
+	// The wakeup fd is marked by the number of handles
+	event.events = EPOLLIN;
+	event.data.u32 = numHandles;
+
+	if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeup.getFd(), &event) < 0)
+	{
+		throw XenEvtchnReactorException("Can't add wakeup fd to epoll");
+	}
+
+	for (size_t i = 0; i < numHandles; i++)
+	{
+		auto handle = xenevtchn_open(nullptr, 0);
+
+		if (!handle)
+		{
+			throw XenEvtchnReactorException("Can't open event channel");
+		}
+
+		mHandles.push_back(Handle{handle, 0});
+
+		event.events = EPOLLIN;
+		event.data.u32 = i;
+
+		if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, xenevtchn_fd(handle), &event) < 0)
+		{
+			throw XenEvtchnReactorException("Can't add event channel to epoll");
+		}
+	}
+}
+
+void XenEvtchnReactor::release()
+{
+	for (size_t port = 0; port < mChannels.size(); port++)
+	{
+		if (mChannels[port].handle)
+		{
+			xenevtchn_unbind(mChannels[port].handle, port);
+		}
+	}
+
+	mChannels.clear();
+
+	for (auto& item : mHandles)
+	{
+		xenevtchn_close(item.handle);
+	}
+
+	mHandles.clear();
+
+	if (mEpollFd >= 0)
+	{
+		close(mEpollFd);
+	}
+
+	mEpollFd = -1;
+}
+
+void XenEvtchnReactor::reactorThread()
+{
+	ThreadPolicy::apply(ThreadPolicy::Group::RING);
+
+	vector<epoll_event> events(mHandles.size() + 1);
+
+	try
+	{
+		while(!mTerminate)
+		{
+			auto ret = epoll_wait(mEpollFd, events.data(), events.size(), -1);
+
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				throw XenEvtchnReactorException("Can't wait for event channels: " +
+												string(strerror(errno)));
+			}
+
+			for (int i = 0; i < ret; i++)
+			{
+				if (events[i].data.u32 == mHandles.size())
+				{
+					mWakeup.clear();
+				}
+				else
+				{
+					handleEvent(mHandles[events[i].data.u32].handle);
+				}
+			}
+		}
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
+void XenEvtchnReactor::handleEvent(xenevtchn_handle* handle)
+{
+	// One port per wake up: epoll is level triggered
+	auto port = xenevtchn_pending(handle);
+
+	if (port < 0)
+	{
+		throw XenEvtchnReactorException("Can't get pending port");
+	}
+
+	if (xenevtchn_unmask(handle, port) < 0)
+	{
+		throw XenEvtchnReactorException("Can't unmask event channel");
+	}
+
+	DLOG(mLog, DEBUG) << "Event received, port: " << port;
+
+	dispatch(port);
+}
+
+void XenEvtchnReactor::dispatch(int port)
+{
+	Callback callback;
+	ErrorCallback errorCallback;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		if (static_cast<size_t>(port) >= mChannels.size() || !mChannels[port].active)
+		{
+			DLOG(mLog, DEBUG) << "Event on not served port: " << port;
+
+			return;
+		}
+
+		auto& channel = mChannels[port];
+
+		// The callbacks are called without the lock: other channels are bound
+		// and unbound meanwhile, unbind() of this channel waits for the flag
+		callback = channel.callback;
+		errorCallback = channel.errorCallback;
+		channel.inUse = true;
+	}
+
+	bool failed = false;
+
+	try
+	{
+		if (callback)
+		{
+			callback();
+		}
+	}
+	catch(const exception& e)
+	{
+		failed = true;
+
+		if (errorCallback)
+		{
+			errorCallback(e);
+		}
+		else
+		{
+			LOG(mLog, ERROR) << e.what();
+		}
+	}
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		auto& channel = mChannels[port];
+
+		// The channel is not served anymore as a dedicated thread would exit
+		if (failed && channel.handle)
+		{
+			channel.active = false;
+		}
+
+		channel.inUse = false;
+	}
+
+	mCallbackDone.notify_all();
+}
+
+}
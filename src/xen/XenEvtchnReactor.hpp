@@ -0,0 +1,155 @@
+/*
+ *  Xen evtchn reactor
+ *  Copyright (c) 2016, Oleksandr Grytsov
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#ifndef SRC_XEN_XENEVTCHNREACTOR_HPP_
+#define SRC_XEN_XENEVTCHNREACTOR_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <xenevtchn.h>
+}
+
+#include "EventFd.hpp"
+#include "XenException.hpp"
+#include "Log.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by XenEvtchnReactor
+ * @ingroup Xen
+ ******************************************************************************/
+class XenEvtchnReactorException : public XenException
+{
+	using XenException::XenException;
+};
+
+/***************************************************************************//**
+ * Serves many event channels by one thread.
+ * The ports are bound to a fixed pool of evtchn handles, the least loaded
+ * handle is used for a new port. One thread waits for all handles with epoll
+ * and dispatches the pending ports through the table indexed by the local
+ * port. Callbacks are called from the reactor thread one by one without the
+ * reactor lock held, so a blocking callback delays the other channels but
+ * not bind() and unbind(). unbind() waits only for the callback of its own
+ * channel.
+ * @ingroup Xen
+ ******************************************************************************/
+class XenEvtchnReactor
+{
+public:
+	typedef std::function<void()> Callback;
+	typedef std::function<void(const std::exception&)> ErrorCallback;
+
+	/**
+	 * @param[in] numHandles number of evtchn handles
+	 */
+	explicit XenEvtchnReactor(size_t numHandles);
+	XenEvtchnReactor(const XenEvtchnReactor&) = delete;
+	XenEvtchnReactor& operator=(XenEvtchnReactor const&) = delete;
+	~XenEvtchnReactor();
+
+	/**
+	 * Returns the reactor. The reactor is created on the first request and
+	 * destroyed when the last reference is released.
+	 */
+	static std::shared_ptr<XenEvtchnReactor> getInstance();
+
+	/**
+	 * Sets number of evtchn handles of new reactors, 0 - disable the reactor
+	 */
+	static void setNumHandles(size_t numHandles) { sNumHandles = numHandles; }
+
+	/**
+	 * Returns number of evtchn handles of new reactors
+	 */
+	static size_t getNumHandles() { return sNumHandles; }
+
+	/**
+	 * Binds the event channel.
+	 * @param[in]  domId         domain id
+	 * @param[in]  port          remote port
+	 * @param[in]  callback      callback which is called when the notification
+	 *                           is received
+	 * @param[in]  errorCallback callback which is called when the callback
+	 *                           throws, the channel is not served after that
+	 * @param[out] handle        handle the port is bound to, used for notify
+	 * @return local port
+	 */
+	int bind(int domId, int port, Callback callback, ErrorCallback errorCallback,
+			 xenevtchn_handle*& handle);
+
+	/**
+	 * Unbinds the event channel.
+	 * @param[in] port local port
+	 */
+	void unbind(int port);
+
+private:
+
+	struct Channel
+	{
+		xenevtchn_handle* handle;
+		Callback callback;
+		ErrorCallback errorCallback;
+		bool active;
+		bool inUse;
+	};
+
+	struct Handle
+	{
+		xenevtchn_handle* handle;
+		size_t numPorts;
+	};
+
+	static std::mutex sInstanceMutex;
+	static std::weak_ptr<XenEvtchnReactor> sInstance;
+	static std::atomic<size_t> sNumHandles;
+
+	std::vector<Handle> mHandles;
+	std::vector<Channel> mChannels;
+	std::mutex mMutex;
+	std::condition_variable mCallbackDone;
+
+	int mEpollFd;
+	EventFd mWakeup;
+
+	std::thread mThread;
+	std::atomic_bool mTerminate;
+
+	Log mLog;
+
+	void init(size_t numHandles);
+	void release();
+	void reactorThread();
+	void handleEvent(xenevtchn_handle* handle);
+	void dispatch(int port);
+};
+
+}
+
+#endif /* SRC_XEN_XENEVTCHNREACTOR_HPP_ */
@@ -20,6 +20,24 @@
 
 #include "XenGnttab.hpp"
 
+#include <algorithm>
+#include <iterator>
+
+using std::atomic;
+using std::list;
+using std::lock_guard;
+using std::make_shared;
+using std::map;
+using std::min;
+using std::move;
+using std::mutex;
+using std::prev;
+using std::shared_ptr;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using std::weak_ptr;
+
 namespace XenBackend {
 
 XenGnttab::XenGnttab()
@@ -40,6 +58,13 @@ XenGnttab::~XenGnttab()
 	}
 }
 
+XenGnttab& XenGnttab::getInstance()
+{
+	static XenGnttab gnttab;
+
+	return gnttab;
+}
+
 XenGnttabBuffer::XenGnttabBuffer(int domId, uint32_t ref, int prot) :
 		XenGnttabBuffer(domId, &ref, 1, prot)
 {
@@ -61,9 +86,7 @@ XenGnttabBuffer::~XenGnttabBuffer()
 
 void XenGnttabBuffer::init(const uint32_t* refs, size_t count, int prot)
 {
-	static XenGnttab gnttab;
-
-	mHandle = gnttab.getHandle();
+	mHandle = XenGnttab::getInstance().getHandle();
 	mBuffer = nullptr;
 	mCount = count;
 
@@ -91,5 +114,279 @@ void XenGnttabBuffer::release()
 	}
 }
 
+/*******************************************************************************
+ * XenGnttabCopy
+ ******************************************************************************/
+
+XenGnttabCopy::XenGnttabCopy(int domId) :
+	mHandle(XenGnttab::getInstance().getHandle()),
+	mDomId(domId),
+	mLog("XenGnttabCopy")
+{
+}
+
+void XenGnttabCopy::addFromRef(uint32_t ref, size_t offset, void* dst, size_t len)
+{
+	xengnttab_grant_copy_segment_t segment {};
+
+	segment.source.foreign.ref = ref;
+	segment.source.foreign.offset = offset;
+	segment.source.foreign.domid = mDomId;
+	segment.dest.virt = dst;
+	segment.len = len;
+	segment.flags = GNTCOPY_source_gref;
+
+	mSegments.push_back(segment);
+}
+
+void XenGnttabCopy::addToRef(uint32_t ref, size_t offset, const void* src, size_t len)
+{
+	xengnttab_grant_copy_segment_t segment {};
+
+	segment.source.virt = const_cast<void*>(src);
+	segment.dest.foreign.ref = ref;
+	segment.dest.foreign.offset = offset;
+	segment.dest.foreign.domid = mDomId;
+	segment.len = len;
+	segment.flags = GNTCOPY_dest_gref;
+
+	mSegments.push_back(segment);
+}
+
+void XenGnttabCopy::addFromRefs(const uint32_t* refs, size_t count, size_t offset,
+								void* dst, size_t len)
+{
+	addRange(refs, count, offset, static_cast<uint8_t*>(dst), len, false);
+}
+
+void XenGnttabCopy::addToRefs(const uint32_t* refs, size_t count, size_t offset,
+							  const void* src, size_t len)
+{
+	addRange(refs, count, offset, static_cast<uint8_t*>(const_cast<void*>(src)),
+			 len, true);
 }
 
+void XenGnttabCopy::addRange(const uint32_t* refs, size_t count, size_t offset,
+							 uint8_t* local, size_t len, bool toRefs)
+{
+	if (offset + len > count * XC_PAGE_SIZE)
+	{
+		throw XenGnttabException("Copy range exceeds buffer, offset: " +
+								 to_string(offset) + ", len: " + to_string(len));
+	}
+
+	while(len)
+	{
+		auto pageOffset = offset % XC_PAGE_SIZE;
+		auto chunk = min<size_t>(len, XC_PAGE_SIZE - pageOffset);
+
+		if (toRefs)
+		{
+			addToRef(refs[offset / XC_PAGE_SIZE], pageOffset, local, chunk);
+		}
+		else
+		{
+			addFromRef(refs[offset / XC_PAGE_SIZE], pageOffset, local, chunk);
+		}
+
+		offset += chunk;
+		local += chunk;
+		len -= chunk;
+	}
+}
+
+void XenGnttabCopy::execute()
+{
+	if (mSegments.empty())
+	{
+		return;
+	}
+
+	DLOG(mLog, DEBUG) << "Grant copy, dom: " << mDomId << ", segments: " << mSegments.size();
+
+	auto ret = xengnttab_grant_copy(mHandle, mSegments.size(), mSegments.data());
+
+	for (auto& segment : mSegments)
+	{
+		if (ret == 0 && segment.status != GNTST_okay)
+		{
+			ret = segment.status;
+		}
+	}
+
+	mSegments.clear();
+
+	if (ret != 0)
+	{
+		throw XenGnttabException("Can't copy grant, error: " + to_string(ret));
+	}
+}
+
+/*******************************************************************************
+ * XenGnttabCache
+ ******************************************************************************/
+
+mutex XenGnttabCache::sInstanceMutex;
+map<int, weak_ptr<XenGnttabCache>> XenGnttabCache::sInstances;
+atomic<size_t> XenGnttabCache::sMaxIdle(0);
+
+XenGnttabCache::XenGnttabCache(int domId, size_t maxIdle) :
+	mDomId(domId),
+	mMaxIdle(maxIdle),
+	mGeneration(0),
+	mHits(0),
+	mMisses(0),
+	mLog("XenGnttabCache")
+{
+	LOG(mLog, DEBUG) << "Create grant table cache, dom: " << mDomId
+					 << ", max idle: " << mMaxIdle;
+}
+
+XenGnttabCache::~XenGnttabCache()
+{
+	LOG(mLog, INFO) << "Delete grant table cache, dom: " << mDomId
+					<< ", hits: " << mHits << ", misses: " << mMisses;
+}
+
+shared_ptr<XenGnttabCache> XenGnttabCache::getInstance(int domId)
+{
+	if (sMaxIdle == 0)
+	{
+		return nullptr;
+	}
+
+	lock_guard<mutex> lock(sInstanceMutex);
+
+	auto cache = sInstances[domId].lock();
+
+	if (!cache)
+	{
+		cache.reset(new XenGnttabCache(domId, sMaxIdle));
+
+		sInstances[domId] = cache;
+	}
+
+	return cache;
+}
+
+void XenGnttabCache::invalidate(int domId)
+{
+	shared_ptr<XenGnttabCache> cache;
+
+	{
+		lock_guard<mutex> lock(sInstanceMutex);
+
+		auto it = sInstances.find(domId);
+
+		if (it == sInstances.end())
+		{
+			return;
+		}
+
+		cache = it->second.lock();
+
+		if (!cache)
+		{
+			sInstances.erase(it);
+
+			return;
+		}
+	}
+
+	cache->invalidate();
+}
+
+shared_ptr<XenGnttabBuffer> XenGnttabCache::map(uint32_t directory,
+												const vector<uint32_t>& refs,
+												int prot)
+{
+	Entry entry { directory, refs, prot, nullptr };
+	uint64_t generation;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		generation = mGeneration;
+
+		for (auto it = mIdle.begin(); it != mIdle.end(); ++it)
+		{
+			if (it->directory == directory && it->prot == prot && it->refs == refs)
+			{
+				entry.buffer = move(it->buffer);
+
+				mIdle.erase(it);
+
+				break;
+			}
+		}
+	}
+
+	if (entry.buffer)
+	{
+		mHits++;
+	}
+	else
+	{
+		mMisses++;
+
+		entry.buffer.reset(new XenGnttabBuffer(mDomId, refs.data(), refs.size(), prot));
+	}
+
+	DLOG(mLog, DEBUG) << "Map buffer, dom: " << mDomId << ", directory: "
+					  << directory << ", hits: " << mHits << ", misses: " << mMisses;
+
+	auto buffer = entry.buffer.get();
+
+	// The deleter owns the entry and returns it to the cache if it still exists
+	auto holder = make_shared<Entry>(move(entry));
+	weak_ptr<XenGnttabCache> cache = shared_from_this();
+
+	return shared_ptr<XenGnttabBuffer>(buffer, [holder, cache, generation] (XenGnttabBuffer*)
+	{
+		if (auto owner = cache.lock())
+		{
+			owner->put(move(*holder), generation);
+		}
+	});
+}
+
+void XenGnttabCache::invalidate()
+{
+	list<Entry> idle;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mGeneration++;
+
+		idle.swap(mIdle);
+	}
+
+	LOG(mLog, INFO) << "Invalidate grant table cache, dom: " << mDomId
+					<< ", unmapped: " << idle.size() << ", hits: " << mHits
+					<< ", misses: " << mMisses;
+}
+
+void XenGnttabCache::put(Entry entry, uint64_t generation)
+{
+	list<Entry> evicted;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		// Mapped before invalidation, unmapped when the entry goes out of scope
+		if (generation != mGeneration)
+		{
+			return;
+		}
+
+		mIdle.push_front(move(entry));
+
+		while (mIdle.size() > mMaxIdle)
+		{
+			evicted.splice(evicted.end(), mIdle, prev(mIdle.end()));
+		}
+	}
+}
+
+}
@@ -21,6 +21,14 @@
 #ifndef SRC_XEN_XENGNTTAB_HPP_
 #define SRC_XEN_XENGNTTAB_HPP_
 
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include <sys/mman.h>
 
 extern "C" {
@@ -50,6 +58,7 @@ class XenGnttab
 {
 private:
 	friend class XenGnttabBuffer;
+	friend class XenGnttabCopy;
 
 	XenGnttab();
 	XenGnttab(const XenGnttab&) = delete;
@@ -62,6 +71,11 @@ private:
 	 */
 	xengnttab_handle* getHandle() const { return mHandle; }
 
+	/**
+	 * Returns the instance shared by all buffers
+	 */
+	static XenGnttab& getInstance();
+
 	xengnttab_handle* mHandle;
 };
 
@@ -113,6 +127,175 @@ private:
 	void release();
 };
 
+/***************************************************************************//**
+ * Copies data between local memory and granted pages without mapping them.
+ * The copies are queued and performed by one grant copy call. A copy
+ * segment must not cross the granted page boundary.
+ * @ingroup Xen
+ ******************************************************************************/
+class XenGnttabCopy
+{
+public:
+
+	/**
+	 * @param[in] domId domain id
+	 */
+	explicit XenGnttabCopy(int domId);
+	XenGnttabCopy(const XenGnttabCopy&) = delete;
+	XenGnttabCopy& operator=(XenGnttabCopy const&) = delete;
+
+	/**
+	 * Queues copying from the granted page
+	 * @param[in] ref    grant reference id
+	 * @param[in] offset offset in the page
+	 * @param[in] dst    local buffer
+	 * @param[in] len    number of bytes
+	 */
+	void addFromRef(uint32_t ref, size_t offset, void* dst, size_t len);
+
+	/**
+	 * Queues copying to the granted page
+	 * @param[in] ref    grant reference id
+	 * @param[in] offset offset in the page
+	 * @param[in] src    local buffer
+	 * @param[in] len    number of bytes
+	 */
+	void addToRef(uint32_t ref, size_t offset, const void* src, size_t len);
+
+	/**
+	 * Queues copying from the buffer granted by pages, the range is split
+	 * at the page boundaries
+	 * @param[in] refs   grant reference ids of the buffer pages
+	 * @param[in] count  number of grant reference ids
+	 * @param[in] offset offset in the buffer
+	 * @param[in] dst    local buffer
+	 * @param[in] len    number of bytes
+	 */
+	void addFromRefs(const uint32_t* refs, size_t count, size_t offset,
+					 void* dst, size_t len);
+
+	/**
+	 * Queues copying to the buffer granted by pages, the range is split at
+	 * the page boundaries
+	 * @param[in] refs   grant reference ids of the buffer pages
+	 * @param[in] count  number of grant reference ids
+	 * @param[in] offset offset in the buffer
+	 * @param[in] src    local buffer
+	 * @param[in] len    number of bytes
+	 */
+	void addToRefs(const uint32_t* refs, size_t count, size_t offset,
+				   const void* src, size_t len);
+
+	/**
+	 * Performs and clears the queued copies
+	 */
+	void execute();
+
+private:
+	xengnttab_handle* mHandle;
+	int mDomId;
+	std::vector<xengnttab_grant_copy_segment_t> mSegments;
+	Log mLog;
+
+	void addRange(const uint32_t* refs, size_t count, size_t offset,
+				  uint8_t* local, size_t len, bool toRefs);
+};
+
+/***************************************************************************//**
+ * Keeps the buffers of one domain mapped after they are released.
+ * A buffer mapped again with the same directory and refs is taken from the
+ * cache instead of being mapped by the hypervisor. The least recently
+ * released buffers are unmapped when the cache is full. The cache must be
+ * invalidated when the frontend disconnects: the released buffers are
+ * unmapped and the buffers in use are unmapped on release.
+ * @ingroup Xen
+ ******************************************************************************/
+class XenGnttabCache : public std::enable_shared_from_this<XenGnttabCache>
+{
+public:
+
+	/**
+	 * @param[in] domId   domain id
+	 * @param[in] maxIdle maximal number of released buffers kept mapped
+	 */
+	XenGnttabCache(int domId, size_t maxIdle);
+	XenGnttabCache(const XenGnttabCache&) = delete;
+	XenGnttabCache& operator=(XenGnttabCache const&) = delete;
+	~XenGnttabCache();
+
+	/**
+	 * Returns the cache of the domain, nullptr if caching is disabled
+	 * @param[in] domId domain id
+	 */
+	static std::shared_ptr<XenGnttabCache> getInstance(int domId);
+
+	/**
+	 * Sets maximal number of released buffers kept mapped per domain,
+	 * 0 - disable caching
+	 */
+	static void setMaxIdle(size_t maxIdle) { sMaxIdle = maxIdle; }
+
+	/**
+	 * Unmaps the cached buffers of the domain
+	 * @param[in] domId domain id
+	 */
+	static void invalidate(int domId);
+
+	/**
+	 * Returns the buffer mapped from the refs. The buffer returns to the cache
+	 * when the last reference is released.
+	 * @param[in] directory first directory ref of the buffer
+	 * @param[in] refs      buffer refs
+	 * @param[in] prot      same flag as in mmap()
+	 */
+	std::shared_ptr<XenGnttabBuffer> map(uint32_t directory,
+										 const std::vector<uint32_t>& refs,
+										 int prot);
+
+	/**
+	 * Unmaps the cached buffers
+	 */
+	void invalidate();
+
+	/**
+	 * Returns number of buffers taken from the cache
+	 */
+	uint64_t getHits() const { return mHits; }
+
+	/**
+	 * Returns number of buffers mapped by the hypervisor
+	 */
+	uint64_t getMisses() const { return mMisses; }
+
+private:
+
+	struct Entry
+	{
+		uint32_t directory;
+		std::vector<uint32_t> refs;
+		int prot;
+		std::unique_ptr<XenGnttabBuffer> buffer;
+	};
+
+	static std::mutex sInstanceMutex;
+	static std::map<int, std::weak_ptr<XenGnttabCache>> sInstances;
+	static std::atomic<size_t> sMaxIdle;
+
+	int mDomId;
+	size_t mMaxIdle;
+
+	std::mutex mMutex;
+	std::list<Entry> mIdle;
+	uint64_t mGeneration;
+
+	std::atomic<uint64_t> mHits;
+	std::atomic<uint64_t> mMisses;
+
+	Log mLog;
+
+	void put(Entry entry, uint64_t generation);
+};
+
 }
 
 #endif /* SRC_XEN_XENGNTTAB_HPP_ */
@@ -21,6 +21,8 @@
 
 #include <poll.h>
 
+#include "ThreadPolicy.hpp"
+
 using std::exception;
 using std::lock_guard;
 using std::mutex;
@@ -208,6 +210,8 @@ void XenStore::clearWatch(const string& path)
 		mWatches.erase(path);
 	}
 
+	mWatchesChanged.signal();
+
 	if (mWatches.empty())
 	{
 		waitWatchesThreadFinished();
@@ -273,16 +277,21 @@ string XenStore::checkXsWatch()
 
 bool XenStore::pollXsWatchFd()
 {
-	pollfd fds = { .fd = xs_fileno(mXsHandle), .events = POLLIN};
-
-	auto ret = poll(&fds, 1, cPollWatchesTimeoutMs);
+	pollfd fds[] = {{ .fd = xs_fileno(mXsHandle), .events = POLLIN, .revents = 0 },
+					{ .fd = mWatchesChanged.getFd(), .events = POLLIN, .revents = 0 }};
 
-	if (ret < 0)
+	if (poll(fds, 2, -1) < 0)
 	{
 		throw XenStoreException("Can't poll watches");
 	}
 
-	if (ret > 0)
+	// Woken up to recheck the watches list
+	if (fds[1].revents)
+	{
+		mWatchesChanged.clear();
+	}
+
+	if (fds[0].revents)
 	{
 		return true;
 	}
@@ -292,6 +301,8 @@ bool XenStore::pollXsWatchFd()
 
 void XenStore::watchesThread()
 {
+	ThreadPolicy::apply(ThreadPolicy::Group::CONTROL);
+
 	try
 	{
 		while(!isWatchesEmpty())
@@ -385,9 +396,13 @@ void XenStore::clearWatches()
 		xs_unwatch(mXsHandle, watch.first.c_str(), "");
 	}
 
-	lock_guard<mutex> lock(mMutex);
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mWatches.clear();
+	}
 
-	mWatches.clear();
+	mWatchesChanged.signal();
 }
 
 void XenStore::waitWatchesThreadFinished()
@@ -34,6 +34,7 @@ extern "C" {
 #include <xenstore.h>
 }
 
+#include "EventFd.hpp"
 #include "XenException.hpp"
 #include "Log.hpp"
 
@@ -131,8 +132,6 @@ public:
 	void clearWatch(const std::string& path);
 
 private:
-	const int cPollWatchesTimeoutMs = 100;
-
 	WatchErrorCallback mErrorCallback;
 
 	xs_handle*	mXsHandle;
@@ -141,6 +140,7 @@ private:
 	std::list<std::string> mInitNotifyWatches;
 
 	std::thread mThread;
+	EventFd mWatchesChanged;
 	std::mutex mMutex;
 	std::mutex mItfMutex;
 	bool mCheckWatchResult;